@@ -83,6 +83,8 @@ _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t
 		skynet_error(context, "lua error in error : [%x to %s : %d]", source , self, session);
 		break;
 	};
+	// keep the records to the error if it's a flight recorder
+	skynet_command(context, "RECORDDUMP", "error");
 
 	lua_pop(L,1);
 
@@ -198,10 +200,16 @@ lintcommand(lua_State *L) {
 	const char * parm = NULL;
 	char tmp[64];	// for integer parm
 	if (lua_gettop(L) == 2) {
-		if (lua_isnumber(L, 2)) {
-			int32_t n = (int32_t)luaL_checkinteger(L,2);
+		int isint;
+		lua_Integer i = lua_tointegerx(L, 2, &isint);
+		if (isint) {
+			int32_t n = (int32_t)i;
 			sprintf(tmp, "%d", n);
 			parm = tmp;
+		} else if (lua_isnumber(L, 2)) {
+			// fractional number, such as timeout 0.5 (5ms), keep all the digits so a tiny timeout isn't 0
+			snprintf(tmp, sizeof(tmp), "%.17g", lua_tonumber(L, 2));
+			parm = tmp;
 		} else {
 			parm = luaL_checkstring(L,2);
 		}
@@ -424,6 +432,13 @@ lnow(lua_State *L) {
 	return 1;
 }
 
+static int
+lnow_ms(lua_State *L) {
+	uint64_t ti = skynet_now_ms();
+	lua_pushinteger(L, ti);
+	return 1;
+}
+
 static int
 lhpc(lua_State *L) {
 	lua_pushinteger(L, get_time());
@@ -433,12 +448,20 @@ lhpc(lua_State *L) {
 static int
 lfast_time(lua_State *L) {
 	uint64_t time = luaL_checkinteger(L,1);
-	uint32_t once_add = luaL_checkinteger(L,2);
+	uint32_t once_add = luaL_optinteger(L,2,0);
  	time = skynet_fast_time(time,once_add);
 	lua_pushinteger(L,time);
 	return 1;
 }
 
+static int
+lreplay(lua_State *L) {
+	const char * cmd = luaL_checkstring(L,1);
+	double arg = luaL_optnumber(L,2,0);
+	lua_pushboolean(L, skynet_replay_control(cmd, arg) == 0);
+	return 1;
+}
+
 #define MAX_LEVEL 3
 
 struct source_info {
@@ -542,7 +565,7 @@ lrecordsetrandomseed(lua_State *L) {
 	int64_t x = luaL_checkinteger(L, 1);
 	int64_t y = luaL_checkinteger(L, 2);
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
-	FILE *rf = skynet_context_recordfile(context);
+	struct record_file *rf = skynet_context_recordfile(context);
 	if (rf) {
 		skynet_record_randseed(context, rf, x, y);
 	}
@@ -560,7 +583,7 @@ static int
 lrecordsetostime(lua_State *L) {
 	uint32_t ostime = luaL_checkinteger(L, 1);
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
-	FILE *rf = skynet_context_recordfile(context);
+	struct record_file *rf = skynet_context_recordfile(context);
 	if (rf) {
 		skynet_record_ostime(context, rf, ostime);
 	}
@@ -569,7 +592,7 @@ lrecordsetostime(lua_State *L) {
 
 static int
 lrecordgetnowtime(lua_State *L) {
-	int64_t nowtime = skynet_record_pop_nowtime();
+	int64_t nowtime = skynet_record_pop_nowtime(lua_toboolean(L, 1));
 	lua_pushinteger(L, nowtime);
 	return 1;
 }
@@ -578,9 +601,21 @@ static int
 lrecordsetnowtime(lua_State *L) {
 	int64_t now = luaL_checkinteger(L, 1);
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
-	FILE *rf = skynet_context_recordfile(context);
+	struct record_file *rf = skynet_context_recordfile(context);
 	if (rf) {
-		skynet_record_nowtime(context, rf, now);
+		skynet_record_nowtime(context, rf, now, lua_toboolean(L, 2));
+	}
+	return 0;
+}
+
+static int
+lrecordcheckpoint(lua_State *L) {
+	size_t sz;
+	const char * snapshot = luaL_checklstring(L, 1, &sz);
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	struct record_file *rf = skynet_context_recordfile(context);
+	if (rf) {
+		skynet_record_checkpoint(context, rf, snapshot, sz);
 	}
 	return 0;
 }
@@ -592,6 +627,13 @@ lgetrecordhandle(lua_State *L) {
 	return 1;
 }
 
+static int
+lisrecordhandle(lua_State *L) {
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 1);
+	lua_pushboolean(L, skynet_is_record_handle(handle));
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_skynet_core(lua_State *L) {
 	luaL_checkversion(L);
@@ -616,7 +658,9 @@ luaopen_skynet_core(lua_State *L) {
 		{ "recordsetostime", lrecordsetostime },
 		{ "recordgetnowtime", lrecordgetnowtime },
 		{ "recordsetnowtime", lrecordsetnowtime },
+		{ "recordcheckpoint", lrecordcheckpoint },
 		{ "getrecordhandle", lgetrecordhandle },
+		{ "isrecordhandle", lisrecordhandle },
 		{ NULL, NULL },
 	};
 
@@ -628,8 +672,10 @@ luaopen_skynet_core(lua_State *L) {
 		{ "packstring", lpackstring },
 		{ "trash" , ltrash },
 		{ "now", lnow },
+		{ "now_ms", lnow_ms },
 		{ "hpc", lhpc },	// getHPCounter
 		{ "fast_time", lfast_time},
+		{ "replay", lreplay },
 		{ NULL, NULL },
 	};
 
@@ -458,7 +458,7 @@ lconnect(lua_State *L) {
 	char tmp[sz];
 	int port = 0;
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	FILE* rf = skynet_context_recordfile(ctx);
+	struct record_file *rf = skynet_context_recordfile(ctx);
 	const char * host = address_port(L, tmp, addr, 2, &port);
 	if (port == 0) {
 		if (rf) {
@@ -504,7 +504,7 @@ llisten(lua_State *L) {
 	}
 	int backlog = luaL_optinteger(L,3,BACKLOG);
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	FILE* rf = skynet_context_recordfile(ctx);
+	struct record_file *rf = skynet_context_recordfile(ctx);
 	int id = skynet_socket_listen(ctx, host,port,backlog);
 	if (id < 0) {
 		if (rf) {
@@ -633,7 +633,7 @@ lbind(lua_State *L) {
 	int id = skynet_socket_bind(ctx,fd);
 	lua_pushinteger(L,id);
 
-	FILE* rf = skynet_context_recordfile(ctx);
+	struct record_file *rf = skynet_context_recordfile(ctx);
 	if (rf) {
 		skynet_record_socketid(ctx, rf, id);
 	}
@@ -676,7 +676,7 @@ ludp(lua_State *L) {
 		host = address_port(L, tmp, addr, 2, &port);
 	}
 
-	FILE* rf = skynet_context_recordfile(ctx);
+	struct record_file *rf = skynet_context_recordfile(ctx);
 	int id = skynet_socket_udp(ctx, host, port);
 	if (id < 0) {
 		if (rf) {
@@ -720,7 +720,7 @@ ludp_dial(lua_State *L){
 	char tmp[sz];
 	int port = 0;
 	const char * host =  address_port(L, tmp, addr, 2, &port);
-	FILE* rf = skynet_context_recordfile(ctx);
+	struct record_file *rf = skynet_context_recordfile(ctx);
 	int id = skynet_socket_udp_dial(ctx, host, port);
 	if (id < 0){
 		skynet_record_socketid(ctx, rf, -1);
@@ -744,7 +744,7 @@ ludp_listen(lua_State *L){
 
 	int port = 0;
 	const char * host = address_port(L, tmp, addr, 2, &port);
-	FILE* rf = skynet_context_recordfile(ctx);
+	struct record_file *rf = skynet_context_recordfile(ctx);
 	int id = skynet_socket_udp_listen(ctx, host, port);
 	if (id < 0){
 		if (rf) {
@@ -16,7 +16,8 @@ local g_is_trace = tonumber(c.command("GETENV", "trace")) == 1
 local g_is_luatrace = tonumber(c.command("GETENV", "luatrace")) == 1
 local g_recordfile = c.command("GETENV","recordfile")
 
-if g_recordfile ~= "" and c.addresscommand "REG" > 1 then
+-- only the services replayed are stubbed, the others (recordconsole) run as usual
+if g_recordfile ~= "" and c.addresscommand "REG" > 1 and c.isrecordhandle(c.addresscommand "REG") then
 	local record_pre = require "skynet.record_pre"
 	record_pre.skynet()
 end
@@ -53,6 +54,7 @@ local skynet = {
 	PTYPE_LUA = 10,
 	PTYPE_SNAX = 11,
 	PTYPE_TRACE = 12,	-- use for debug trace
+	PTYPE_RECORD = 13,	-- checkpoint snapshot when replay seeks
 }
 
 -- code cache
@@ -79,6 +81,7 @@ local g_is_send = false
 
 local wakeup_queue = {}
 local sleep_session = {}
+local timeout_session = setmetatable({}, { __mode = "k" })
 
 local watching_session = {}
 local error_queue = {}
@@ -204,6 +207,15 @@ do ---- avoid session rewind conflict
 	set_checkrewind()
 end
 
+-- remove the timer of the session, or ignore the response when it's already on the way
+local function break_timeout(session)
+	if c.intcommand("TIMEOUTCANCEL", session) == 1 then
+		session_id_coroutine[session] = nil
+	else
+		session_id_coroutine[session] = "BREAK"
+	end
+end
+
 do ---- request/select
 	local function send_requests(self)
 		local sessions = {}
@@ -314,7 +326,7 @@ do ---- request/select
 			self._request = 0
 		end
 		if self._timeout then
-			session_id_coroutine[self._timeout] = "BREAK"
+			break_timeout(self._timeout)
 			self._timeout = nil
 		end
 	end
@@ -456,7 +468,7 @@ local function dispatch_wakeup()
 				if g_is_trace and trace_tag then
 					skynet.trace_log(trace_tag, 'resume')
 				end
-				session_id_coroutine[session] = "BREAK"
+				break_timeout(session)
 				return suspend(co, coroutine_resume(co, false, "BREAK", nil, session))
 			end
 		else
@@ -539,6 +551,7 @@ function skynet.timeout(ti, func)
 	local co = co_create_for_timeout(func, ti)
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
+	timeout_session[co] = session
 	local trace_tag = session_coroutine_luatrace[co] or (g_is_luatrace and skynet.create_lua_trace())
 	if trace_tag then
 		session_coroutine_luatrace[co] = trace_tag
@@ -546,7 +559,21 @@ function skynet.timeout(ti, func)
 			skynet.trace_log(trace_tag, 'timeout', nil, 5)
 		end
 	end
-	return co	-- for debug
+	-- the handle of skynet.timeout_cancel is the session, not the coroutine :
+	-- the coroutine goes back to the pool after the timer expired, and may run another timer.
+	return session
+end
+
+function skynet.timeout_cancel(session)
+	local co = session_id_coroutine[session]
+	-- the timer is not expired (or canceled) yet
+	if co and timeout_session[co] == session then
+		timeout_session[co] = nil
+		session_coroutine_luatrace[co] = nil
+		break_timeout(session)
+		return true
+	end
+	return false
 end
 
 local function suspend_sleep(session, token)
@@ -670,6 +697,51 @@ function skynet.recordstart(str)
 	c.command("RECORDSTART", str)
 end
 
+-- write the records kept by the flight recorder (recordflight) to the record file now
+function skynet.record_dump()
+	c.command("RECORDDUMP")
+end
+
+-- save() returns a string snapshot of the service state, restore(snapshot) rebuilds it.
+-- A checkpoint is written every interval (centisecond) while recording,
+-- and replay with recordseek can start from the nearest one.
+-- restore should arm the pending timeouts in the order they were created,
+-- they get the same sessions as in the record.
+function skynet.record_checkpoint(save, restore, interval)
+	interval = interval or 6000
+	local function checkpoint()
+		local sessions = {}
+		for session, co in pairs(session_id_coroutine) do
+			if timeout_session[co] == session then
+				sessions[#sessions+1] = session
+			end
+		end
+		table.sort(sessions)
+		c.recordcheckpoint(skynet.packstring(sessions, save()))
+		skynet.timeout(interval, checkpoint)
+	end
+	if g_recordfile ~= "" then
+		skynet.register_protocol {
+			name = "record",
+			id = skynet.PTYPE_RECORD,
+			unpack = skynet.unpack,
+			dispatch = function(_, _, sessions, snapshot)
+				local aux = auxtimeout
+				local n = 0
+				auxtimeout = function(ti)
+					n = n + 1
+					return sessions[n] or aux(ti)
+				end
+				local ok, err = pcall(restore, snapshot)
+				auxtimeout = aux
+				assert(ok, err)
+				skynet.timeout(interval, checkpoint)
+			end,
+		}
+	end
+	skynet.timeout(interval, checkpoint)
+end
+
 local g_record_handle
 function skynet.get_record_handle()
 	if not g_record_handle then
@@ -681,8 +753,7 @@ end
 function skynet.is_record_handle()
 	local shandle = skynet.self()
 	if shandle <= 0 then return false end
-	local rhandle = skynet.get_record_handle()
-	return shandle == rhandle
+	return c.isrecordhandle(shandle)
 end
 
 local g_write_record = false
@@ -695,6 +766,7 @@ function skynet.localname(name)
 end
 
 skynet.now = c.now
+skynet.now_ms = c.now_ms	-- millisecond, precise when timerresolution = 1000
 skynet.hpc = c.hpc	-- high performance counter
 
 local traceid = 0
@@ -729,7 +801,7 @@ function skynet.starttime()
 end
 
 function skynet.time()
-	return skynet.now()/100 + (starttime or skynet.starttime())
+	return skynet.now_ms()/1000 + (starttime or skynet.starttime())
 end
 
 function skynet.exit()
@@ -1211,10 +1283,11 @@ end
 
 function skynet.start(start_func)
 	c.callback(skynet.dispatch_message)
-	init_thread = skynet.timeout(0, function()
+	local session = skynet.timeout(0, function()
 		skynet.init_service(start_func)
 		init_thread = nil
 	end)
+	init_thread = session_id_coroutine[session]
 end
 
 function skynet.endless()
@@ -1313,10 +1386,15 @@ function skynet.memlimit(bytes)
 	skynet.memlimit = nil	-- set only once
 end
 
-function skynet.start_record(ARGV, filename)
+-- group : the services recorded in the same group are replayed together,
+-- set recordfile to the directory of the group (recordpath/group) to replay them.
+function skynet.start_record(ARGV, filename, group)
 	--记录录像
 	if g_recordfile == "" then
 		g_write_record = true
+		if group then
+			filename = group .. "/" .. filename
+		end
 		skynet.recordon(filename)
 		skynet.recordstart(string.format("%08x", skynet.self()) .. SERVICE_NAME .. ' ' .. table.concat(ARGV, ' '))
 
@@ -1343,6 +1421,12 @@ function skynet.start_record(ARGV, filename)
 			c.recordsetnowtime(now)
 			return now
 		end
+
+		skynet.now_ms = function()
+			local now = c.now_ms()
+			c.recordsetnowtime(now, true)
+			return now
+		end
 	end
 	
 	--设置随机种子，以便录像播放时使用
@@ -0,0 +1,141 @@
+-- Decoder of the binary message log (logformat = "binary"), see skynet-src/skynet_log.c.
+-- The log uses the layout of the record file, so it reads the messages of the record files too.
+--
+--	local binlog = require "skynet.binlog"
+--	for msg in binlog.messages("./0000000a.blog", { source = 9, type = skynet.PTYPE_LUA }) do
+--		print(msg.source, msg.type, msg.session, msg.time, #msg.data)
+--	end
+--
+-- msg.tag is "m" for a message, or "a" for a socket message (msg.type is PTYPE_SOCKET, msg.socket
+-- is { type, id, ud }). The filter matches source, type and session, a function filter(msg) also works.
+--
+-- It's a standalone tool too, it prints the messages like the text log :
+--	3rd/lua/lua lualib/skynet/binlog.lua 0000000a.blog [source=:00000009] [type=1] [session=2]
+
+local binlog = {}
+
+local PTYPE_SOCKET = 6
+
+local HEADER_M = "=I4i4i4I8T"
+local HEADER_A = "=i4i4i4I8T"
+local HEADER_M_SIZE = string.packsize(HEADER_M)
+local HEADER_A_SIZE = string.packsize(HEADER_A)
+local SIZE_T = string.packsize "T"
+local VERSION_SIZE = 5	-- SKYNET_RECORD_VERSION
+
+-- the size of the side records of the record file, skipped
+local SKIP = {
+	o = 16, c = 8, q = 8, n = 8, r = 16,
+	s = 4, h = 4, k = 4, t = 4,
+}
+
+local function read(f, n)
+	if n == 0 then
+		return ""
+	end
+	local s = f:read(n)
+	if s == nil or #s < n then
+		error "truncated log"
+	end
+	return s
+end
+
+local function match(filter, msg)
+	if filter == nil then
+		return true
+	end
+	if type(filter) == "function" then
+		return filter(msg)
+	end
+	return (filter.source == nil or filter.source == msg.source)
+		and (filter.type == nil or filter.type == msg.type)
+		and (filter.session == nil or filter.session == msg.session)
+end
+
+-- iterate the messages of the log file
+function binlog.messages(filename, filter)
+	local f = assert(io.open(filename, "rb"))
+	local version = f:read(VERSION_SIZE)
+	if version == nil or not version:match "^%d%.%d%.%d$" then
+		f:close()
+		error(filename .. " is not a binary log")
+	end
+	local handle
+	local function next_message()
+		while true do
+			local tag = f:read(1)
+			if tag == nil or tag == "x" then
+				-- the index at the end of the record file
+				f:close()
+				return
+			end
+			local msg
+			if tag == "m" then
+				local source, type, session, time, sz = string.unpack(HEADER_M, read(f, HEADER_M_SIZE))
+				msg = { tag = tag, handle = handle, source = source, type = type, session = session, time = time }
+				msg.data = read(f, sz)
+			elseif tag == "a" then
+				local stype, id, ud, time, sz = string.unpack(HEADER_A, read(f, HEADER_A_SIZE))
+				msg = { tag = tag, handle = handle, source = 0, type = PTYPE_SOCKET, session = 0, time = time,
+					socket = { type = stype, id = id, ud = ud } }
+				msg.data = read(f, sz)
+			elseif tag == "b" then
+				local len = string.unpack("=T", read(f, SIZE_T))
+				handle = tonumber(read(f, len):sub(1, 8), 16)
+			elseif tag == "p" then
+				local _, sz = string.unpack("=I8T", read(f, 8 + SIZE_T))
+				f:seek("cur", sz)
+			elseif SKIP[tag] then
+				read(f, SKIP[tag])
+			else
+				local offset = f:seek() - 1
+				f:close()
+				error(string.format("Unknown record type %q at %d", tag, offset))
+			end
+			if msg and match(filter, msg) then
+				return msg
+			end
+		end
+	end
+	return next_message
+end
+
+local function hex(s)
+	return (s:gsub(".", function(c) return string.format("%02x", c:byte()) end))
+end
+
+-- the line of the text log
+function binlog.format(msg)
+	if msg.tag == "a" then
+		local s = msg.socket
+		return string.format("[socket] %d %d %d %s", s.type, s.id, s.ud, hex(msg.data))
+	end
+	return string.format(":%08x %d %d %d %s", msg.source, msg.type, msg.session, msg.time, hex(msg.data))
+end
+
+local function main(filename, ...)
+	if filename == nil then
+		print "Usage: lua binlog.lua filename [source=:00000009] [type=1] [session=2]"
+		return
+	end
+	local filter = {}
+	for i = 1, select("#", ...) do
+		local k, v = select(i, ...):match "^(%w+)=(.+)$"
+		assert(k == "source" or k == "type" or k == "session", "Invalid filter " .. select(i, ...))
+		if k == "source" and v:sub(1, 1) == ":" then
+			filter.source = tonumber(v:sub(2), 16)
+		else
+			filter[k] = math.tointeger(tonumber(v))
+		end
+	end
+	for msg in binlog.messages(filename, filter) do
+		print(binlog.format(msg))
+	end
+end
+
+local modname = ...
+if modname ~= "skynet.binlog" then
+	main(...)
+end
+
+return binlog
@@ -39,6 +39,7 @@ local function init(skynet, export)
 			local stat = {}
 			stat.task = skynet.task()
 			stat.mqlen = skynet.stat "mqlen"
+			stat.mqhigh = skynet.stat "mqhigh"
 			stat.cpu = skynet.stat "cpu"
 			stat.message = skynet.stat "message"
 			skynet.ret(skynet.pack(stat))
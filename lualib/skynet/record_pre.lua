@@ -17,8 +17,14 @@ function M.skynet()
     end
 
     local old_cintcommand = c.intcommand
+    local init_timeout = true
     c.intcommand = function(sub_cmd, ...)
         if sub_cmd == "TIMEOUT" then
+            if init_timeout then
+                --skynet.start 的 timeout 在 start_record 之前，录像里没有它
+                init_timeout = false
+                return old_cintcommand(sub_cmd, ...)
+            end
             return c.recordgenid()
         else
             return old_cintcommand(sub_cmd, ...)
@@ -110,6 +116,12 @@ function M.skynet()
         assert(now > 0, "record now err")    --录像记录不一致
         return now
     end
+
+    c.now_ms = function()
+        local now = c.recordgetnowtime(true)
+        assert(now > 0, "record now err")    --录像记录不一致
+        return now
+    end
 end
 
 return M
\ No newline at end of file
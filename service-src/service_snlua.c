@@ -24,12 +24,34 @@
 
 #define MEMORY_WARNING_REPORT (1024 * 1024 * 32)
 
+// small object allocator of lua state, turn on by luaslab = true in config
+#define SLAB_ALIGN 16
+#define SLAB_MAX 256
+#define SLAB_CLASS (SLAB_MAX / SLAB_ALIGN)
+#define SLAB_CHUNK (16 * 1024)
+
+struct slab_block {
+	struct slab_block * next;
+};
+
+// The blocks (<= SLAB_MAX) of all the size classes are carved from the current chunk, and freed to
+// the free list of their size class. The chunks are freed when the lua state closes, they are counted
+// in the memory of the lua state (and mem_limit) instead of the blocks.
+struct slab {
+	struct slab_block * freelist[SLAB_CLASS];
+	char * ptr;	// the rest of the current chunk
+	char * end;
+	void * chunk;	// the chunk list, linked by the first pointer of chunk
+	size_t chunk_count;
+};
+
 struct snlua {
 	lua_State * L;
 	struct skynet_context * ctx;
 	size_t mem;
 	size_t mem_report;
 	size_t mem_limit;
+	struct slab * slab;
 	lua_State * activeL;
 	ATOM_INT trap;
 };
@@ -480,24 +502,133 @@ snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
 	return 0;
 }
 
+static inline int
+slab_class(size_t sz) {
+	return (int)((sz + SLAB_ALIGN - 1) / SLAB_ALIGN) - 1;
+}
+
+static void * mem_realloc(struct snlua *l, void *ptr, size_t osize, size_t nsize, int grow);
+
+static inline void
+slab_free(struct slab *s, void *ptr, int c) {
+	struct slab_block *b = ptr;
+	b->next = s->freelist[c];
+	s->freelist[c] = b;
+}
+
 static void *
-lalloc(void * ud, void *ptr, size_t osize, size_t nsize) {
-	struct snlua *l = ud;
+slab_alloc(struct snlua *l, int c, int grow) {
+	struct slab *s = l->slab;
+	struct slab_block *b = s->freelist[c];
+	if (b) {
+		s->freelist[c] = b->next;
+		return b;
+	}
+	size_t sz = (size_t)(c + 1) * SLAB_ALIGN;
+	if ((size_t)(s->end - s->ptr) < sz) {
+		char * chunk = mem_realloc(l, NULL, 0, SLAB_CHUNK, grow);
+		if (chunk == NULL)
+			return NULL;
+		// the rest of the last chunk is smaller than sz, keep it in the free list of its size
+		size_t rest = (size_t)(s->end - s->ptr);
+		if (rest > 0) {
+			slab_free(s, s->ptr, slab_class(rest));
+		}
+		*(void **)chunk = s->chunk;
+		s->chunk = chunk;
+		++s->chunk_count;
+		// the first SLAB_ALIGN bytes is the chunk link, keep the blocks aligned
+		s->ptr = chunk + SLAB_ALIGN;
+		s->end = chunk + SLAB_CHUNK;
+	}
+	void * ret = s->ptr;
+	s->ptr += sz;
+	return ret;
+}
+
+// osize is the size of block when ptr isn't NULL, the blocks are told apart by their size
+static void *
+slab_realloc(struct snlua *l, void *ptr, size_t osize, size_t nsize, int grow) {
+	struct slab *s = l->slab;
+	if (ptr == NULL)
+		osize = 0;
+	int oc = (ptr && osize <= SLAB_MAX) ? slab_class(osize) : -1;
+	if (nsize == 0) {
+		if (oc >= 0) {
+			slab_free(s, ptr, oc);
+		} else {
+			mem_realloc(l, ptr, osize, 0, 0);
+		}
+		return NULL;
+	}
+	int nc = nsize <= SLAB_MAX ? slab_class(nsize) : -1;
+	if (ptr && oc < 0 && nc < 0) {
+		return mem_realloc(l, ptr, osize, nsize, grow);
+	}
+	if (ptr && oc == nc) {
+		return ptr;
+	}
+	void * ret = nc >= 0 ? slab_alloc(l, nc, grow) : mem_realloc(l, NULL, 0, nsize, grow);
+	if (ret && ptr) {
+		memcpy(ret, ptr, osize < nsize ? osize : nsize);
+		if (oc >= 0) {
+			slab_free(s, ptr, oc);
+		} else {
+			mem_realloc(l, ptr, osize, 0, 0);
+		}
+	}
+	return ret;
+}
+
+static struct slab *
+slab_new(void) {
+	struct slab * s = skynet_malloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	return s;
+}
+
+static void
+slab_delete(struct slab *s) {
+	void * chunk = s->chunk;
+	while (chunk) {
+		void * next = *(void **)chunk;
+		skynet_lalloc(chunk, SLAB_CHUNK, 0);
+		chunk = next;
+	}
+	skynet_free(s);
+}
+
+// l->mem is the memory allocated by skynet_lalloc, it fails beyond mem_limit only if lua grows a block
+// (lua assumes that shrinking never fails)
+static void *
+mem_realloc(struct snlua *l, void *ptr, size_t osize, size_t nsize, int grow) {
 	size_t mem = l->mem;
 	l->mem += nsize;
 	if (ptr)
 		l->mem -= osize;
-	if (l->mem_limit != 0 && l->mem > l->mem_limit) {
-		if (ptr == NULL || nsize > osize) {
-			l->mem = mem;
-			return NULL;
-		}
+	if (l->mem_limit != 0 && l->mem > l->mem_limit && grow) {
+		l->mem = mem;
+		return NULL;
 	}
 	if (l->mem > l->mem_report) {
 		l->mem_report *= 2;
 		skynet_error(l->ctx, "Memory warning %.2f M", (float)l->mem / (1024 * 1024));
 	}
-	return skynet_lalloc(ptr, osize, nsize);
+	void * ret = skynet_lalloc(ptr, osize, nsize);
+	if (ret == NULL && nsize > 0) {
+		// lua keeps the old block when it fails
+		l->mem = mem;
+	}
+	return ret;
+}
+
+static void *
+lalloc(void * ud, void *ptr, size_t osize, size_t nsize) {
+	struct snlua *l = ud;
+	int grow = ptr == NULL || nsize > osize;
+	if (l->slab)
+		return slab_realloc(l, ptr, osize, nsize, grow);
+	return mem_realloc(l, ptr, osize, nsize, grow);
 }
 
 static unsigned
@@ -526,6 +657,10 @@ snlua_create(void) {
 	memset(l,0,sizeof(*l));
 	l->mem_report = MEMORY_WARNING_REPORT;
 	l->mem_limit = 0;
+	const char * slab = skynet_command(NULL, "GETENV", "luaslab");
+	if (slab && strcmp(slab, "true") == 0) {
+		l->slab = slab_new();
+	}
 	l->L = lua_newstate(lalloc, l, global_seed());
 	l->activeL = NULL;
 	ATOM_INIT(&l->trap , 0);
@@ -535,6 +670,9 @@ snlua_create(void) {
 void
 snlua_release(struct snlua *l) {
 	lua_close(l->L);
+	if (l->slab) {
+		slab_delete(l->slab);
+	}
 	skynet_free(l);
 }
 
@@ -552,5 +690,8 @@ snlua_signal(struct snlua *l, int signal) {
 		}
 	} else if (signal == 1) {
 		skynet_error(l->ctx, "Current Memory %.3fK", (float)l->mem / 1024);
+		if (l->slab) {
+			skynet_error(l->ctx, "Slab Chunks %.3fK", (float)(l->slab->chunk_count * SLAB_CHUNK) / 1024);
+		}
 	}
 }
@@ -167,6 +167,7 @@ function COMMAND.help()
 		exit = "exit address : kill a lua service",
 		kill = "kill address : kill service",
 		mem = "mem : show memory status",
+		worker = "worker : show worker idle stats (sleep/wakeup/spin)",
 		gc = "gc : force every lua service do garbage collect",
 		start = "lanuch a new lua service",
 		snax = "lanuch a new snax service",
@@ -190,7 +191,8 @@ function COMMAND.help()
 		dumpheap = "dumpheap : dump heap profilling",
 		killtask = "killtask address threadname : threadname listed by task",
 		dbgcmd = "run address debug command",
-		fasttime = "fast forward time to specified timestamp",
+		fasttime = "fasttime timestamp [once_add] : fast forward time to specified timestamp",
+		replay = "replay speed n|pause|resume|step [n]|goto timestamp : control the replay clock",
 		getenv = "getenv name : skynet.getenv(name)",
 		setenv = "setenv name value: skynet.setenv(name,value)",
 	}
@@ -274,6 +276,14 @@ function COMMAND.mem(ti)
 	return skynet.call(".launcher", "lua", "MEM", timeout(ti))
 end
 
+function COMMAND.worker()
+	return {
+		sleep = skynet.stat "worker_sleep",
+		wakeup = skynet.stat "worker_wakeup",
+		spin = skynet.stat "worker_spin",
+	}
+end
+
 function COMMAND.kill(address)
 	return skynet.call(".launcher", "lua", "KILL", adjust_address(address))
 end
@@ -494,15 +504,28 @@ end
 
 function COMMAND.fasttime(timestamp,once_add)
 	timestamp = tonumber(timestamp)
-	once_add = tonumber(once_add)
+	once_add = tonumber(once_add or 0)
 	assert(timestamp and timestamp > 0,"err timestamp " .. tostring(timestamp))
-	assert(once_add and once_add > 0,"err once_add " .. tostring(once_add))
+	assert(once_add and once_add >= 0,"err once_add " .. tostring(once_add))
 	local fast_time = core.fast_time(timestamp * 100,once_add * 100)
 	if fast_time <= 0 then
 		return "fasttime faild"
 	end
 	return string.format("fasttime to %s",os.date("%Y%m%d-%H:%M:%S",timestamp))
 end
+
+function COMMAND.replay(cmd, arg)
+	arg = tonumber(arg)
+	if cmd == "goto" then
+		-- timestamp to the recorded time, skynet.starttime() is the start time of the record when playing it
+		assert(arg and arg > skynet.starttime(), "err timestamp " .. tostring(arg))
+		arg = (arg - skynet.starttime()) * 100
+	end
+	if not core.replay(cmd, arg) then
+		return "replay " .. tostring(cmd) .. " faild"
+	end
+	return "replay " .. cmd .. (arg and (" " .. arg) or "")
+end
 function COMMAND.getenv(name)
 	local value = skynet.getenv(name)
 	return {[name]=tostring(value)}
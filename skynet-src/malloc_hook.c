@@ -13,6 +13,13 @@
 // turn on MEMORY_CHECK can do more memory check, such as double free
 // #define MEMORY_CHECK
 
+// turn on USE_SERVICE_ARENA (see Makefile) to allocate in a jemalloc arena per service instead of the prefix cookie
+#if defined(USE_SERVICE_ARENA) && defined(NOUSE_JEMALLOC)
+#error "USE_SERVICE_ARENA needs jemalloc"
+#endif
+
+#ifndef USE_SERVICE_ARENA
+
 #define MEMORY_ALLOCTAG 0x20140605
 #define MEMORY_FREETAG 0x0badf00d
 
@@ -45,10 +52,14 @@ get_mem_stat(uint32_t handle) {
 	return data;
 }
 
+#endif
+
 #ifndef NOUSE_JEMALLOC
 
 #include "jemalloc.h"
 
+#ifndef USE_SERVICE_ARENA
+
 // for skynet_lalloc use
 #define raw_realloc je_realloc
 #define raw_free je_free
@@ -108,6 +119,8 @@ clean_prefix(char* ptr) {
 	return p;
 }
 
+#endif
+
 static void malloc_oom(size_t size) {
 	fprintf(stderr, "xmalloc: Out of memory trying to allocate %zu bytes\n",
 		size);
@@ -168,6 +181,343 @@ mallctl_opt(const char* name, int* newval) {
 	return v;
 }
 
+#ifdef USE_SERVICE_ARENA
+
+// Each service allocates in its own jemalloc arena, without the prefix cookie and the atomic stats,
+// and the arena stats of jemalloc are exact for the service. The tcache is bypassed for the blocks of
+// the service arenas (a block freed by another service would be reused from its tcache), the arena of
+// a service is uncontended anyway. The blocks of the automatic arenas are freed to the tcache as usual.
+// The arena can't be destroyed when the service exits, because the messages it sent may be still alive,
+// so it's purged and recycled by the next service. The services beyond ARENA_MAX share the automatic arenas.
+// An arena still holding the blocks of its last owner is recycled only when no arena can be created,
+// and these blocks are taken as the baseline of the new owner.
+
+#include "spinlock.h"
+
+#ifndef ARENA_MAX
+#define ARENA_MAX 1024
+#endif
+
+struct mem_arena {
+	uint32_t handle;	// 0 if it's free
+	unsigned index;		// index of jemalloc arena
+	int next;		// in the free list
+	size_t base;		// bytes allocated by the last owners when it's recycled
+};
+
+struct arena_pool {
+	struct spinlock lock;	// zero initialized
+	int count;
+	int creating;	// arenas.create in progress, out of the lock
+	int freelist;	// freelist - 1 is the first free arena, 0 for none
+	int freetail;	// the free list is FIFO, the oldest one is most likely drained
+	struct mem_arena arena[ARENA_MAX];
+};
+
+static struct arena_pool A;
+
+// the arena bound to the thread, by the service dispatched on it
+static _Thread_local int ARENA = -1;
+static _Thread_local int ARENA_FLAGS = 0;
+
+// the jemalloc arenas from FIRST_ARENA on are created by malloc_arena_new, the automatic ones are below it.
+// -1 before the first one is created (LOOKUP_MIB is set before it), 0 if arenas.lookup is not supported.
+static ATOM_INT FIRST_ARENA = -1;
+static size_t LOOKUP_MIB[2];
+
+// the tcache is bypassed when the block is owned by a service arena
+static inline int
+free_flags(void *ptr) {
+	int first = ATOM_LOAD(&FIRST_ARENA);
+	if (first < 0)
+		return 0;
+	if (first == 0)
+		return MALLOCX_TCACHE_NONE;
+	unsigned index;
+	size_t sz = sizeof(index);
+	if (je_mallctlbymib(LOOKUP_MIB, 2, &index, &sz, &ptr, sizeof(ptr)) != 0)
+		return MALLOCX_TCACHE_NONE;
+	return index >= (unsigned)first ? MALLOCX_TCACHE_NONE : 0;
+}
+
+// for skynet_lalloc use
+static inline void *
+raw_realloc(void *ptr, size_t size) {
+	if (ptr == NULL)
+		return je_mallocx(size, ARENA_FLAGS);
+	return je_rallocx(ptr, size, ARENA_FLAGS);
+}
+
+static inline void
+raw_free(void *ptr) {
+	if (ptr)
+		je_dallocx(ptr, free_flags(ptr));
+}
+
+static void
+stats_refresh(void) {
+	uint64_t epoch = 1;
+	size_t sz = sizeof(epoch);
+	je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+}
+
+static size_t
+stats_size(const char *name, unsigned index) {
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "stats.arenas.%u.%s", index, name);
+	size_t v = 0;
+	size_t sz = sizeof(v);
+	je_mallctl(cmd, &v, &sz, NULL, 0);
+	return v;
+}
+
+static uint64_t
+stats_count(const char *name, unsigned index) {
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "stats.arenas.%u.%s", index, name);
+	uint64_t v = 0;
+	size_t sz = sizeof(v);
+	je_mallctl(cmd, &v, &sz, NULL, 0);
+	return v;
+}
+
+static size_t
+arena_allocated(unsigned index) {
+	return stats_size("small.allocated", index) + stats_size("large.allocated", index);
+}
+
+// the bytes allocated by the owner of the arena, call stats_refresh first
+static size_t
+service_allocated(struct mem_arena *a) {
+	size_t v = arena_allocated(a->index);
+	return v > a->base ? v - a->base : 0;
+}
+
+// the mallctl calls are out of the spinlock, they may take the locks of jemalloc and create an arena.
+static int
+arena_create(void) {
+	spinlock_lock(&A.lock);
+	int full = A.count + A.creating >= ARENA_MAX;
+	if (!full)
+		++A.creating;
+	spinlock_unlock(&A.lock);
+	if (full)
+		return -1;
+	size_t mib[2];
+	size_t miblen = 2;
+	int lookup = ATOM_LOAD(&FIRST_ARENA) < 0 ? je_mallctlnametomib("arenas.lookup", mib, &miblen) == 0 : 0;
+	unsigned index;
+	size_t sz = sizeof(index);
+	int err = je_mallctl("arenas.create", &index, &sz, NULL, 0);
+	spinlock_lock(&A.lock);
+	--A.creating;
+	int id = -1;
+	if (err == 0) {
+		id = A.count++;
+		A.arena[id].index = index;
+		// the arenas may be created out of order, and no block is in this one yet
+		int first = ATOM_LOAD(&FIRST_ARENA);
+		if (first < 0) {
+			if (lookup) {
+				memcpy(LOOKUP_MIB, mib, sizeof(mib));
+				ATOM_STORE(&FIRST_ARENA, (int)index);
+			} else {
+				ATOM_STORE(&FIRST_ARENA, 0);	// bypass the tcache for every free
+			}
+		} else if (first > 0 && (int)index < first) {
+			ATOM_STORE(&FIRST_ARENA, (int)index);
+		}
+	}
+	spinlock_unlock(&A.lock);
+	return id;
+}
+
+static void
+arena_push(int id, int front) {
+	spinlock_lock(&A.lock);
+	if (front) {
+		A.arena[id].next = A.freelist;
+		A.freelist = id + 1;
+		if (A.freetail == 0)
+			A.freetail = id + 1;
+	} else {
+		A.arena[id].next = 0;
+		if (A.freetail) {
+			A.arena[A.freetail - 1].next = id + 1;
+		} else {
+			A.freelist = id + 1;
+		}
+		A.freetail = id + 1;
+	}
+	spinlock_unlock(&A.lock);
+}
+
+int
+malloc_arena_new(uint32_t handle) {
+	int id = -1;
+	spinlock_lock(&A.lock);
+	if (A.freelist) {
+		id = A.freelist - 1;
+		A.freelist = A.arena[id].next;
+		if (A.freelist == 0)
+			A.freetail = 0;
+	}
+	spinlock_unlock(&A.lock);
+	size_t base = 0;
+	if (id >= 0) {
+		stats_refresh();
+		base = arena_allocated(A.arena[id].index);
+		if (base > 0) {
+			// the messages of the last owner are still alive, keep it in the free list if a new one can be created
+			int newid = arena_create();
+			if (newid >= 0) {
+				arena_push(id, 1);
+				id = newid;
+				base = 0;
+			}
+		}
+	} else {
+		id = arena_create();
+	}
+	if (id >= 0) {
+		A.arena[id].base = base;
+		A.arena[id].handle = handle;
+	}
+	return id;
+}
+
+void
+malloc_arena_release(int id) {
+	if (id < 0)
+		return;
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "arena.%u.purge", A.arena[id].index);
+	je_mallctl(cmd, NULL, NULL, NULL, 0);
+	A.arena[id].handle = 0;
+	arena_push(id, 0);
+}
+
+int
+malloc_arena_bind(int id) {
+	int last = ARENA;
+	if (id != last) {
+		ARENA = id;
+		ARENA_FLAGS = id >= 0 ? (MALLOCX_ARENA(A.arena[id].index) | MALLOCX_TCACHE_NONE) : 0;
+	}
+	return last;
+}
+
+// hook : malloc, realloc, free, calloc
+
+void *
+skynet_malloc(size_t size) {
+	void* ptr = je_mallocx(size ? size : 1, ARENA_FLAGS);
+	if(!ptr) malloc_oom(size);
+	return ptr;
+}
+
+void *
+skynet_realloc(void *ptr, size_t size) {
+	if (ptr == NULL) return skynet_malloc(size);
+
+	void *newptr = je_rallocx(ptr, size ? size : 1, ARENA_FLAGS);
+	if(!newptr) malloc_oom(size);
+	return newptr;
+}
+
+void
+skynet_free(void *ptr) {
+	if (ptr == NULL) return;
+	je_dallocx(ptr, free_flags(ptr));
+}
+
+void *
+skynet_calloc(size_t nmemb, size_t size) {
+	size_t sz = nmemb * size;
+	void* ptr = je_mallocx(sz ? sz : 1, ARENA_FLAGS | MALLOCX_ZERO);
+	if(!ptr) malloc_oom(sz);
+	return ptr;
+}
+
+void *
+skynet_memalign(size_t alignment, size_t size) {
+	void* ptr = je_mallocx(size ? size : 1, ARENA_FLAGS | MALLOCX_ALIGN(alignment));
+	if(!ptr) malloc_oom(size);
+	return ptr;
+}
+
+void *
+skynet_aligned_alloc(size_t alignment, size_t size) {
+	return skynet_memalign(alignment, size);
+}
+
+int
+skynet_posix_memalign(void **memptr, size_t alignment, size_t size) {
+	*memptr = skynet_memalign(alignment, size);
+	return 0;
+}
+
+size_t
+malloc_used_memory(void) {
+	stats_refresh();
+	size_t v = 0;
+	size_t sz = sizeof(v);
+	je_mallctl("stats.allocated", &v, &sz, NULL, 0);
+	return v;
+}
+
+size_t
+malloc_memory_block(void) {
+	stats_refresh();
+	uint64_t n = stats_count("small.nmalloc", MALLCTL_ARENAS_ALL) + stats_count("large.nmalloc", MALLCTL_ARENAS_ALL);
+	uint64_t d = stats_count("small.ndalloc", MALLCTL_ARENAS_ALL) + stats_count("large.ndalloc", MALLCTL_ARENAS_ALL);
+	return (size_t)(n - d);
+}
+
+void
+dump_c_mem() {
+	skynet_error(NULL, "dump all service mem:");
+	size_t total = malloc_used_memory();
+	size_t services = 0;
+	int i;
+	for (i=0;i<ARENA_MAX;i++) {
+		uint32_t handle = A.arena[i].handle;
+		if (handle != 0) {
+			size_t using = service_allocated(&A.arena[i]);
+			services += using;
+			skynet_error(NULL, ":%08x -> %zukb %zub", handle, using >> 10, using);
+		}
+	}
+	size_t shared = total > services ? total - services : 0;
+	skynet_error(NULL, "+shared: %zukb", shared >> 10);
+	skynet_error(NULL, "+total: %zukb", total >> 10);
+}
+
+int
+dump_mem_lua(lua_State *L) {
+	int i;
+	stats_refresh();
+	lua_newtable(L);
+	for (i=0;i<ARENA_MAX;i++) {
+		uint32_t handle = A.arena[i].handle;
+		if (handle != 0) {
+			lua_pushinteger(L, service_allocated(&A.arena[i]));
+			lua_rawseti(L, -2, handle);
+		}
+	}
+	return 1;
+}
+
+size_t
+malloc_current_memory(void) {
+	if (ARENA < 0)
+		return 0;
+	stats_refresh();
+	return service_allocated(&A.arena[ARENA]);
+}
+
+#else
+
 // hook : malloc, realloc, free, calloc
 
 void *
@@ -243,6 +593,8 @@ skynet_posix_memalign(void **memptr, size_t alignment, size_t size) {
 	return err;
 }
 
+#endif
+
 #else
 
 // for skynet_lalloc use
@@ -280,6 +632,22 @@ mallctl_cmd(const char* name) {
 
 #endif
 
+#ifndef USE_SERVICE_ARENA
+
+int
+malloc_arena_new(uint32_t handle) {
+	return -1;
+}
+
+void
+malloc_arena_release(int id) {
+}
+
+int
+malloc_arena_bind(int id) {
+	return -1;
+}
+
 size_t
 malloc_used_memory(void) {
 	MemInfo total = {};
@@ -325,24 +693,6 @@ dump_c_mem() {
 	skynet_error(NULL, "+total: %zukb", using >> 10);
 }
 
-char *
-skynet_strdup(const char *str) {
-	size_t sz = strlen(str);
-	char * ret = skynet_malloc(sz+1);
-	memcpy(ret, str, sz+1);
-	return ret;
-}
-
-void *
-skynet_lalloc(void *ptr, size_t osize, size_t nsize) {
-	if (nsize == 0) {
-		raw_free(ptr);
-		return NULL;
-	} else {
-		return raw_realloc(ptr, nsize);
-	}
-}
-
 int
 dump_mem_lua(lua_State *L) {
 	int i;
@@ -372,6 +722,26 @@ malloc_current_memory(void) {
 	return info.alloc - info.free;
 }
 
+#endif
+
+char *
+skynet_strdup(const char *str) {
+	size_t sz = strlen(str);
+	char * ret = skynet_malloc(sz+1);
+	memcpy(ret, str, sz+1);
+	return ret;
+}
+
+void *
+skynet_lalloc(void *ptr, size_t osize, size_t nsize) {
+	if (nsize == 0) {
+		raw_free(ptr);
+		return NULL;
+	} else {
+		return raw_realloc(ptr, nsize);
+	}
+}
+
 void
 skynet_debug_memory(const char *info) {
 	// for debug use
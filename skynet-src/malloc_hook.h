@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <lua.h>
 
 #include "mem_info.h"
@@ -18,4 +19,9 @@ extern void   dump_c_mem(void);
 extern int    dump_mem_lua(lua_State *L);
 extern size_t malloc_current_memory(void);
 
+// the arena of a service in USE_SERVICE_ARENA mode, -1 for none (the others mode always return -1)
+extern int    malloc_arena_new(uint32_t handle);
+extern void   malloc_arena_release(int id);
+extern int    malloc_arena_bind(int id);	// bind the arena to the current thread, returns the last one
+
 #endif /* SKYNET_MALLOC_HOOK_H */
@@ -20,6 +20,7 @@
 #define PTYPE_RESERVED_DEBUG 9
 #define PTYPE_RESERVED_LUA 10
 #define PTYPE_RESERVED_SNAX 11
+#define PTYPE_RECORD 13	// checkpoint snapshot delivered when replay seeks
 
 #define PTYPE_TAG_DONTCOPY 0x10000
 #define PTYPE_TAG_ALLOCSESSION 0x20000
@@ -39,7 +40,10 @@ void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
 
 uint32_t skynet_current_handle(void);
 uint64_t skynet_now(void);
-uint64_t skynet_fast_time(uint64_t ftime, uint32_t once_add);
+uint64_t skynet_now_ms(void);
+uint64_t skynet_fast_time(uint64_t ftime, uint32_t once_add);	// once_add 0 : jump from timer to timer
+// control the replay clock : "speed" times, "pause", "resume", "step" n messages, "goto" recorded time (centisecond)
+int skynet_replay_control(const char *cmd, double arg);
 void skynet_debug_memory(const char *info);	// for debug use, output current service memory to stderr
 
 #endif
@@ -3,13 +3,304 @@
 #include "skynet_imp.h"
 #include "skynet_mq.h"
 #include "skynet_server.h"
+#include "skynet_timer.h"
+#include "skynet_error.h"
+#include "atomic.h"
 
+#include <pthread.h>
+#include <unistd.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #define LOG_MESSAGE_SIZE 256
 
+// The async logger (logbuffer in config) : skynet_error appends to the staging ring of the calling thread
+// (single producer, lock free), and the log thread drains all the rings into the log file in large writes.
+// A message is dropped and counted when the ring is full, instead of queuing in the logger service.
+#define LOG_RING_MAX 256	// threads with a ring, the others push to the logger service
+#define LOG_FLUSH_INTERVAL 1000	// microsecond, log thread sleeps when there is nothing to write
+#define LOG_WRITE_BUFFER (256 * 1024)
+#define LOG_ALIGN 8
+#define SIZETIMEFMT 64
+
+struct log_entry {
+	uint32_t size;	// bytes of the entry with padding, 0 for skipping to the begin of ring
+	uint32_t len;
+	uint32_t source;
+	uint64_t time;
+	char data[];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	ATOM_SIZET head;	// producer
+	ATOM_SIZET tail;	// log thread
+	ATOM_SIZET dropped;
+	size_t reported;	// log thread
+	size_t size;
+	char data[];
+};
+
+struct log_async {
+	FILE *f;
+	char *filename;
+	char *buffer;
+	size_t used;
+	uint32_t starttime;
+	size_t size;
+	ATOM_INT running;
+	ATOM_INT quit;
+	ATOM_INT reopen;
+	ATOM_INT count;
+	ATOM_POINTER rings;
+	pthread_t thread;
+	uint64_t timesec;	// cached time string
+	char timestr[SIZETIMEFMT];
+};
+
+static struct log_async A;
+static _Thread_local struct log_ring *RING = NULL;
+
+static struct log_ring *
+ring_get(void) {
+	struct log_ring *r = RING;
+	if (r) {
+		return r == (struct log_ring *)&A ? NULL : r;
+	}
+	if (ATOM_FINC(&A.count) >= LOG_RING_MAX) {
+		RING = (struct log_ring *)&A;
+		return NULL;
+	}
+	r = skynet_malloc(sizeof(*r) + A.size);
+	ATOM_INIT(&r->head, 0);
+	ATOM_INIT(&r->tail, 0);
+	ATOM_INIT(&r->dropped, 0);
+	r->reported = 0;
+	r->size = A.size;
+	for (;;) {
+		uintptr_t head = ATOM_LOAD(&A.rings);
+		r->next = (struct log_ring *)head;
+		if (ATOM_CAS_POINTER(&A.rings, head, (uintptr_t)r))
+			break;
+	}
+	RING = r;
+	return r;
+}
+
+static void
+ring_push(struct log_ring *r, uint32_t source, const char *data, size_t len) {
+	size_t need = (sizeof(struct log_entry) + len + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+	size_t head = ATOM_LOAD(&r->head);
+	size_t pos = head & (r->size - 1);
+	size_t skip = r->size - pos < need ? r->size - pos : 0;
+	if (need + skip > r->size - (head - ATOM_LOAD(&r->tail))) {
+		ATOM_FINC(&r->dropped);
+		return;
+	}
+	if (skip) {
+		((struct log_entry *)(r->data + pos))->size = 0;
+		pos = 0;
+	}
+	struct log_entry *e = (struct log_entry *)(r->data + pos);
+	e->size = (uint32_t)need;
+	e->len = (uint32_t)len;
+	e->source = source;
+	e->time = skynet_now();
+	memcpy(e->data, data, len);
+	ATOM_STORE(&r->head, head + skip + need);
+}
+
+static void
+log_flush(void) {
+	if (A.used > 0) {
+		fwrite(A.buffer, A.used, 1, A.f);
+		A.used = 0;
+	}
+	fflush(A.f);
+}
+
+static void
+log_write(const void *data, size_t sz) {
+	if (A.used + sz > LOG_WRITE_BUFFER) {
+		log_flush();
+		if (sz > LOG_WRITE_BUFFER) {
+			fwrite(data, sz, 1, A.f);
+			return;
+		}
+	}
+	memcpy(A.buffer + A.used, data, sz);
+	A.used += sz;
+}
+
+// the same format as service_logger
+static void
+log_output(uint32_t source, uint64_t now, const char *data, size_t len) {
+	char tmp[SIZETIMEFMT * 2];
+	int n = 0;
+	if (A.filename) {
+		uint64_t sec = now / 100;
+		if (sec != A.timesec) {
+			A.timesec = sec;
+			time_t ti = sec + A.starttime;
+			struct tm info;
+			(void)localtime_r(&ti, &info);
+			strftime(A.timestr, SIZETIMEFMT, "%d/%m/%y %H:%M:%S", &info);
+		}
+		n = snprintf(tmp, SIZETIMEFMT, "%s.%02d ", A.timestr, (int)(now % 100));
+	}
+	n += snprintf(tmp + n, sizeof(tmp) - n, "[:%08x] ", source);
+	log_write(tmp, n);
+	log_write(data, len);
+	log_write("\n", 1);
+}
+
+static size_t
+ring_drain(struct log_ring *r) {
+	size_t head = ATOM_LOAD(&r->head);
+	size_t tail = ATOM_LOAD(&r->tail);
+	size_t n = 0;
+	while (tail != head) {
+		size_t pos = tail & (r->size - 1);
+		struct log_entry *e = (struct log_entry *)(r->data + pos);
+		if (e->size == 0) {
+			tail += r->size - pos;
+			continue;
+		}
+		log_output(e->source, e->time, e->data, e->len);
+		tail += e->size;
+		++n;
+	}
+	ATOM_STORE(&r->tail, tail);
+	size_t dropped = ATOM_LOAD(&r->dropped);
+	if (dropped != r->reported) {
+		char tmp[LOG_MESSAGE_SIZE];
+		int len = snprintf(tmp, sizeof(tmp), "%zu log messages dropped, logbuffer is full", dropped - r->reported);
+		log_output(0, skynet_now(), tmp, len);
+		r->reported = dropped;
+		++n;
+	}
+	return n;
+}
+
+static void *
+thread_log(void *p) {
+	for (;;) {
+		int quit = ATOM_LOAD(&A.quit);
+		if (ATOM_LOAD(&A.reopen)) {
+			ATOM_STORE(&A.reopen, 0);
+			if (A.filename) {
+				log_flush();
+				A.f = freopen(A.filename, "a", A.f);
+				if (A.f == NULL) {
+					// nowhere to log, keep draining the rings
+					A.f = fopen("/dev/null", "w");
+				}
+			}
+		}
+		size_t n = 0;
+		struct log_ring *r = (struct log_ring *)ATOM_LOAD(&A.rings);
+		while (r) {
+			n += ring_drain(r);
+			r = r->next;
+		}
+		if (n > 0) {
+			log_flush();
+		}
+		if (quit)
+			break;
+		if (n == 0) {
+			usleep(LOG_FLUSH_INTERVAL);
+		}
+	}
+	return NULL;
+}
+
+int
+skynet_error_async(const char *filename, int size) {
+	size_t sz = 1024;
+	while (sz < (size_t)size) {
+		sz *= 2;
+	}
+	if (filename) {
+		A.f = fopen(filename, "a");
+		if (A.f == NULL) {
+			return 1;
+		}
+		A.filename = skynet_strdup(filename);
+	} else {
+		A.f = stdout;
+		A.filename = NULL;
+	}
+	A.buffer = skynet_malloc(LOG_WRITE_BUFFER);
+	A.used = 0;
+	A.starttime = skynet_starttime();
+	A.size = sz;
+	A.timesec = UINT64_MAX;
+	ATOM_INIT(&A.quit, 0);
+	ATOM_INIT(&A.reopen, 0);
+	ATOM_INIT(&A.count, 0);
+	ATOM_INIT(&A.rings, 0);
+	if (pthread_create(&A.thread, NULL, thread_log, NULL)) {
+		if (A.filename) {
+			fclose(A.f);
+		}
+		return 1;
+	}
+	ATOM_STORE(&A.running, 1);
+	return 0;
+}
+
+void
+skynet_error_reopen(void) {
+	ATOM_STORE(&A.reopen, 1);
+}
+
+void
+skynet_error_exit(void) {
+	if (!ATOM_LOAD(&A.running))
+		return;
+	ATOM_STORE(&A.running, 0);
+	ATOM_STORE(&A.quit, 1);
+	pthread_join(A.thread, NULL);
+	if (A.filename) {
+		fclose(A.f);
+	}
+}
+
+// returns 0 if the thread has no ring, and the message should go to the logger service
+static int
+log_async(struct skynet_context * context, const char *msg, va_list ap) {
+	struct log_ring *r = ring_get();
+	if (r == NULL)
+		return 0;
+	uint32_t source = context ? skynet_context_handle(context) : 0;
+	if (strcmp(msg, "%*s") == 0) {
+		// for `lerror` in lua-skynet.c
+		const int len = va_arg(ap, int);
+		const char *tmp = va_arg(ap, const char*);
+		ring_push(r, source, tmp, (size_t)len);
+		return 1;
+	}
+	char tmp[LOG_MESSAGE_SIZE];
+	va_list ap2;
+	va_copy(ap2, ap);
+	int len = vsnprintf(tmp, LOG_MESSAGE_SIZE, msg, ap);
+	if (len >= LOG_MESSAGE_SIZE) {
+		char *data = skynet_malloc(len + 1);
+		len = vsnprintf(data, len + 1, msg, ap2);
+		if (len >= 0) {
+			ring_push(r, source, data, len);
+		}
+		skynet_free(data);
+	} else if (len >= 0) {
+		ring_push(r, source, tmp, len);
+	}
+	va_end(ap2);
+	return 1;
+}
+
 static int
 log_try_vasprintf(char **strp, const char *fmt, va_list ap) {
 	if (strcmp(fmt, "%*s") == 0) {
@@ -31,6 +322,14 @@ log_try_vasprintf(char **strp, const char *fmt, va_list ap) {
 
 void
 skynet_error(struct skynet_context * context, const char *msg, ...) {
+	if (ATOM_LOAD(&A.running)) {
+		va_list ap;
+		va_start(ap, msg);
+		int done = log_async(context, msg, ap);
+		va_end(ap);
+		if (done)
+			return;
+	}
 	static uint32_t logger = 0;
 	if (logger == 0) {
 		logger = skynet_handle_findname("logger");
@@ -0,0 +1,9 @@
+#ifndef SKYNET_ERROR_H
+#define SKYNET_ERROR_H
+
+// the async logger replaces the logger service for skynet_error, size is the bytes of staging ring per thread
+int skynet_error_async(const char *filename, int size);
+void skynet_error_reopen(void);
+void skynet_error_exit(void);
+
+#endif
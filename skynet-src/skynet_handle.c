@@ -7,39 +7,60 @@
 #include "spinlock.h"
 
 #include <stdlib.h>
+#include <limits.h>
+#include <sched.h>
 #include <assert.h>
 #include <string.h>
 
 #define HANDLE_CACHE_LINE 64
+#define HANDLE_SPIN 64
 
+// A reader publishes the epoch it entered with, 0 when it's quiescent.
 struct handle_reader_slot {
-	ATOM_INT active;
-	char _pad[HANDLE_CACHE_LINE - sizeof(ATOM_INT)];
+	ATOM_ULONG epoch;
+	char _pad[HANDLE_CACHE_LINE - sizeof(ATOM_ULONG)];
 };
 
 static _Thread_local int TLS_SLOT_IDX = -1;
 
 #define DEFAULT_SLOT_SIZE 4
+#define DEFAULT_NAME_SIZE 16
 #define MAX_SLOT_SIZE 0x40000000
 
+// A name is linked in two hash tables : by the name for findname, and by the handle for retire.
 struct handle_name {
 	char * name;
 	uint32_t handle;
+	uint32_t hash;
+	struct handle_name *next;	// in the name table
+	struct handle_name *hnext;	// in the handle table
+};
+
+// The slot array is published by an atomic pointer, a grown array replaces the old one,
+// and the old one is freed when no reader entered before it was retired (epoch based reclamation).
+struct handle_slots {
+	int size;
+	unsigned long epoch;	// the epoch it's retired at
+	struct handle_slots *next;
+	ATOM_POINTER slot[1];
 };
 
 struct handle_storage {
+	// writers, name readers, and the threads without reader slot
 	struct rwlock lock;
 
 	uint32_t harbor;
 	uint32_t handle_index;
-	int slot_size;
-	struct skynet_context ** slot;
+	ATOM_POINTER slots;
+	struct handle_slots *retired;
 
-	int name_cap;
+	int name_size;
 	int name_count;
-	struct handle_name *name;
+	struct handle_name **name;
+	struct handle_name **owner;
 
 	// distributed reader slots
+	ATOM_ULONG epoch;
 	ATOM_INT thread_idx;
 	int rslot_count;
 	struct handle_reader_slot *rslots;
@@ -47,84 +68,184 @@ struct handle_storage {
 
 static struct handle_storage *H = NULL;
 
-static inline void
-handle_rlock(struct handle_storage *s) {
-	if (TLS_SLOT_IDX >= 0 && TLS_SLOT_IDX < s->rslot_count) {
-		for (;;) {
-			ATOM_STORE(&s->rslots[TLS_SLOT_IDX].active, 1);
-			if (!ATOM_LOAD(&s->lock.write)) {
-				break;
-			}
-			// Writer present — back off to avoid deadlock
-			ATOM_STORE(&s->rslots[TLS_SLOT_IDX].active, 0);
-			while (ATOM_LOAD(&s->lock.write)) { atomic_pause_(); }
-		}
+// Lookups in the slot array never wait for the writers.
+static inline struct handle_slots *
+handle_enter(struct handle_storage *s) {
+	if (TLS_SLOT_IDX >= 0) {
+		ATOM_STORE(&s->rslots[TLS_SLOT_IDX].epoch, ATOM_LOAD(&s->epoch));
 	} else {
 		rwlock_rlock(&s->lock);
 	}
+	return (struct handle_slots *)ATOM_LOAD(&s->slots);
 }
 
 static inline void
-handle_runlock(struct handle_storage *s) {
-	if (TLS_SLOT_IDX >= 0 && TLS_SLOT_IDX < s->rslot_count) {
-		ATOM_STORE(&s->rslots[TLS_SLOT_IDX].active, 0);
+handle_leave(struct handle_storage *s) {
+	if (TLS_SLOT_IDX >= 0) {
+		ATOM_STORE(&s->rslots[TLS_SLOT_IDX].epoch, 0);
 	} else {
 		rwlock_runlock(&s->lock);
 	}
 }
 
-static inline void
-handle_wlock(struct handle_storage *s) {
-	rwlock_wlock(&s->lock);
-	// Additionally wait for all slot readers
-	for (int i = 0; i < s->rslot_count; i++) {
-		while (ATOM_LOAD(&s->rslots[i].active)) { atomic_pause_(); }
+static inline struct skynet_context *
+handle_slot(struct handle_slots *slots, uint32_t handle) {
+	return (struct skynet_context *)ATOM_LOAD(&slots->slot[handle & (slots->size-1)]);
+}
+
+static struct handle_slots *
+slots_new(int size) {
+	struct handle_slots *slots = skynet_malloc(sizeof(*slots) + (size - 1) * sizeof(ATOM_POINTER));
+	slots->size = size;
+	slots->epoch = 0;
+	slots->next = NULL;
+	int i;
+	for (i=0;i<size;i++) {
+		ATOM_INIT(&slots->slot[i], 0);
 	}
+	return slots;
 }
 
-static inline void
-handle_wunlock(struct handle_storage *s) {
-	rwlock_wunlock(&s->lock);
+// the oldest epoch a reader is still in, ULONG_MAX if none
+static unsigned long
+handle_oldest(struct handle_storage *s) {
+	unsigned long oldest = ULONG_MAX;
+	int i;
+	for (i=0;i<s->rslot_count;i++) {
+		unsigned long e = ATOM_LOAD(&s->rslots[i].epoch);
+		if (e != 0 && e < oldest) {
+			oldest = e;
+		}
+	}
+	return oldest;
+}
+
+// free the retired arrays no reader can see, in the write lock
+static void
+handle_reclaim(struct handle_storage *s) {
+	if (s->retired == NULL)
+		return;
+	unsigned long oldest = handle_oldest(s);
+	struct handle_slots **prev = &s->retired;
+	struct handle_slots *r;
+	while ((r = *prev) != NULL) {
+		if (r->epoch < oldest) {
+			*prev = r->next;
+			skynet_free(r);
+		} else {
+			prev = &r->next;
+		}
+	}
+}
+
+// the slots of s->slots are copied into the new one, in the write lock
+static void
+handle_publish(struct handle_storage *s, struct handle_slots *slots) {
+	struct handle_slots *old = (struct handle_slots *)ATOM_LOAD(&s->slots);
+	int i;
+	for (i=0;i<old->size;i++) {
+		struct skynet_context *ctx = (struct skynet_context *)ATOM_LOAD(&old->slot[i]);
+		if (ctx) {
+			uint32_t hash = skynet_context_handle(ctx) & (slots->size-1);
+			assert(ATOM_LOAD(&slots->slot[hash]) == 0);
+			ATOM_STORE(&slots->slot[hash], (uintptr_t)ctx);
+		}
+	}
+	ATOM_STORE(&s->slots, (uintptr_t)slots);
+	old->epoch = ATOM_FINC(&s->epoch);
+	old->next = s->retired;
+	s->retired = old;
+	handle_reclaim(s);
+}
+
+// wait for the readers entered before now, so a context removed from the slots can't be grabbed any more
+static void
+handle_synchronize(struct handle_storage *s) {
+	unsigned long epoch = ATOM_FINC(&s->epoch);
+	int i;
+	for (i=0;i<s->rslot_count;i++) {
+		int spin = 0;
+		for (;;) {
+			unsigned long e = ATOM_LOAD(&s->rslots[i].epoch);
+			if (e == 0 || e > epoch)
+				break;
+			// the reader may be preempted in the lookup, give it the cpu
+			if (++spin < HANDLE_SPIN) {
+				atomic_pause_();
+			} else {
+				sched_yield();
+			}
+		}
+	}
+}
+
+// FNV-1a
+static inline uint32_t
+name_hash(const char *name) {
+	uint32_t h = 2166136261u;
+	const unsigned char *p = (const unsigned char *)name;
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static inline uint32_t
+owner_hash(uint32_t handle) {
+	return handle * 2654435761u;
+}
+
+// remove all the names of handle, in the write lock
+static void
+name_remove(struct handle_storage *s, uint32_t handle) {
+	struct handle_name **hslot = &s->owner[owner_hash(handle) & (s->name_size-1)];
+	while (*hslot) {
+		struct handle_name *n = *hslot;
+		if (n->handle != handle) {
+			hslot = &n->hnext;
+			continue;
+		}
+		*hslot = n->hnext;
+		struct handle_name **slot = &s->name[n->hash & (s->name_size-1)];
+		while (*slot != n) {
+			slot = &(*slot)->next;
+		}
+		*slot = n->next;
+		--s->name_count;
+		skynet_free(n->name);
+		skynet_free(n);
+	}
 }
 
 uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
 	struct handle_storage *s = H;
 
-	handle_wlock(s);
+	rwlock_wlock(&s->lock);
 
 	for (;;) {
+		struct handle_slots *slots = (struct handle_slots *)ATOM_LOAD(&s->slots);
 		int i;
 		uint32_t handle = s->handle_index;
-		for (i=0;i<s->slot_size;i++,handle++) {
+		for (i=0;i<slots->size;i++,handle++) {
 			if (handle > HANDLE_MASK) {
 				// 0 is reserved
 				handle = 1;
 			}
-			int hash = handle & (s->slot_size-1);
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			int hash = handle & (slots->size-1);
+			if (ATOM_LOAD(&slots->slot[hash]) == 0) {
+				ATOM_STORE(&slots->slot[hash], (uintptr_t)ctx);
 				s->handle_index = handle + 1;
 
-				handle_wunlock(s);
+				rwlock_wunlock(&s->lock);
 
 				handle |= s->harbor;
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			if (s->slot[i]) {
-				int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-				assert(new_slot[hash] == NULL);
-				new_slot[hash] = s->slot[i];
-			}
-		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		assert((slots->size*2 - 1) <= HANDLE_MASK);
+		handle_publish(s, slots_new(slots->size * 2));
 	}
 }
 
@@ -133,33 +254,25 @@ skynet_handle_retire(uint32_t handle) {
 	int ret = 0;
 	struct handle_storage *s = H;
 
-	handle_wlock(s);
+	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slots *slots = (struct handle_slots *)ATOM_LOAD(&s->slots);
+	uint32_t hash = handle & (slots->size-1);
+	struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&slots->slot[hash]);
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+		ATOM_STORE(&slots->slot[hash], 0);
 		ret = 1;
-		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
-			}
-			++j;
-		}
-		s->name_count = j;
+		name_remove(s, handle);
 	} else {
 		ctx = NULL;
 	}
 
-	handle_wunlock(s);
+	rwlock_wunlock(&s->lock);
 
 	if (ctx) {
+		// a reader may have loaded ctx before it's removed, wait it grab ctx first.
+		handle_synchronize(s);
 		// release ctx may call skynet_handle_* , so wunlock first.
 		skynet_context_release(ctx);
 	}
@@ -173,15 +286,19 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
-			handle_rlock(s);
-			struct skynet_context * ctx = s->slot[i];
+		for (i=0;;i++) {
+			struct handle_slots *slots = handle_enter(s);
+			if (i >= slots->size) {
+				handle_leave(s);
+				break;
+			}
+			struct skynet_context * ctx = (struct skynet_context *)ATOM_LOAD(&slots->slot[i]);
 			uint32_t handle = 0;
 			if (ctx) {
 				handle = skynet_context_handle(ctx);
 				++n;
 			}
-			handle_runlock(s);
+			handle_leave(s);
 			if (handle != 0) {
 				skynet_handle_retire(handle);
 			}
@@ -196,16 +313,15 @@ skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
 
-	handle_rlock(s);
+	struct handle_slots *slots = handle_enter(s);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct skynet_context * ctx = handle_slot(slots, handle);
 	if (ctx && skynet_context_handle(ctx) == handle) {
 		result = ctx;
 		skynet_context_grab(result);
 	}
 
-	handle_runlock(s);
+	handle_leave(s);
 
 	return result;
 }
@@ -214,89 +330,88 @@ uint32_t
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
 
-	handle_rlock(s);
+	rwlock_rlock(&s->lock);
 
 	uint32_t handle = 0;
-
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
+	uint32_t hash = name_hash(name);
+	struct handle_name *n = s->name[hash & (s->name_size-1)];
+	while (n) {
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
 			handle = n->handle;
 			break;
 		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+		n = n->next;
 	}
 
-	handle_runlock(s);
+	rwlock_runlock(&s->lock);
 
 	return handle;
 }
 
 static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
+name_expand(struct handle_storage *s) {
+	int newsize = s->name_size * 2;
+	assert(newsize <= MAX_SLOT_SIZE);
+	struct handle_name **name = skynet_malloc(newsize * sizeof(struct handle_name *));
+	struct handle_name **owner = skynet_malloc(newsize * sizeof(struct handle_name *));
+	memset(name, 0, newsize * sizeof(struct handle_name *));
+	memset(owner, 0, newsize * sizeof(struct handle_name *));
+	int i;
+	for (i=0;i<s->name_size;i++) {
+		struct handle_name *n = s->name[i];
+		while (n) {
+			struct handle_name *next = n->next;
+			struct handle_name **slot = &name[n->hash & (newsize-1)];
+			n->next = *slot;
+			*slot = n;
+			slot = &owner[owner_hash(n->handle) & (newsize-1)];
+			n->hnext = *slot;
+			*slot = n;
+			n = next;
 		}
 	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	skynet_free(s->name);
+	skynet_free(s->owner);
+	s->name = name;
+	s->owner = owner;
+	s->name_size = newsize;
 }
 
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
+	uint32_t hash = name_hash(name);
+	struct handle_name *n = s->name[hash & (s->name_size-1)];
+	while (n) {
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
 			return NULL;
 		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+		n = n->next;
 	}
-	char * result = skynet_strdup(name);
-
-	_insert_name_before(s, result, handle, begin);
-
-	return result;
+	if (s->name_count >= s->name_size) {
+		name_expand(s);
+	}
+	n = skynet_malloc(sizeof(*n));
+	n->name = skynet_strdup(name);
+	n->handle = handle;
+	n->hash = hash;
+	struct handle_name **slot = &s->name[hash & (s->name_size-1)];
+	n->next = *slot;
+	*slot = n;
+	slot = &s->owner[owner_hash(handle) & (s->name_size-1)];
+	n->hnext = *slot;
+	*slot = n;
+	++s->name_count;
+
+	return n->name;
 }
 
 const char *
 skynet_handle_namehandle(uint32_t handle, const char *name) {
-	handle_wlock(H);
+	rwlock_wlock(&H->lock);
 
 	const char * ret = _insert_name(H, name, handle);
 
-	handle_wunlock(H);
+	rwlock_wunlock(&H->lock);
 
 	return ret;
 }
@@ -313,9 +428,8 @@ void
 skynet_handle_init(int harbor, int thread) {
 	assert(H==NULL);
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	ATOM_INIT(&s->slots, (uintptr_t)slots_new(DEFAULT_SLOT_SIZE));
+	s->retired = NULL;
 
 	rwlock_init(&s->lock);
 
@@ -325,12 +439,16 @@ skynet_handle_init(int harbor, int thread) {
 	s->rslots = (struct handle_reader_slot *)skynet_malloc(rslot_sz);
 	memset(s->rslots, 0, rslot_sz);
 	ATOM_INIT(&s->thread_idx, 0);
+	ATOM_INIT(&s->epoch, 1);
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
+	s->name_size = DEFAULT_NAME_SIZE;
 	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name = skynet_malloc(s->name_size * sizeof(struct handle_name *));
+	s->owner = skynet_malloc(s->name_size * sizeof(struct handle_name *));
+	memset(s->name, 0, s->name_size * sizeof(struct handle_name *));
+	memset(s->owner, 0, s->name_size * sizeof(struct handle_name *));
 
 	H = s;
 
@@ -340,21 +458,19 @@ skynet_handle_init(int harbor, int thread) {
 void 
 skynet_handle_set_index(uint32_t handle) {
 	struct handle_storage *s = H;
-	s->handle_index = handle;
 
-	if (handle <= s->slot_size) return;
+	rwlock_wlock(&s->lock);
+	s->handle_index = handle;
 
-	struct skynet_context ** new_slot = skynet_malloc(handle * sizeof(struct skynet_context *));
-	memset(new_slot, 0, handle * sizeof(struct skynet_context *));
-	int i;
-	for (i=0;i<s->slot_size;i++) {
-		if (s->slot[i]) {
-			int hash = skynet_context_handle(s->slot[i]) & (handle - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
-		}
+	// the slot size must stay a power of 2, and larger than handle so it can't collide with a lower one
+	struct handle_slots *slots = (struct handle_slots *)ATOM_LOAD(&s->slots);
+	int size = slots->size;
+	while (size <= (int)handle) {
+		size *= 2;
 	}
-	skynet_free(s->slot);
-	s->slot = new_slot;
-	s->slot_size = handle;
+	if (size != slots->size) {
+		assert((size - 1) <= HANDLE_MASK);
+		handle_publish(s, slots_new(size));
+	}
+	rwlock_wunlock(&s->lock);
 }
@@ -5,15 +5,25 @@
 
 struct skynet_config {
 	int thread;
+	int socketthread;	// socket poller threads, the sockets are sharded by id
+	int socketuring;	// use io_uring for the sockets, only when it's built with USE_IO_URING
 	int harbor;
 	int profile;
+	int workstealing;
+	int prioritylane;
+	int softaffinity;
+	const char * cpuaffinity;
+	int timerresolution;
+	int timershard;
 	const char * daemon;
 	const char * module_path;
 	const char * bootstrap;
 	const char * logger;
 	const char * logservice;
+	int logbuffer;	// bytes of the staging ring per thread of the async logger, 0 to log by the logger service
 	const char * recordfile;
 	int64_t recordlimit;
+	int64_t recordbacklog;	// max bytes of a record file buffered in memory
 };
 
 #define THREAD_WORKER 0
@@ -25,6 +35,7 @@ struct skynet_config {
 #define THREAD_RECORD 6
 
 void skynet_start(struct skynet_config * config);
+void skynet_worker_idlestat(uint64_t *sleep, uint64_t *wakeup, uint64_t *spin);
 
 static inline char *
 skynet_strndup(const char *str, size_t size) {
@@ -2,14 +2,74 @@
 #include "skynet_timer.h"
 #include "skynet.h"
 #include "skynet_socket.h"
+#include "skynet_record.h"
 #include <string.h>
 #include <time.h>
 
+#define PROTOCOL_UDP 1
+#define PROTOCOL_UDPv6 2
+
+// logformat = "binary" : the log file (logpath/handle.blog) uses the layout of the record file (see skynet_record.h),
+// so the record reader parses it, and lualib/skynet/binlog.lua decodes it offline.
+//	'o' uint32_t starttime, uint64_t now, uint32_t strseed for each logon, 'c' uint64_t now for each logoff
+//	SKYNET_RECORD_VERSION and the first 'o' are followed by 'b' size_t 8, handle in %08x
+//	(no launch args, the replay launches recordservice instead)
+//	'm' uint32_t source, int type, int session, uint64_t now, size_t sz, payload[sz]
+//	'a' int type, int id, int ud, uint64_t now, size_t sz, payload[sz] for PTYPE_SOCKET
+// The writes are buffered, the file is flushed on logoff.
+#define LOG_BUFFER (64 * 1024)
+
+static int BINARY = 0;
+
+#define APPEND(ptr, v) memcpy(ptr, &(v), sizeof(v)); ptr += sizeof(v)
+
+static FILE *
+binary_open(struct skynet_context * ctx, const char * logpath, uint32_t handle) {
+	size_t sz = strlen(logpath);
+	char tmp[sz + 16];
+	sprintf(tmp, "%s/%08x.blog", logpath, handle);
+	FILE *f = fopen(tmp, "ab");
+	if (f == NULL) {
+		skynet_error(ctx, "Open log file %s fail", tmp);
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, LOG_BUFFER);
+	skynet_error(ctx, "Open log file %s", tmp);
+	char header[64];
+	char *ptr = header;
+	fseek(f, 0, SEEK_END);
+	int newfile = ftell(f) == 0;
+	if (newfile) {
+		memcpy(ptr, SKYNET_RECORD_VERSION, sizeof(SKYNET_RECORD_VERSION) - 1);
+		ptr += sizeof(SKYNET_RECORD_VERSION) - 1;
+	}
+	uint32_t starttime = skynet_starttime();
+	uint64_t currenttime = skynet_now();
+	uint32_t strseed = skynet_get_strseed();
+	*ptr++ = 'o';
+	APPEND(ptr, starttime);
+	APPEND(ptr, currenttime);
+	APPEND(ptr, strseed);
+	if (newfile) {
+		size_t len = 8;
+		*ptr++ = 'b';
+		APPEND(ptr, len);
+		sprintf(ptr, "%08x", handle);
+		ptr += len;
+	}
+	fwrite(header, ptr - header, 1, f);
+	return f;
+}
+
 FILE * 
 skynet_log_open(struct skynet_context * ctx, uint32_t handle) {
 	const char * logpath = skynet_getenv("logpath");
 	if (logpath == NULL)
 		return NULL;
+	const char * format = skynet_getenv("logformat");
+	BINARY = format && strcmp(format, "binary") == 0;
+	if (BINARY)
+		return binary_open(ctx, logpath, handle);
 	size_t sz = strlen(logpath);
 	char tmp[sz + 16];
 	sprintf(tmp, "%s/%08x.log", logpath, handle);
@@ -30,17 +90,31 @@ skynet_log_open(struct skynet_context * ctx, uint32_t handle) {
 void
 skynet_log_close(struct skynet_context * ctx, FILE *f, uint32_t handle) {
 	skynet_error(ctx, "Close log file :%08x", handle);
-	fprintf(f, "close time: %u\n", (uint32_t)skynet_now());
+	if (BINARY) {
+		uint64_t ti = skynet_now();
+		fputc('c', f);
+		fwrite(&ti, sizeof(ti), 1, f);
+	} else {
+		fprintf(f, "close time: %u\n", (uint32_t)skynet_now());
+	}
 	fclose(f);
 }
 
 static void
 log_blob(FILE *f, void * buffer, size_t sz) {
-	size_t i;
+	static const char hex[] = "0123456789abcdef";
+	char tmp[1024];
+	size_t i, n = 0;
 	uint8_t * buf = buffer;
 	for (i=0;i!=sz;i++) {
-		fprintf(f, "%02x", buf[i]);
+		tmp[n++] = hex[buf[i] >> 4];
+		tmp[n++] = hex[buf[i] & 0xf];
+		if (n == sizeof(tmp)) {
+			fwrite(tmp, n, 1, f);
+			n = 0;
+		}
 	}
+	fwrite(tmp, n, 1, f);
 }
 
 static void
@@ -63,9 +137,68 @@ log_socket(FILE * f, struct skynet_socket_message * message, size_t sz) {
 	fflush(f);
 }
 
+static void
+binary_socket(FILE * f, struct skynet_socket_message * message, size_t sz) {
+	const char *buffer;
+	if (message->buffer == NULL) {
+		buffer = (const char *)(message + 1);
+		sz -= sizeof(*message);
+		const char * eol = memchr(buffer, '\0', sz);
+		if (eol) {
+			sz = eol - buffer;
+		}
+	} else {
+		sz = message->ud;
+		buffer = message->buffer;
+		if (message->type == SKYNET_SOCKET_TYPE_UDP) {
+			// keep the address after the payload, as the record does
+			uint8_t protocol = buffer[message->ud];
+			if (protocol == PROTOCOL_UDP) {
+				sz += 1 + 2 + 4;
+			} else if (protocol == PROTOCOL_UDPv6) {
+				sz += 1 + 2 + 16;
+			}
+		}
+	}
+	uint64_t ti = skynet_now();
+	char header[1 + sizeof(message->type) + sizeof(message->id) + sizeof(message->ud) + sizeof(ti) + sizeof(sz)];
+	char *ptr = header;
+	*ptr++ = 'a';
+	APPEND(ptr, message->type);
+	APPEND(ptr, message->id);
+	APPEND(ptr, message->ud);
+	APPEND(ptr, ti);
+	APPEND(ptr, sz);
+	fwrite(header, sizeof(header), 1, f);
+	if (sz > 0)
+		fwrite(buffer, sz, 1, f);
+}
+
+static void
+binary_output(FILE *f, uint32_t source, int type, int session, void * buffer, size_t sz) {
+	if (type == PTYPE_SOCKET) {
+		binary_socket(f, buffer, sz);
+		return;
+	}
+	uint64_t ti = skynet_now();
+	char header[1 + sizeof(source) + sizeof(type) + sizeof(session) + sizeof(ti) + sizeof(sz)];
+	char *ptr = header;
+	*ptr++ = 'm';
+	APPEND(ptr, source);
+	APPEND(ptr, type);
+	APPEND(ptr, session);
+	APPEND(ptr, ti);
+	APPEND(ptr, sz);
+	fwrite(header, sizeof(header), 1, f);
+	if (sz > 0)
+		fwrite(buffer, sz, 1, f);
+}
+
 void 
 skynet_log_output(FILE *f, uint32_t source, int type, int session, void * buffer, size_t sz) {
-	if (type == PTYPE_SOCKET) {
+	if (BINARY) {
+		binary_output(f, source, type, session, buffer, sz);
+	} else if (type == PTYPE_SOCKET) {
 		log_socket(f, buffer, sz);
 	} else {
 		uint32_t ti = (uint32_t)skynet_now();
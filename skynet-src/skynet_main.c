@@ -147,8 +147,14 @@ static int try_read_strseed(const char* config_file) {
 		return 0;
 	}
 
-	//开始从recordfile读取strseed
-	f = fopen(recordfile, "rb"); // 以二进制读取模式打开文件
+	//开始从recordfile读取strseed, 录像组的成员都相同
+	char *first = NULL;
+	if (skynet_record_files(recordfile, &first, 1) == 1) {
+		f = fopen(first, "rb"); // 以二进制读取模式打开文件
+		skynet_free(first);
+	} else {
+		f = NULL;
+	}
 	if (f == NULL) {
 		fprintf(stderr, "Error opening record file: %s", recordfile);
 		return 1;
@@ -161,7 +167,7 @@ static int try_read_strseed(const char* config_file) {
 		return 1;
     }
 
-	if (strcmp(version, SKYNET_RECORD_VERSION) != 0) {
+	if (!skynet_record_version_check(version)) {
 		fprintf(stderr, "record version not same curversion[%s] recordversion[%s]", version, SKYNET_RECORD_VERSION);
 		return 1;
 	}
@@ -248,15 +254,29 @@ main(int argc, char *argv[]) {
 		fprintf(stderr, "Invalid thread %d , should be in [1,%d]\n", config.thread, SKYNET_MAXTHREAD);
 		return 1;
 	}
+	config.socketthread = optint("socketthread", 1);
+	if (config.socketthread < 1 || config.socketthread > SKYNET_MAXTHREAD) {
+		fprintf(stderr, "Invalid socketthread %d , should be in [1,%d]\n", config.socketthread, SKYNET_MAXTHREAD);
+		return 1;
+	}
+	config.socketuring = optboolean("socketuring", 1);
 	config.module_path = optstring("cpath","./cservice/?.so");
 	config.harbor = optint("harbor", 1);
 	config.bootstrap = optstring("bootstrap","snlua bootstrap");
 	config.daemon = optstring("daemon", NULL);
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
+	config.logbuffer = optint("logbuffer", 0);
 	config.profile = optboolean("profile", 1);
+	config.workstealing = optboolean("workstealing", 0);
+	config.prioritylane = optboolean("prioritylane", 0);
+	config.softaffinity = optboolean("softaffinity", 0);
+	config.cpuaffinity = optstring("cpuaffinity", NULL);
+	config.timerresolution = optint("timerresolution", 100);
+	config.timershard = optint("timershard", 1);
 	config.recordfile = optstring("recordfile", "");
 	config.recordlimit = optint("recordlimit", 1024 * 1024 * 100);
+	config.recordbacklog = optint("recordbacklog", 1024 * 1024 * 64);
 
 	skynet_start(&config);
 	skynet_globalexit();
@@ -2,6 +2,7 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,69 +19,456 @@
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
-struct message_queue {
-	struct spinlock lock;
-	uint32_t handle;
+#ifndef USE_LOCKFREE_MQ
+
+#define MQ_HIGH_QUEUE_SIZE 8
+
+struct message_ring {
 	int cap;
 	int head;
 	int tail;
+	struct skynet_message *queue;
+};
+
+struct message_queue {
+	struct spinlock lock;
+	uint32_t handle;
 	int release;
 	int in_global;
 	int overload;
 	int overload_threshold;
-	struct skynet_message *queue;
+	struct message_ring lane[MQ_LANES];
+	int affinity;	// the worker last ran it, a hint only
+	struct message_queue *next;
+};
+
+#else
+
+// Multi-producer single-consumer queue, made of a list of fixed size segments.
+// Producers reserve a position with one atomic add, and never wait for a copy when the queue grows.
+// Only one worker can pop a message_queue at the same time (see in_global), so the consumer side is lock free.
+
+#define MQ_SEGMENT_SIZE DEFAULT_QUEUE_SIZE
+
+struct message_slot {
+	struct skynet_message msg;
+	ATOM_INT ready;
+};
+
+struct message_segment {
+	ATOM_POINTER next;
+	size_t base;	// position of slot[0]
+	struct message_segment *retired;
+	struct message_slot slot[MQ_SEGMENT_SIZE];
+};
+
+struct message_lane {
+	// producer side
+	ATOM_SIZET tail;
+	ATOM_POINTER tail_seg;
+	// consumer side, head_seg is NULL if the lane is not used
+	ATOM_SIZET head;
+	struct message_segment *head_seg;
+	struct message_segment *retired;	// fully consumed segments, free them when no producer is pushing
+};
+
+struct message_queue {
+	uint32_t handle;
+	ATOM_INT release;
+	ATOM_INT in_global;
+	int overload;
+	int overload_threshold;
+	ATOM_INT pushing;
+	ATOM_POINTER spare;	// one freed segment kept for the next growth
+	struct message_lane lane[MQ_LANES];
+	int affinity;	// the worker last ran it, a hint only
 	struct message_queue *next;
 };
 
+#endif
+
+// Priority lanes : PTYPE_RESPONSE and system messages go to the high lane when it's enabled,
+// and dispatch prefers the high lane, so an overloaded service can still finish its calls.
+
+static int LANE = 0;
+
+static inline int
+message_lane(struct skynet_message *message) {
+	if (!LANE)
+		return MQ_LANE_NORMAL;
+	int type = message->sz >> MESSAGE_TYPE_SHIFT;
+	switch (type) {
+	case PTYPE_RESPONSE:
+	case PTYPE_SYSTEM:
+	case PTYPE_ERROR:
+	case PTYPE_RESERVED_DEBUG:
+		return MQ_LANE_HIGH;
+	default:
+		return MQ_LANE_NORMAL;
+	}
+}
+
+void
+skynet_mq_lane_enable(int enable) {
+	LANE = enable;
+}
+
+// With work stealing on, every worker owns a local run queue.
+// A worker pushes the queues it re-schedules into its own local queue,
+// and steals half of a peer's local queue when it runs out of work.
+
+#define LOCAL_MQ_MAX 256
+#define GLOBAL_CHECK_INTERVAL 61
+#define LOCAL_MQ_CACHE_LINE 64
+
+struct local_queue {
+	struct spinlock lock;
+	struct message_queue *head;
+	struct message_queue *tail;
+	ATOM_INT count;
+	unsigned tick;	// owner only
+	char _pad[LOCAL_MQ_CACHE_LINE];
+};
+
 struct global_queue {
 	struct message_queue *head;
 	struct message_queue *tail;
 	struct spinlock lock;
+	ATOM_INT count;
+	int worker;	// 0 means work stealing is off
+	struct local_queue *local;
 };
 
 static struct global_queue *Q = NULL;
+static _Thread_local int TLS_WORKER_ID = -1;
+static mq_unpark UNPARK = NULL;
+
+static inline void
+list_push(struct message_queue **head, struct message_queue **tail, struct message_queue *queue) {
+	assert(queue->next == NULL);
+	if(*tail) {
+		(*tail)->next = queue;
+		*tail = queue;
+	} else {
+		*head = *tail = queue;
+	}
+}
+
+static inline struct message_queue *
+list_pop(struct message_queue **head, struct message_queue **tail) {
+	struct message_queue *mq = *head;
+	if(mq) {
+		*head = mq->next;
+		if(*head == NULL) {
+			assert(mq == *tail);
+			*tail = NULL;
+		}
+		mq->next = NULL;
+	}
+	return mq;
+}
+
+static inline struct local_queue *
+local_queue(struct global_queue *q) {
+	if (TLS_WORKER_ID < 0)
+		return NULL;
+	return &q->local[TLS_WORKER_ID];
+}
+
+static void
+global_push(struct global_queue *q, struct message_queue * queue) {
+	SPIN_LOCK(q)
+	list_push(&q->head, &q->tail, queue);
+	ATOM_FINC(&q->count);
+	SPIN_UNLOCK(q)
+}
+
+static struct message_queue *
+global_pop(struct global_queue *q) {
+	if (ATOM_LOAD(&q->count) == 0) {
+		// peek without lock, so idle (spinning) workers don't contend the global lock
+		return NULL;
+	}
+	SPIN_LOCK(q)
+	struct message_queue *mq = list_pop(&q->head, &q->tail);
+	if (mq) {
+		ATOM_FDEC(&q->count);
+	}
+	SPIN_UNLOCK(q)
+
+	return mq;
+}
 
 void 
 skynet_globalmq_push(struct message_queue * queue) {
 	struct global_queue *q= Q;
+	struct local_queue *lq = local_queue(q);
+	if (lq) {
+		SPIN_LOCK(lq)
+		if (ATOM_LOAD(&lq->count) < LOCAL_MQ_MAX) {
+			list_push(&lq->head, &lq->tail, queue);
+			ATOM_FINC(&lq->count);
+			SPIN_UNLOCK(lq)
+			return;
+		}
+		SPIN_UNLOCK(lq)
+		// local queue is full, spill to the global queue
+	}
+	global_push(q, queue);
+}
 
-	SPIN_LOCK(q)
-	assert(queue->next == NULL);
-	if(q->tail) {
-		q->tail->next = queue;
-		q->tail = queue;
-	} else {
-		q->head = q->tail = queue;
+static struct message_queue *
+local_pop(struct global_queue *q, struct local_queue *lq) {
+	struct message_queue *mq;
+	// check the global queue first once in a while, so it can't be starved by busy local queue
+	if (++lq->tick % GLOBAL_CHECK_INTERVAL == 0) {
+		mq = global_pop(q);
+		if (mq)
+			return mq;
 	}
-	SPIN_UNLOCK(q)
+	if (ATOM_LOAD(&lq->count) > 0) {
+		SPIN_LOCK(lq)
+		mq = list_pop(&lq->head, &lq->tail);
+		if (mq) {
+			ATOM_FDEC(&lq->count);
+		}
+		SPIN_UNLOCK(lq)
+		if (mq)
+			return mq;
+	}
+	return global_pop(q);
 }
 
 struct message_queue * 
 skynet_globalmq_pop() {
 	struct global_queue *q = Q;
+	struct local_queue *lq = local_queue(q);
+	if (lq == NULL) {
+		return global_pop(q);
+	}
+	struct message_queue *mq = local_pop(q, lq);
+	if (mq) {
+		mq->affinity = TLS_WORKER_ID;
+	}
+	return mq;
+}
 
-	SPIN_LOCK(q)
-	struct message_queue *mq = q->head;
-	if(mq) {
-		q->head = mq->next;
-		if(q->head == NULL) {
-			assert(mq == q->tail);
-			q->tail = NULL;
+// Soft affinity : a queue becomes active goes back to the local queue of the worker last ran it,
+// if that worker is not busy. Otherwise, it's pushed as usual.
+// The worker is unparked for it if it's parked, no one else runs the queue until it's stolen.
+
+#define AFFINITY_BUSY 4
+
+static int AFFINITY = 0;
+
+// return the worker the queue is pushed to, or -1 for any
+static int
+activate_queue(struct message_queue *mq) {
+	struct global_queue *q = Q;
+	int id = mq->affinity;
+	if (AFFINITY && q->worker > 0 && id >= 0 && id != TLS_WORKER_ID) {
+		struct local_queue *lq = &q->local[id];
+		if (ATOM_LOAD(&lq->count) < AFFINITY_BUSY) {
+			SPIN_LOCK(lq)
+			list_push(&lq->head, &lq->tail, mq);
+			ATOM_FINC(&lq->count);
+			SPIN_UNLOCK(lq)
+			return id;
+		}
+	}
+	skynet_globalmq_push(mq);
+	return -1;
+}
+
+// a queue becomes active, wake a parked worker for it
+static inline void
+unpark_worker(int worker) {
+	if (UNPARK)
+		UNPARK(worker);
+}
+
+void
+skynet_mq_unpark_hook(mq_unpark func) {
+	UNPARK = func;
+}
+
+// Any queue a worker can take : the global queue, or the local queue of any worker (to steal).
+// A queue pushed to the local queue of a parked worker may not wake it (See worker_unpark in skynet_start.c).
+int
+skynet_mq_pending(void) {
+	struct global_queue *q = Q;
+	if (ATOM_LOAD(&q->count) > 0)
+		return 1;
+	int i;
+	for (i=0;i<q->worker;i++) {
+		if (ATOM_LOAD(&q->local[i].count) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+void
+skynet_mq_affinity_enable(int enable) {
+	AFFINITY = enable;
+}
+
+struct message_queue *
+skynet_mq_steal(void) {
+	struct global_queue *q = Q;
+	struct local_queue *lq = local_queue(q);
+	if (lq == NULL)
+		return NULL;
+	int n = q->worker - 1;
+	int offset = lq->tick % n;
+	int i;
+	for (i=0;i<n;i++) {
+		int id = (TLS_WORKER_ID + 1 + (offset + i) % n) % q->worker;
+		struct local_queue *victim = &q->local[id];
+		if (ATOM_LOAD(&victim->count) == 0)
+			continue;
+		if (!spinlock_trylock(&victim->lock))
+			continue;
+		// take the older half of the victim's queues
+		int count = ATOM_LOAD(&victim->count);
+		int steal = (count + 1) / 2;
+		struct message_queue *first = victim->head;
+		struct message_queue *last = first;
+		if (first == NULL) {
+			SPIN_UNLOCK(victim)
+			continue;
+		}
+		int j;
+		for (j=1;j<steal;j++) {
+			last = last->next;
+		}
+		victim->head = last->next;
+		if (victim->head == NULL) {
+			victim->tail = NULL;
+		}
+		last->next = NULL;
+		ATOM_FSUB(&victim->count, steal);
+		SPIN_UNLOCK(victim)
+
+		struct message_queue *mq = first;
+		if (steal > 1) {
+			SPIN_LOCK(lq)
+			if (lq->tail) {
+				lq->tail->next = mq->next;
+			} else {
+				lq->head = mq->next;
+			}
+			lq->tail = last;
+			ATOM_FADD(&lq->count, steal - 1);
+			SPIN_UNLOCK(lq)
 		}
 		mq->next = NULL;
+		mq->affinity = TLS_WORKER_ID;
+		return mq;
 	}
-	SPIN_UNLOCK(q)
+	return NULL;
+}
 
-	return mq;
+void
+skynet_mq_register_worker(int id) {
+	struct global_queue *q = Q;
+	if (id < q->worker) {
+		TLS_WORKER_ID = id;
+	}
+}
+
+uint32_t 
+skynet_mq_handle(struct message_queue *q) {
+	return q->handle;
+}
+
+int
+skynet_mq_overload(struct message_queue *q) {
+	if (q->overload) {
+		int overload = q->overload;
+		q->overload = 0;
+		return overload;
+	} 
+	return 0;
+}
+
+static inline int
+batch_budget(int length, int weight) {
+	// the same as the original dispatch loop : 1 message for weight < 0, else the length after first pop >> weight
+	if (weight < 0)
+		return 1;
+	int n = (length - 1) >> weight;
+	return n > 0 ? n : 1;
+}
+
+#ifndef USE_LOCKFREE_MQ
+
+static void
+ring_init(struct message_ring *r, int cap) {
+	r->cap = cap;
+	r->head = 0;
+	r->tail = 0;
+	r->queue = cap > 0 ? skynet_malloc(sizeof(struct skynet_message) * cap) : NULL;
+}
+
+static inline int
+ring_length(struct message_ring *r) {
+	if (r->head <= r->tail) {
+		return r->tail - r->head;
+	}
+	return r->tail + r->cap - r->head;
+}
+
+// pop n messages, n must not be greater than ring_length(r)
+static void
+ring_pop(struct message_ring *r, struct skynet_message *batch, int n) {
+	int head = r->head;
+	int part = r->cap - head;
+	if (part >= n) {
+		memcpy(batch, r->queue + head, n * sizeof(*batch));
+	} else {
+		memcpy(batch, r->queue + head, part * sizeof(*batch));
+		memcpy(batch + part, r->queue, (n - part) * sizeof(*batch));
+	}
+	head += n;
+	if (head >= r->cap) {
+		head -= r->cap;
+	}
+	r->head = head;
+}
+
+static void
+expand_ring(struct message_ring *r) {
+	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * r->cap * 2);
+	int i;
+	for (i=0;i<r->cap;i++) {
+		new_queue[i] = r->queue[(r->head + i) % r->cap];
+	}
+	r->head = 0;
+	r->tail = r->cap;
+	r->cap *= 2;
+	
+	skynet_free(r->queue);
+	r->queue = new_queue;
+}
+
+static void
+ring_push(struct message_ring *r, struct skynet_message *message) {
+	r->queue[r->tail] = *message;
+	if (++ r->tail >= r->cap) {
+		r->tail = 0;
+	}
+
+	if (r->head == r->tail) {
+		expand_ring(r);
+	}
 }
 
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
 	q->handle = handle;
-	q->cap = DEFAULT_QUEUE_SIZE;
-	q->head = 0;
-	q->tail = 0;
+	ring_init(&q->lane[MQ_LANE_HIGH], LANE ? MQ_HIGH_QUEUE_SIZE : 0);
+	ring_init(&q->lane[MQ_LANE_NORMAL], DEFAULT_QUEUE_SIZE);
 	SPIN_INIT(q)
 	// When the queue is create (always between service create and service init) ,
 	// set in_global flag to avoid push it to global queue .
@@ -89,7 +477,7 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
+	q->affinity = -1;
 	q->next = NULL;
 
 	return q;
@@ -99,39 +487,41 @@ static void
 _release(struct message_queue *q) {
 	assert(q->next == NULL);
 	SPIN_DESTROY(q)
-	skynet_free(q->queue);
+	int i;
+	for (i=0;i<MQ_LANES;i++) {
+		skynet_free(q->lane[i].queue);
+	}
 	skynet_free(q);
 }
 
-uint32_t 
-skynet_mq_handle(struct message_queue *q) {
-	return q->handle;
-}
-
 int
 skynet_mq_length(struct message_queue *q) {
-	int head, tail,cap;
+	int length;
 
 	SPIN_LOCK(q)
-	head = q->head;
-	tail = q->tail;
-	cap = q->cap;
+	length = ring_length(&q->lane[MQ_LANE_HIGH]) + ring_length(&q->lane[MQ_LANE_NORMAL]);
 	SPIN_UNLOCK(q)
-	
-	if (head <= tail) {
-		return tail - head;
-	}
-	return tail + cap - head;
+
+	return length;
 }
 
 int
-skynet_mq_overload(struct message_queue *q) {
-	if (q->overload) {
-		int overload = q->overload;
-		q->overload = 0;
-		return overload;
-	} 
-	return 0;
+skynet_mq_lane_length(struct message_queue *q, int lane) {
+	int length;
+
+	SPIN_LOCK(q)
+	length = ring_length(&q->lane[lane]);
+	SPIN_UNLOCK(q)
+
+	return length;
+}
+
+static inline void
+check_overload(struct message_queue *q, int length) {
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
 }
 
 int
@@ -139,24 +529,15 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 	int ret = 1;
 	SPIN_LOCK(q)
 
-	if (q->head != q->tail) {
-		*message = q->queue[q->head++];
-		ret = 0;
-		int head = q->head;
-		int tail = q->tail;
-		int cap = q->cap;
+	struct message_ring *high = &q->lane[MQ_LANE_HIGH];
+	struct message_ring *normal = &q->lane[MQ_LANE_NORMAL];
+	int hlen = ring_length(high);
+	int nlen = ring_length(normal);
 
-		if (head >= cap) {
-			q->head = head = 0;
-		}
-		int length = tail - head;
-		if (length < 0) {
-			length += cap;
-		}
-		while (length > q->overload_threshold) {
-			q->overload = length;
-			q->overload_threshold *= 2;
-		}
+	if (hlen + nlen > 0) {
+		ring_pop(hlen > 0 ? high : normal, message, 1);
+		ret = 0;
+		check_overload(q, hlen + nlen - 1);
 	} else {
 		// reset overload_threshold when queue is empty
 		q->overload_threshold = MQ_OVERLOAD;
@@ -171,19 +552,43 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 	return ret;
 }
 
-static void
-expand_queue(struct message_queue *q) {
-	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * q->cap * 2);
-	int i;
-	for (i=0;i<q->cap;i++) {
-		new_queue[i] = q->queue[(q->head + i) % q->cap];
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *batch, int max, int weight, int *budget) {
+	int n = 0;
+	SPIN_LOCK(q)
+
+	struct message_ring *high = &q->lane[MQ_LANE_HIGH];
+	struct message_ring *normal = &q->lane[MQ_LANE_NORMAL];
+	int hlen = ring_length(high);
+	int length = hlen + ring_length(normal);
+	if (length > 0) {
+		if (*budget == 0) {
+			*budget = batch_budget(length, weight);
+		}
+		n = length;
+		if (n > *budget)
+			n = *budget;
+		if (n > max)
+			n = max;
+		// high lane first
+		if (hlen >= n) {
+			ring_pop(high, batch, n);
+		} else {
+			ring_pop(high, batch, hlen);
+			ring_pop(normal, batch + hlen, n - hlen);
+		}
+		*budget -= n;
+		// report the length after the first message popped, as skynet_mq_pop does
+		check_overload(q, length - 1);
+	} else {
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		q->in_global = 0;
 	}
-	q->head = 0;
-	q->tail = q->cap;
-	q->cap *= 2;
-	
-	skynet_free(q->queue);
-	q->queue = new_queue;
+
+	SPIN_UNLOCK(q)
+
+	return n;
 }
 
 void 
@@ -191,29 +596,21 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);
 	SPIN_LOCK(q)
 
-	q->queue[q->tail] = *message;
-	if (++ q->tail >= q->cap) {
-		q->tail = 0;
-	}
-
-	if (q->head == q->tail) {
-		expand_queue(q);
-	}
+	ring_push(&q->lane[message_lane(message)], message);
 
+	int activate = 0;
+	int worker = -1;
 	if (q->in_global == 0) {
 		q->in_global = MQ_IN_GLOBAL;
-		skynet_globalmq_push(q);
+		worker = activate_queue(q);
+		activate = 1;
 	}
 	
 	SPIN_UNLOCK(q)
-}
 
-void 
-skynet_mq_init() {
-	struct global_queue *q = skynet_malloc(sizeof(*q));
-	memset(q,0,sizeof(*q));
-	SPIN_INIT(q);
-	Q=q;
+	if (activate) {
+		unpark_worker(worker);
+	}
 }
 
 void 
@@ -227,14 +624,7 @@ skynet_mq_mark_release(struct message_queue *q) {
 	SPIN_UNLOCK(q)
 }
 
-static void
-_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
-	struct skynet_message msg;
-	while(!skynet_mq_pop(q, &msg)) {
-		drop_func(&msg, ud);
-	}
-	_release(q);
-}
+static void _drop_queue(struct message_queue *q, message_drop drop_func, void *ud);
 
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
@@ -248,3 +638,275 @@ skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 		SPIN_UNLOCK(q)
 	}
 }
+
+#else
+
+static struct message_segment *
+segment_new(struct message_queue *q, size_t base) {
+	struct message_segment *seg = (struct message_segment *)ATOM_EXCHANGE_POINTER(&q->spare, (uintptr_t)NULL);
+	if (seg == NULL) {
+		seg = skynet_malloc(sizeof(*seg));
+	}
+	ATOM_INIT(&seg->next, (uintptr_t)NULL);
+	seg->base = base;
+	seg->retired = NULL;
+	int i;
+	for (i=0;i<MQ_SEGMENT_SIZE;i++) {
+		ATOM_INIT(&seg->slot[i].ready, 0);
+	}
+	return seg;
+}
+
+static void
+lane_init(struct message_queue *q, struct message_lane *l, int used) {
+	struct message_segment *seg = used ? segment_new(q, 0) : NULL;
+	ATOM_INIT(&l->tail, 0);
+	ATOM_INIT(&l->tail_seg, (uintptr_t)seg);
+	ATOM_INIT(&l->head, 0);
+	l->head_seg = seg;
+	l->retired = NULL;
+}
+
+struct message_queue * 
+skynet_mq_create(uint32_t handle) {
+	struct message_queue *q = skynet_malloc(sizeof(*q));
+	q->handle = handle;
+	// See the comment in the spinlock version, init success will push it to global queue.
+	ATOM_INIT(&q->in_global, MQ_IN_GLOBAL);
+	ATOM_INIT(&q->release, 0);
+	q->overload = 0;
+	q->overload_threshold = MQ_OVERLOAD;
+	ATOM_INIT(&q->pushing, 0);
+	ATOM_INIT(&q->spare, (uintptr_t)NULL);
+	lane_init(q, &q->lane[MQ_LANE_HIGH], LANE);
+	lane_init(q, &q->lane[MQ_LANE_NORMAL], 1);
+	q->affinity = -1;
+	q->next = NULL;
+
+	return q;
+}
+
+static void
+free_retired(struct message_queue *q, struct message_lane *l) {
+	struct message_segment *seg = l->retired;
+	l->retired = NULL;
+	while (seg) {
+		struct message_segment *next = seg->retired;
+		if (!ATOM_CAS_POINTER(&q->spare, (uintptr_t)NULL, (uintptr_t)seg)) {
+			skynet_free(seg);
+		}
+		seg = next;
+	}
+}
+
+static void 
+_release(struct message_queue *q) {
+	assert(q->next == NULL);
+	int i;
+	for (i=0;i<MQ_LANES;i++) {
+		struct message_lane *l = &q->lane[i];
+		free_retired(q, l);
+		struct message_segment *seg = l->head_seg;
+		while (seg) {
+			struct message_segment *next = (struct message_segment *)ATOM_LOAD(&seg->next);
+			skynet_free(seg);
+			seg = next;
+		}
+	}
+	skynet_free((void *)ATOM_LOAD(&q->spare));
+	skynet_free(q);
+}
+
+static inline int
+lane_length(struct message_lane *l) {
+	size_t tail = ATOM_LOAD(&l->tail);
+	size_t head = ATOM_LOAD(&l->head);
+	return (int)(tail - head);
+}
+
+int
+skynet_mq_length(struct message_queue *q) {
+	return lane_length(&q->lane[MQ_LANE_HIGH]) + lane_length(&q->lane[MQ_LANE_NORMAL]);
+}
+
+int
+skynet_mq_lane_length(struct message_queue *q, int lane) {
+	return lane_length(&q->lane[lane]);
+}
+
+// return the slot of head position, or NULL if the message is not ready
+static struct message_slot *
+head_slot(struct message_queue *q, struct message_lane *l) {
+	struct message_segment *seg = l->head_seg;
+	if (seg == NULL)
+		return NULL;
+	size_t idx = ATOM_LOAD(&l->head) - seg->base;
+	if (idx == MQ_SEGMENT_SIZE) {
+		struct message_segment *next = (struct message_segment *)ATOM_LOAD(&seg->next);
+		if (next == NULL)
+			return NULL;
+		// Producers which loaded the old tail_seg may still walk through it, so retire it first.
+		seg->retired = l->retired;
+		l->retired = seg;
+		l->head_seg = seg = next;
+		idx = 0;
+	}
+	if (l->retired && ATOM_LOAD(&q->pushing) == 0) {
+		free_retired(q, l);
+	}
+	struct message_slot *slot = &seg->slot[idx];
+	if (!ATOM_LOAD(&slot->ready))
+		return NULL;
+	return slot;
+}
+
+static int
+pop_ready(struct message_queue *q, struct skynet_message *message) {
+	// high lane first
+	struct message_lane *l = &q->lane[MQ_LANE_HIGH];
+	struct message_slot *slot = head_slot(q, l);
+	if (slot == NULL) {
+		l = &q->lane[MQ_LANE_NORMAL];
+		slot = head_slot(q, l);
+		if (slot == NULL)
+			return 0;
+	}
+	*message = slot->msg;
+	ATOM_STORE(&l->head, ATOM_LOAD(&l->head) + 1);
+	int length = skynet_mq_length(q);
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+	return 1;
+}
+
+static void
+pop_empty(struct message_queue *q) {
+	// reset overload_threshold when queue is empty
+	q->overload_threshold = MQ_OVERLOAD;
+	if (skynet_mq_length(q) != 0) {
+		// A producer has reserved the head position but not published it yet.
+		// Keep in_global set and reschedule q, the producer won't do it.
+		skynet_globalmq_push(q);
+		return;
+	}
+	ATOM_STORE(&q->in_global, 0);
+	// A producer may reserve a position before in_global is cleared, and see in_global still set.
+	// Don't touch the consumer side after clearing in_global, other worker may own q now.
+	if (skynet_mq_length(q) != 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	if (pop_ready(q, message))
+		return 0;
+	pop_empty(q);
+	return 1;
+}
+
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *batch, int max, int weight, int *budget) {
+	if (*budget == 0) {
+		*budget = batch_budget(skynet_mq_length(q), weight);
+	}
+	int n = 0;
+	// only the first pop releases the queue when it's empty, see skynet_mq_pop_batch in spinlock version
+	while (n < max && n < *budget && pop_ready(q, &batch[n])) {
+		++n;
+	}
+	if (n == 0) {
+		pop_empty(q);
+	}
+	*budget -= n;
+	return n;
+}
+
+void 
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	assert(message);
+	struct message_lane *l = &q->lane[message_lane(message)];
+	ATOM_FINC(&q->pushing);
+	// load tail_seg before reserving position, so seg->base <= pos
+	struct message_segment *seg = (struct message_segment *)ATOM_LOAD(&l->tail_seg);
+	assert(seg);
+	size_t pos = ATOM_FINC(&l->tail);
+	while (pos - seg->base >= MQ_SEGMENT_SIZE) {
+		struct message_segment *next = (struct message_segment *)ATOM_LOAD(&seg->next);
+		if (next == NULL) {
+			struct message_segment *nseg = segment_new(q, seg->base + MQ_SEGMENT_SIZE);
+			if (ATOM_CAS_POINTER(&seg->next, (uintptr_t)NULL, (uintptr_t)nseg)) {
+				next = nseg;
+			} else {
+				skynet_free(nseg);
+				next = (struct message_segment *)ATOM_LOAD(&seg->next);
+			}
+		}
+		// tail_seg only moves forward, it's ok to fail
+		ATOM_CAS_POINTER(&l->tail_seg, (uintptr_t)seg, (uintptr_t)next);
+		seg = next;
+	}
+	struct message_slot *slot = &seg->slot[pos - seg->base];
+	slot->msg = *message;
+	ATOM_STORE(&slot->ready, 1);
+	ATOM_FDEC(&q->pushing);
+
+	if (ATOM_LOAD(&q->in_global) == 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		unpark_worker(activate_queue(q));
+	}
+}
+
+void 
+skynet_mq_mark_release(struct message_queue *q) {
+	assert(ATOM_LOAD(&q->release) == 0);
+	ATOM_STORE(&q->release, 1);
+	if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+static void _drop_queue(struct message_queue *q, message_drop drop_func, void *ud);
+
+void 
+skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	if (ATOM_LOAD(&q->release)) {
+		_drop_queue(q, drop_func, ud);
+	} else {
+		skynet_globalmq_push(q);
+	}
+}
+
+#endif
+
+static void
+_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
+	struct skynet_message msg;
+	while(!skynet_mq_pop(q, &msg)) {
+		drop_func(&msg, ud);
+	}
+	_release(q);
+}
+
+void 
+skynet_mq_init(int worker, int steal) {
+	struct global_queue *q = skynet_malloc(sizeof(*q));
+	memset(q,0,sizeof(*q));
+	SPIN_INIT(q);
+	ATOM_INIT(&q->count, 0);
+	q->worker = 0;
+	q->local = NULL;
+	if (steal && worker > 1) {
+		q->worker = worker;
+		q->local = skynet_malloc(worker * sizeof(struct local_queue));
+		memset(q->local, 0, worker * sizeof(struct local_queue));
+		int i;
+		for (i=0;i<worker;i++) {
+			struct local_queue *lq = &q->local[i];
+			SPIN_INIT(lq)
+			ATOM_INIT(&lq->count, 0);
+		}
+	}
+	Q=q;
+}
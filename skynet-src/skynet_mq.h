@@ -17,8 +17,19 @@ struct skynet_message {
 
 struct message_queue;
 
+// When work stealing is on, a worker thread pushes to / pops from its own local queue first.
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+// steal queues from other workers, return NULL when work stealing is off
+struct message_queue * skynet_mq_steal(void);
+void skynet_mq_register_worker(int id);
+// push an activated queue back to the worker last ran it, work stealing only
+void skynet_mq_affinity_enable(int enable);
+// called when a queue becomes active, to wake a parked worker. worker is the preferred one, or -1 for any
+typedef void (*mq_unpark)(int worker);
+void skynet_mq_unpark_hook(mq_unpark func);
+// return 1 if the global queue or the local queue of any worker is not empty
+int skynet_mq_pending(void);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -31,11 +42,20 @@ uint32_t skynet_mq_handle(struct message_queue *);
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
+// Pop at most max messages into batch in one critical section, return the number of messages (0 for empty, like skynet_mq_pop returns 1).
+// *budget is the number of messages left in this dispatch turn, init it to 0 and it's set by the queue length and weight at first pop.
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *batch, int max, int weight, int *budget);
 
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
+// priority lanes, response and system messages go to high lane if it's enabled
+#define MQ_LANE_HIGH 0
+#define MQ_LANE_NORMAL 1
+#define MQ_LANES 2
+int skynet_mq_lane_length(struct message_queue *q, int lane);
+void skynet_mq_lane_enable(int enable);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+void skynet_mq_init(int worker, int steal);
 
 #endif
@@ -4,17 +4,101 @@
 #include "skynet_socket.h"
 #include "skynet_server.h"
 #include "skynet_mq.h"
+#include "skynet_imp.h"
+#include "atomic.h"
 
+#include <pthread.h>
+#include <unistd.h>
 #include <string.h>
 #include <time.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>   // 包含 mkdir 函数的声明
 #include <sys/types.h>  // 包含类型定义
 
 #define PROTOCOL_UDP 1
 #define PROTOCOL_UDPv6 2
 
+// The owner service appends records into a chain of blocks (single producer, lock free),
+// and the record writer thread flushes them to the file, so the worker never blocks on disk.
+#define RECORD_BLOCK_SIZE (64 * 1024)
+#define RECORD_FLUSH_INTERVAL 1000	// microsecond, writer thread sleeps when there is nothing to flush
+#define RECORD_RETIRE_DELAY 100	// centisecond, a closed record file is finalized after this grace period
+#define RECORD_DUMP_INTERVAL 1000	// centisecond, lua errors dump a flight recorder once in this interval at most
+
+#define RECORD_OPEN 0
+#define RECORD_CLOSE 1	// finalize with 'c'
+#define RECORD_RELEASE 2	// the context is deleted, just close the file
+
+struct record_block {
+	ATOM_POINTER next;
+	ATOM_SIZET used;	// published by producer
+	size_t flushed;	// writer thread only
+	char data[RECORD_BLOCK_SIZE];
+};
+
+struct record_file {
+	FILE *f;
+	struct record_file *next;	// writer list
+	struct record_block *head;	// writer thread side
+	struct record_block *tail;	// producer side
+	size_t used;	// producer side, bytes in tail not published yet
+	ATOM_SIZET backlog;	// bytes appended but not flushed
+	size_t backlog_limit;
+	int overflow;
+	ATOM_INT state;
+	uint64_t closetime;
+	uint64_t offset;	// producer side, bytes committed
+	uint64_t msgno;
+	struct record_index *index;
+	int index_n;
+	int index_cap;
+	int group;	// member of a record group, write 'q' before each group
+	// flight recorder : keep the tail of the records in memory, and write them only on demand
+	size_t flight;	// bytes kept, 0 if it's not a flight recorder
+	uint64_t flighttime;	// centisecond kept, 0 no limit
+	char *path;
+	uint64_t base;	// offset of head->data[0]
+	char *prologue;	// the records before the second message, always kept
+	size_t prologue_sz;
+	int flight_head;	// index is a circular queue of the message groups in memory
+	uint64_t dropped;	// messages dropped
+	uint64_t dumped;	// offset of the last dump
+	uint64_t dumptime;
+	int dump_pending;	// a lua error within RECORD_DUMP_INTERVAL, dump at the next message after the interval
+	struct record_file *flight_next;
+};
+
+// The replay reader maps the whole record file and parses records in place,
+// payloads are copied only when they are pushed to the service.
+// It falls back to stdio if the file can't be mapped.
+struct record_reader {
+	FILE *f;	// NULL if mapped
+	const char *data;
+	size_t size;
+	size_t pos;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct record_file *list;
+	int running;
+	ATOM_INT quit;
+	pthread_t thread;
+	struct record_file *flight;	// flight recorders, dumped at exit
+	int crash_handler;
+	size_t backlog;	// max bytes of a record file buffered in memory, 0 for unlimited
+} W = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+void
+skynet_record_init(size_t backlog) {
+	W.backlog = backlog;
+}
+
 /* 全局 lua 字符串 hash 种子，供 snlua 在创建 lua_State 时使用 */
 static unsigned int g_strseed = 0;
 
@@ -28,15 +112,497 @@ skynet_get_strseed(void) {
 	return g_strseed;
 }
 
-static inline uint64_t unpackNumberValue(FILE* f, size_t len) {
-    uint64_t value;
-    if (fread(&value, len, 1, f) != 1) {
+static inline int
+reader_read(struct record_reader *r, void *buf, size_t sz) {
+	if (r->data) {
+		if (r->size - r->pos < sz) {
+			r->pos = r->size;
+			return 0;
+		}
+		memcpy(buf, r->data + r->pos, sz);
+	} else if (fread(buf, sz, 1, r->f) != 1) {
+		return 0;
+	}
+	r->pos += sz;
+	return 1;
+}
+
+static inline uint64_t unpackNumberValue(struct record_reader *r, size_t len) {
+    uint64_t value = 0;
+    if (!reader_read(r, &value, len)) {
         skynet_error(NULL, "read recordfile err");
         return 0;
     }
     return value;
 }
 
+// read the fixed size header of a record at once
+#define HEADER(ptr, v) (memcpy(&(v), ptr, sizeof(v)), ptr += sizeof(v))
+
+// the payload is pushed to the service, so it must be copied out of the mapping
+static char *
+reader_payload(struct record_reader *r, size_t sz) {
+	char *buffer = skynet_malloc(sz);
+	if (sz > 0 && !reader_read(r, buffer, sz)) {
+		skynet_free(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+static struct record_block *
+block_new() {
+	struct record_block *b = skynet_malloc(sizeof(*b));
+	ATOM_INIT(&b->next, (uintptr_t)NULL);
+	ATOM_INIT(&b->used, 0);
+	b->flushed = 0;
+	return b;
+}
+
+static void
+record_append(struct record_file *rf, const void *data, size_t sz) {
+	const char *ptr = data;
+	while (sz > 0) {
+		struct record_block *b = rf->tail;
+		if (rf->used == RECORD_BLOCK_SIZE) {
+			struct record_block *nb = block_new();
+			ATOM_STORE(&b->used, rf->used);
+			ATOM_STORE(&b->next, (uintptr_t)nb);
+			rf->tail = b = nb;
+			rf->used = 0;
+		}
+		size_t n = RECORD_BLOCK_SIZE - rf->used;
+		if (n > sz)
+			n = sz;
+		memcpy(b->data + rf->used, ptr, n);
+		rf->used += n;
+		ptr += n;
+		sz -= n;
+	}
+}
+
+// publish the appended bytes of a record to the writer thread
+static inline void
+record_commit(struct record_file *rf, size_t sz) {
+	ATOM_STORE(&rf->tail->used, rf->used);
+	ATOM_FADD(&rf->backlog, sz);
+	rf->offset += sz;
+}
+
+// index the record to be appended
+static void
+index_add(struct record_file *rf, uint64_t time, int checkpoint) {
+	if (rf->index_n >= rf->index_cap) {
+		int cap = rf->index_cap ? rf->index_cap * 2 : 64;
+		struct record_index *index = skynet_malloc(cap * sizeof(*index));
+		if (rf->index_n > 0) {
+			memcpy(index, rf->index, rf->index_n * sizeof(*index));
+		}
+		skynet_free(rf->index);
+		rf->index = index;
+		rf->index_cap = cap;
+	}
+	struct record_index *r = &rf->index[rf->index_n++];
+	r->offset = rf->offset;
+	r->msgno = rf->msgno;
+	r->time = time;
+	r->checkpoint = checkpoint;
+	r->reserved = 0;
+}
+
+static void flight_mark(struct record_file *rf, uint64_t time, int checkpoint);
+static void flight_dump(struct record_file *rf, int crash);
+
+static inline void
+index_message(struct record_file *rf, uint64_t time) {
+	if (rf->flight) {
+		flight_mark(rf, time, 0);
+	} else if (rf->msgno % SKYNET_RECORD_INDEX_INTERVAL == 0) {
+		index_add(rf, time, 0);
+	}
+	++rf->msgno;
+}
+
+// the in-memory backlog is bounded like recordlimit: recording stops when the disk can't keep up.
+static int
+record_reserve(struct skynet_context *ctx, struct record_file *rf, size_t sz) {
+	if (rf->overflow)
+		return 0;
+	if (ATOM_LOAD(&rf->backlog) + sz > rf->backlog_limit) {
+		rf->overflow = 1;
+		skynet_error(ctx, "Record backlog exceed %zu bytes, stop recording", rf->backlog_limit);
+		return 0;
+	}
+	return 1;
+}
+
+#define APPEND(rf, v) record_append(rf, &(v), sizeof(v))
+
+// The files of a record group share the sequence, replay merges them by it.
+static ATOM_SIZET G_SEQ = 0;
+
+#define SEQUENCE_SIZE(rf) ((rf)->group ? 1 + sizeof(uint64_t) : 0)
+
+static void
+record_sequence(struct record_file *rf) {
+	if (rf->group) {
+		uint64_t seq = ATOM_FINC(&G_SEQ);
+		record_append(rf, "q", 1);
+		APPEND(rf, seq);
+	}
+}
+
+// return bytes flushed
+static size_t
+record_flush(struct record_file *rf) {
+	size_t total = 0;
+	for (;;) {
+		struct record_block *b = rf->head;
+		struct record_block *next = (struct record_block *)ATOM_LOAD(&b->next);
+		// read used after next, the producer doesn't touch b after publishing next
+		size_t used = ATOM_LOAD(&b->used);
+		if (used > b->flushed) {
+			size_t n = used - b->flushed;
+			fwrite(b->data + b->flushed, n, 1, rf->f);
+			b->flushed = used;
+			total += n;
+		}
+		if (next == NULL)
+			break;
+		rf->head = next;
+		skynet_free(b);
+	}
+	if (total > 0) {
+		ATOM_FSUB(&rf->backlog, total);
+	}
+	return total;
+}
+
+static void
+record_write_index(FILE *f, const struct record_index *index, int index_n) {
+	uint64_t offset = (uint64_t)ftell(f);
+	uint32_t n = (uint32_t)index_n;
+	fprintf(f, "x");
+	fwrite(&n, sizeof(n), 1, f);
+	if (n > 0) {
+		fwrite(index, sizeof(struct record_index), n, f);
+	}
+	fwrite(&offset, sizeof(offset), 1, f);
+	fwrite(SKYNET_RECORD_INDEX_MAGIC, sizeof(SKYNET_RECORD_INDEX_MAGIC) - 1, 1, f);
+}
+
+static void
+record_finalize(struct record_file *rf) {
+	record_flush(rf);
+	if (ATOM_LOAD(&rf->state) == RECORD_CLOSE) {
+		fprintf(rf->f, "c");
+		fwrite(&rf->closetime, sizeof(rf->closetime), 1, rf->f);
+	}
+	record_write_index(rf->f, rf->index, rf->index_n);
+	fflush(rf->f);
+	fclose(rf->f);
+	skynet_free(rf->index);
+	skynet_free(rf->head);
+	skynet_free(rf);
+}
+
+// The flight recorder is never registered to the writer thread, the owner service trims and dumps it.
+// rf->index holds the message groups still in memory, oldest first.
+
+// write(2) is used by the dump, it may run in a signal handler (See flight_crash)
+static void
+flight_write(int fd, const void *data, size_t sz) {
+	const char *ptr = data;
+	while (sz > 0) {
+		ssize_t n = write(fd, ptr, sz);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		ptr += n;
+		sz -= n;
+	}
+}
+
+// copy the bytes [from, to) in the blocks to dst, or write them to fd
+static void
+flight_read(struct record_file *rf, uint64_t from, uint64_t to, char *dst, int fd) {
+	struct record_block *b = rf->head;
+	uint64_t base = rf->base;
+	while (from < to) {
+		if (from >= base + RECORD_BLOCK_SIZE) {
+			b = (struct record_block *)ATOM_LOAD(&b->next);
+			base += RECORD_BLOCK_SIZE;
+			continue;
+		}
+		size_t off = (size_t)(from - base);
+		size_t n = RECORD_BLOCK_SIZE - off;
+		if (n > to - from)
+			n = (size_t)(to - from);
+		if (dst) {
+			memcpy(dst, b->data + off, n);
+			dst += n;
+		} else {
+			flight_write(fd, b->data + off, n);
+		}
+		from += n;
+	}
+}
+
+static inline struct record_index *
+flight_group(struct record_file *rf, int i) {
+	return &rf->index[(rf->flight_head + i) % rf->index_cap];
+}
+
+// a message group (or a checkpoint) begins at rf->offset, drop the oldest groups out of the limits
+static void
+flight_mark(struct record_file *rf, uint64_t time, int checkpoint) {
+	if (rf->prologue == NULL) {
+		if (rf->msgno == 0)
+			return;
+		// the start and the first message (skynet.start) are needed to replay from a checkpoint
+		rf->prologue_sz = (size_t)rf->offset;
+		rf->prologue = skynet_malloc(rf->prologue_sz);
+		flight_read(rf, 0, rf->offset, rf->prologue, -1);
+	}
+	if (rf->dump_pending && time >= rf->dumptime + RECORD_DUMP_INTERVAL) {
+		// the groups before are complete
+		rf->dump_pending = 0;
+		flight_dump(rf, 0);
+	}
+	if (rf->index_n >= rf->index_cap) {
+		int cap = rf->index_cap ? rf->index_cap * 2 : 64;
+		struct record_index *index = skynet_malloc(cap * sizeof(*index));
+		int i;
+		for (i=0;i<rf->index_n;i++) {
+			index[i] = *flight_group(rf, i);
+		}
+		skynet_free(rf->index);
+		rf->index = index;
+		rf->index_cap = cap;
+		rf->flight_head = 0;
+	}
+	struct record_index *r = flight_group(rf, rf->index_n++);
+	r->offset = rf->offset;
+	r->msgno = rf->msgno;
+	r->time = time;
+	r->checkpoint = checkpoint;
+	r->reserved = 0;
+
+	// keep the new group at least
+	while (rf->index_n > 1) {
+		struct record_index *first = flight_group(rf, 0);
+		if (rf->offset - first->offset <= rf->flight && (rf->flighttime == 0 || first->time + rf->flighttime >= time))
+			break;
+		if (!first->checkpoint) {
+			++rf->dropped;
+		}
+		rf->flight_head = (rf->flight_head + 1) % rf->index_cap;
+		--rf->index_n;
+	}
+	uint64_t start = flight_group(rf, 0)->offset;
+	while (rf->head != rf->tail && rf->base + RECORD_BLOCK_SIZE <= start) {
+		struct record_block *b = rf->head;
+		rf->head = (struct record_block *)ATOM_LOAD(&b->next);
+		rf->base += RECORD_BLOCK_SIZE;
+		skynet_free(b);
+	}
+}
+
+// write the records in memory to the record file (overwrite the last dump).
+// If some messages are dropped, it begins with the prologue, and replay restores the first checkpoint kept.
+// It doesn't allocate memory nor use stdio, because it's called by flight_crash in a signal handler.
+static void
+flight_dump(struct record_file *rf, int crash) {
+	if (rf->msgno == 0 || rf->dumped == rf->offset)
+		return;
+	int fd = open(rf->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		if (!crash)
+			skynet_error(NULL, "Open record file %s fail %s", rf->path, strerror(errno));
+		return;
+	}
+	uint64_t start = 0;
+	int from = 0;
+	int truncated = 0;
+	if (rf->prologue) {
+		flight_write(fd, rf->prologue, rf->prologue_sz);
+		start = rf->index_n > 0 ? flight_group(rf, 0)->offset : rf->offset;
+		if (rf->dropped > 0) {
+			for (from=0;from<rf->index_n;from++) {
+				if (flight_group(rf, from)->checkpoint)
+					break;
+			}
+			if (from < rf->index_n) {
+				start = flight_group(rf, from)->offset;
+				truncated = 1;
+			} else {
+				from = 0;
+				if (!crash)
+					skynet_error(NULL, "Flight record %s dropped %" PRIu64 " messages without checkpoint, the replay may diverge", rf->path, rf->dropped);
+			}
+		}
+	}
+	flight_read(rf, start, rf->offset, NULL, fd);
+
+	// the index, same as record_write_index
+	uint64_t offset = rf->offset - start + rf->prologue_sz;
+	uint32_t n = 0;
+	int i;
+	for (i=from;i<rf->index_n;i++) {
+		struct record_index *r = flight_group(rf, i);
+		if (r->checkpoint || r->msgno % SKYNET_RECORD_INDEX_INTERVAL == 0)
+			++n;
+	}
+	flight_write(fd, "x", 1);
+	flight_write(fd, &n, sizeof(n));
+	for (i=from;i<rf->index_n;i++) {
+		struct record_index r = *flight_group(rf, i);
+		if (r.checkpoint || r.msgno % SKYNET_RECORD_INDEX_INTERVAL == 0) {
+			r.offset = r.offset - start + rf->prologue_sz;
+			if (truncated) {
+				r.checkpoint = SKYNET_RECORD_INDEX_TRUNCATED;
+				truncated = 0;
+			}
+			flight_write(fd, &r, sizeof(r));
+		}
+	}
+	flight_write(fd, &offset, sizeof(offset));
+	flight_write(fd, SKYNET_RECORD_INDEX_MAGIC, sizeof(SKYNET_RECORD_INDEX_MAGIC) - 1);
+	close(fd);
+	if (crash)
+		return;
+	rf->dumped = rf->offset;
+	rf->dumptime = skynet_now();
+	skynet_error(NULL, "Dump flight record %s (%" PRIu64 " messages dropped)", rf->path, rf->dropped);
+}
+
+// Dump the flight recorders on a fatal signal, then raise it again with the default action.
+// It's best effort : the owners are not stopped, and W.lock is not taken because the crashed thread may hold it.
+static void
+flight_crash(int sig) {
+	struct record_file *rf = W.flight;
+	while (rf) {
+		flight_dump(rf, 1);
+		rf = rf->flight_next;
+	}
+	raise(sig);
+}
+
+// install flight_crash for the signals not handled by others, W.lock is held
+static void
+flight_crash_handler() {
+	static const int sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM };
+	if (W.crash_handler)
+		return;
+	W.crash_handler = 1;
+	int i;
+	for (i=0;i<(int)(sizeof(sigs)/sizeof(sigs[0]));i++) {
+		struct sigaction old;
+		if (sigaction(sigs[i], NULL, &old) != 0 || old.sa_handler != SIG_DFL)
+			continue;
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = flight_crash;
+		sa.sa_flags = SA_RESETHAND;
+		sigemptyset(&sa.sa_mask);
+		sigaction(sigs[i], &sa, NULL);
+	}
+}
+
+static void
+flight_remove(struct record_file *rf) {
+	pthread_mutex_lock(&W.lock);
+	struct record_file **prev = &W.flight;
+	while (*prev != rf) {
+		prev = &(*prev)->flight_next;
+	}
+	*prev = rf->flight_next;
+	pthread_mutex_unlock(&W.lock);
+	while (rf->head) {
+		struct record_block *b = rf->head;
+		rf->head = (struct record_block *)ATOM_LOAD(&b->next);
+		skynet_free(b);
+	}
+	skynet_free(rf->prologue);
+	skynet_free(rf->index);
+	skynet_free(rf->path);
+	skynet_free(rf);
+}
+
+static void *
+thread_writer(void *p) {
+	for (;;) {
+		int quit = ATOM_LOAD(&W.quit);
+		size_t flushed = 0;
+		uint64_t now = skynet_now();
+		pthread_mutex_lock(&W.lock);
+		struct record_file **prev = &W.list;
+		struct record_file *rf = *prev;
+		pthread_mutex_unlock(&W.lock);
+		while (rf) {
+			flushed += record_flush(rf);
+			struct record_file *next = rf->next;
+			int state = ATOM_LOAD(&rf->state);
+			if (state != RECORD_OPEN && (quit || now - rf->closetime >= RECORD_RETIRE_DELAY)) {
+				// new files are only inserted at the head of the list
+				pthread_mutex_lock(&W.lock);
+				while (*prev != rf) {
+					prev = &(*prev)->next;
+				}
+				*prev = next;
+				pthread_mutex_unlock(&W.lock);
+				record_finalize(rf);
+			} else {
+				if (quit) {
+					fflush(rf->f);
+				}
+				prev = &rf->next;
+			}
+			rf = next;
+		}
+		if (quit)
+			break;
+		if (flushed == 0) {
+			usleep(RECORD_FLUSH_INTERVAL);
+		}
+	}
+	return NULL;
+}
+
+static void
+writer_register(struct record_file *rf) {
+	pthread_mutex_lock(&W.lock);
+	rf->next = W.list;
+	W.list = rf;
+	if (!W.running) {
+		W.running = 1;
+		if (pthread_create(&W.thread, NULL, thread_writer, NULL)) {
+			skynet_error(NULL, "Create record writer thread failed");
+			exit(1);
+		}
+	}
+	pthread_mutex_unlock(&W.lock);
+}
+
+void
+skynet_record_exit(void) {
+	pthread_mutex_lock(&W.lock);
+	int running = W.running;
+	struct record_file *rf = W.flight;
+	// the workers are gone, the services left don't append any more
+	while (rf) {
+		flight_dump(rf, 0);
+		rf = rf->flight_next;
+	}
+	pthread_mutex_unlock(&W.lock);
+	if (running) {
+		ATOM_STORE(&W.quit, 1);
+		pthread_join(W.thread, NULL);
+	}
+}
+
 static int create_dir(struct skynet_context* ctx, const char *path) {
     char buffer[256];
     char *pos = NULL;
@@ -67,7 +633,7 @@ static int create_dir(struct skynet_context* ctx, const char *path) {
     return 0; // 成功创建
 }
 
-FILE * 
+struct record_file * 
 skynet_record_open(struct skynet_context* ctx, uint32_t handle, const char* filename) {
 	const char * recordpath = skynet_getenv("recordpath");
 	if (recordpath == NULL)
@@ -87,55 +653,129 @@ skynet_record_open(struct skynet_context* ctx, uint32_t handle, const char* file
 	size_t sz = strlen(recordpath);
 	char tmp[sz + 256];
     memset(tmp, 0, sz + 256);
+	// "group/name" : a member of the record group, all the members are in the directory of the group
+	const char * group = strrchr(filename, '/');
+	if (group) {
+		sprintf(tmp, "%s/%.*s", recordpath, (int)(group - filename), filename);
+		if (create_dir(ctx, tmp) != 0) {
+			return NULL;
+		}
+	}
 	sprintf(tmp, "%s/%s.record", recordpath, filename);
-	FILE *f = fopen(tmp, "w+b");
-	if (f) {
-		uint32_t starttime = skynet_starttime();
-		uint64_t currenttime = skynet_now();
-		skynet_error(NULL, "Open record file %s", tmp);
-        fprintf(f, "%s", SKYNET_RECORD_VERSION);
-        fprintf(f, "o");
-        fwrite(&starttime, sizeof(starttime), 1, f);
-        fwrite(&currenttime, sizeof(currenttime), 1, f);
-        uint32_t strseed = g_strseed;
-        fwrite(&strseed, sizeof(strseed), 1, f);
-        skynet_record_add_limit_count(ctx, sizeof(starttime) + sizeof(currenttime) + sizeof(strseed) + 1);
+	// recordflight = bytes : flight recorder, the file is written only by dump
+	const char * flight = skynet_getenv("recordflight");
+	size_t flight_sz = flight ? strtoull(flight, NULL, 10) : 0;
+	FILE *f = NULL;
+	if (flight_sz == 0) {
+		f = fopen(tmp, "w+b");
+		if (f == NULL) {
+			skynet_error(ctx, "Open record file %s fail %s", tmp, strerror(errno));
+			return NULL;
+		}
+	}
+	struct record_file *rf = skynet_malloc(sizeof(*rf));
+	memset(rf, 0, sizeof(*rf));
+	rf->f = f;
+	rf->group = group != NULL;
+	rf->flight = flight_sz;
+	rf->head = rf->tail = block_new();
+	ATOM_INIT(&rf->backlog, 0);
+	ATOM_INIT(&rf->state, RECORD_OPEN);
+	rf->backlog_limit = W.backlog ? W.backlog : (size_t)-1;
+
+	if (flight_sz > 0) {
+		const char * flighttime = skynet_getenv("recordflighttime");
+		rf->flighttime = flighttime ? strtoull(flighttime, NULL, 10) : 0;
+		rf->path = skynet_strdup(tmp);
+		rf->backlog_limit = (size_t)-1;
+	}
+
+	uint32_t starttime = skynet_starttime();
+	uint64_t currenttime = skynet_now();
+	skynet_error(NULL, "Open %srecord file %s", flight_sz ? "flight " : "", tmp);
+	record_append(rf, SKYNET_RECORD_VERSION, sizeof(SKYNET_RECORD_VERSION) - 1);
+	record_append(rf, "o", 1);
+	APPEND(rf, starttime);
+	APPEND(rf, currenttime);
+	uint32_t strseed = g_strseed;
+	APPEND(rf, strseed);
+	size_t len = sizeof(SKYNET_RECORD_VERSION) - 1 + sizeof(starttime) + sizeof(currenttime) + sizeof(strseed) + 1;
+	record_commit(rf, len);
+	skynet_record_add_limit_count(ctx, len);
+	if (flight_sz > 0) {
+		pthread_mutex_lock(&W.lock);
+		rf->flight_next = W.flight;
+		W.flight = rf;
+		flight_crash_handler();
+		pthread_mutex_unlock(&W.lock);
 	} else {
-		skynet_error(ctx, "Open record file %s fail %s", tmp, strerror(errno));
+		writer_register(rf);
 	}
-    
-	return f;
+
+	return rf;
 }
 
 void 
-skynet_record_parse_open(FILE *f) {
-    uint32_t starttime = (uint32_t)unpackNumberValue(f, 4);
-    uint64_t currenttime = unpackNumberValue(f, 8);
-    uint32_t strseed = (uint32_t)unpackNumberValue(f, 4);
+skynet_record_parse_open(struct record_reader *r) {
+    uint32_t starttime = (uint32_t)unpackNumberValue(r, 4);
+    uint64_t currenttime = unpackNumberValue(r, 8);
+    uint32_t strseed = (uint32_t)unpackNumberValue(r, 4);
     
     skynet_timer_setstarttime(starttime);
 	skynet_timer_setcurrent(currenttime);
     skynet_error(NULL ,"skynet_record_parse_open starttime[%d] currenttime[%llu] strseed[%d]\n", starttime, currenttime, strseed);
 }
 
+// the writer thread finalizes the file later, because the owner may still be appending.
+// A flight recorder closed by the owner is discarded, and it's dumped if the service exits without closing it.
 void
-skynet_record_close(struct skynet_context* ctx, FILE *f, uint32_t handle) {
+skynet_record_close(struct skynet_context* ctx, struct record_file *rf, uint32_t handle) {
 	skynet_error(ctx, "Close record file :%08x", handle);
-    uint64_t currenttime = skynet_now();
-    fprintf(f, "c");
-    fwrite(&currenttime, sizeof(currenttime), 1, f);
-    fflush(f);
-	fclose(f);
+	if (rf->flight) {
+		flight_remove(rf);
+		return;
+	}
+	rf->closetime = skynet_now();
+	ATOM_STORE(&rf->state, RECORD_CLOSE);
+}
+
+void
+skynet_record_release(struct record_file *rf) {
+	if (rf->flight) {
+		flight_dump(rf, 0);
+		flight_remove(rf);
+		return;
+	}
+	rf->closetime = skynet_now();
+	ATOM_STORE(&rf->state, RECORD_RELEASE);
+}
+
+void
+skynet_record_dump(struct record_file *rf, int error) {
+	if (rf->flight == 0)
+		return;
+	if (error && rf->dumptime > 0 && skynet_now() < rf->dumptime + RECORD_DUMP_INTERVAL) {
+		// an error storm, dump once after the interval
+		rf->dump_pending = 1;
+		return;
+	}
+	rf->dump_pending = 0;
+	flight_dump(rf, 0);
+}
+
+int
+skynet_record_flight(struct record_file *rf) {
+	return rf->flight != 0;
 }
 
 void 
-skynet_record_parse_close(FILE *f) {
-    uint64_t currenttime = unpackNumberValue(f, 8);
+skynet_record_parse_close(struct record_reader *r) {
+    uint64_t currenttime = unpackNumberValue(r, 8);
     skynet_error(NULL, "Close Time: %lu", currenttime);
 }
 
 static void
-record_socket(struct skynet_context* ctx, FILE * f, struct skynet_socket_message * message, size_t sz) {
+record_socket(struct skynet_context* ctx, struct record_file * rf, struct skynet_socket_message * message, size_t sz) {
     uint64_t ti = skynet_now();
     const char *buffer = NULL;
     if (message->buffer == NULL) {
@@ -161,29 +801,44 @@ record_socket(struct skynet_context* ctx, FILE * f, struct skynet_socket_message
         }
     }
 
-    fprintf(f, "a");
-    fwrite(&message->type, sizeof(message->type), 1, f);
-    fwrite(&message->id, sizeof(message->id), 1, f);
-    fwrite(&message->ud, sizeof(message->ud), 1, f);
-    fwrite(&ti, sizeof(ti), 1, f);
-    fwrite(&sz, sizeof(sz), 1, f);
-    fwrite(buffer, sz, 1, f);
+    size_t len = SEQUENCE_SIZE(rf) + sizeof(message->type) + sizeof(message->id) + sizeof(message->ud) + sizeof(ti) + sizeof(sz) + sz + 1;
+    if (!record_reserve(ctx, rf, len)) {
+        return;
+    }
+    index_message(rf, ti);
+    record_sequence(rf);
+    record_append(rf, "a", 1);
+    APPEND(rf, message->type);
+    APPEND(rf, message->id);
+    APPEND(rf, message->ud);
+    APPEND(rf, ti);
+    APPEND(rf, sz);
+    record_append(rf, buffer, sz);
+    record_commit(rf, len);
 
-    skynet_record_add_limit_count(ctx, sizeof(message->type) + sizeof(message->id) + sizeof(message->ud) + sizeof(ti) + sizeof(sz) + sz + 1);
+    skynet_record_add_limit_count(ctx, len);
 }
 
-void 
-skynet_record_parse_socket(FILE *f, uint32_t handle) {
-    int type = (int)unpackNumberValue(f, 4);
-    int id = (int)unpackNumberValue(f, 4);
-    int ud = (int)unpackNumberValue(f, 4);
-    uint64_t ti = unpackNumberValue(f, 8);
-    size_t bufsz = (size_t)unpackNumberValue(f, 8);
-    char *buffer = skynet_malloc(bufsz);
-    if (bufsz > 0 && fread(buffer, bufsz, 1, f) != 1) {
-        skynet_free(buffer);
+int
+skynet_record_parse_socket(struct record_reader *r, uint32_t handle, struct record_message *msg) {
+    int type, id, ud;
+    uint64_t ti;
+    size_t bufsz;
+    char header[sizeof(type) + sizeof(id) + sizeof(ud) + sizeof(ti) + sizeof(bufsz)];
+    if (!reader_read(r, header, sizeof(header))) {
+        skynet_error(NULL, "Error record socket header");
+        return 0;
+    }
+    const char *ptr = header;
+    HEADER(ptr, type);
+    HEADER(ptr, id);
+    HEADER(ptr, ud);
+    HEADER(ptr, ti);
+    HEADER(ptr, bufsz);
+    char *buffer = reader_payload(r, bufsz);
+    if (buffer == NULL) {
         skynet_error(NULL, "Error record socket buffer %d", bufsz);
-        return;
+        return 0;
     }
 
     struct skynet_socket_message *sm;
@@ -210,174 +865,412 @@ skynet_record_parse_socket(FILE *f, uint32_t handle) {
         skynet_free(buffer);
     }
     
-    struct skynet_message message;
-    message.source = 0;
-    message.session = 0;
-    message.data = sm;
-    message.sz = smsz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
-
-    skynet_timer_setcurrent(ti);
-    skynet_context_push(handle, &message);
+    msg->handle = handle;
+    msg->time = ti;
+    msg->message.source = 0;
+    msg->message.session = 0;
+    msg->message.data = sm;
+    msg->message.sz = smsz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
+    return 1;
 }
 
 void 
-skynet_record_output(struct skynet_context* ctx, FILE *f, uint32_t source, int type, int session, void * buffer, size_t sz) {
+skynet_record_output(struct skynet_context* ctx, struct record_file *rf, uint32_t source, int type, int session, void * buffer, size_t sz) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
 
     if (type == PTYPE_SOCKET) {
-        record_socket(ctx, f, buffer, sz);
+        record_socket(ctx, rf, buffer, sz);
         return;
     }
     uint64_t ti = skynet_now();
-    fprintf(f,"m");
-    fwrite(&source, sizeof(source), 1, f);
-    fwrite(&type, sizeof(type), 1, f);
-    fwrite(&session, sizeof(session), 1, f);
-    fwrite(&ti, sizeof(ti), 1, f);
-    fwrite(&sz, sizeof(sz), 1, f);
-    fwrite(buffer, sz, 1, f);
+    size_t len = SEQUENCE_SIZE(rf) + sizeof(source) + sizeof(type) + sizeof(session) + sizeof(ti) + sizeof(sz) + sz + 1;
+    if (!record_reserve(ctx, rf, len)) {
+        return;
+    }
+    index_message(rf, ti);
+    record_sequence(rf);
+    record_append(rf, "m", 1);
+    APPEND(rf, source);
+    APPEND(rf, type);
+    APPEND(rf, session);
+    APPEND(rf, ti);
+    APPEND(rf, sz);
+    record_append(rf, buffer, sz);
+    record_commit(rf, len);
 
-    skynet_record_add_limit_count(ctx, sizeof(source) + sizeof(type) + sizeof(session) + sizeof(ti) + sizeof(sz) + sz + 1);
+    skynet_record_add_limit_count(ctx, len);
 }
 
-void
-skynet_record_parse_output(FILE *f, uint32_t handle) {
-    int source = (uint32_t)unpackNumberValue(f, 4);
-    int type = (int)unpackNumberValue(f, 4);
-    int session = (int)unpackNumberValue(f, 4);
-    uint64_t ti = unpackNumberValue(f, 8);
-    size_t bufsz = (size_t)unpackNumberValue(f, 8);
-    char *buffer = skynet_malloc(bufsz);
-    if (bufsz > 0 && fread(buffer, bufsz, 1, f) != 1) {
-        skynet_free(buffer);
+int
+skynet_record_parse_output(struct record_reader *r, uint32_t handle, struct record_message *msg) {
+    uint32_t source;
+    int type, session;
+    uint64_t ti;
+    size_t bufsz;
+    char header[sizeof(source) + sizeof(type) + sizeof(session) + sizeof(ti) + sizeof(bufsz)];
+    if (!reader_read(r, header, sizeof(header))) {
+        skynet_error(NULL, "Error record message header");
+        return 0;
+    }
+    const char *ptr = header;
+    HEADER(ptr, source);
+    HEADER(ptr, type);
+    HEADER(ptr, session);
+    HEADER(ptr, ti);
+    HEADER(ptr, bufsz);
+    char *buffer = reader_payload(r, bufsz);
+    if (buffer == NULL) {
         skynet_error(NULL, "Error record socket buffer %d", bufsz);
-        return;
+        return 0;
     }
 
-    struct skynet_message message;
-    message.source = source;
-    message.session = session;
-    message.data = buffer;					
-    message.sz = bufsz | ((size_t)type << MESSAGE_TYPE_SHIFT);
-
-    skynet_timer_setcurrent(ti);
-    skynet_context_push(handle, &message);
+    msg->handle = handle;
+    msg->time = ti;
+    msg->message.source = source;
+    msg->message.session = session;
+    msg->message.data = buffer;
+    msg->message.sz = bufsz | ((size_t)type << MESSAGE_TYPE_SHIFT);
+    return 1;
 }
 
 void
-skynet_record_start(struct skynet_context* ctx, FILE *f, const char* buffer) {
+skynet_record_start(struct skynet_context* ctx, struct record_file *rf, const char* buffer) {
     size_t len = strlen(buffer);
-    fprintf(f,"b");
-    fwrite(&len, sizeof(len), 1, f);
-    fwrite(buffer, len, 1, f);
+    size_t total = SEQUENCE_SIZE(rf) + sizeof(len) + len + 1;
+    record_sequence(rf);
+    record_append(rf, "b", 1);
+    APPEND(rf, len);
+    record_append(rf, buffer, len);
+    record_commit(rf, total);
 
-    skynet_record_add_limit_count(ctx, sizeof(len) + len + 1);
+    skynet_record_add_limit_count(ctx, total);
 }
 
 void 
-skynet_record_newsession(struct skynet_context* ctx, FILE *f, int session) {
+skynet_record_newsession(struct skynet_context* ctx, struct record_file *rf, int session) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
-    fprintf(f,"s");
-    fwrite(&session, sizeof(session), 1, f);
+    if (!record_reserve(ctx, rf, 5)) {
+        return;
+    }
+    record_append(rf, "s", 1);
+    APPEND(rf, session);
+    record_commit(rf, 5);
     skynet_record_add_limit_count(ctx, 5);
 }
 
 void 
-skynet_record_parse_newsession(FILE *f) {
-    int session = (int)unpackNumberValue(f, 4);
+skynet_record_parse_newsession(struct record_reader *r) {
+    int session = (int)unpackNumberValue(r, 4);
     skynet_record_push_session(session);
 }
 
 void 
-skynet_record_handle(struct skynet_context* ctx, FILE *f, uint32_t handle) {
+skynet_record_handle(struct skynet_context* ctx, struct record_file *rf, uint32_t handle) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
-    fprintf(f,"h");
-    fwrite(&handle, sizeof(handle), 1, f);
+    if (!record_reserve(ctx, rf, 5)) {
+        return;
+    }
+    record_append(rf, "h", 1);
+    APPEND(rf, handle);
+    record_commit(rf, 5);
     skynet_record_add_limit_count(ctx, 5);
 }
 
 void 
-skynet_record_parse_handle(FILE *f) {
-    uint32_t handle = (uint32_t)unpackNumberValue(f, 4);
+skynet_record_parse_handle(struct record_reader *r) {
+    uint32_t handle = (uint32_t)unpackNumberValue(r, 4);
     skynet_record_push_handle(handle);
 }
 
 void 
-skynet_record_socketid(struct skynet_context* ctx, FILE *f, int id) {
+skynet_record_socketid(struct skynet_context* ctx, struct record_file *rf, int id) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
-    fprintf(f,"k");
-    fwrite(&id, sizeof(id), 1, f);
+    if (!record_reserve(ctx, rf, 5)) {
+        return;
+    }
+    record_append(rf, "k", 1);
+    APPEND(rf, id);
+    record_commit(rf, 5);
     skynet_record_add_limit_count(ctx, 5);
 }
 
 void 
-skynet_record_parse_socketid(FILE *f) {
-    int id = (int)unpackNumberValue(f, 4);
+skynet_record_parse_socketid(struct record_reader *r) {
+    int id = (int)unpackNumberValue(r, 4);
     skynet_record_push_socketid(id);
 }
 
 void 
-skynet_record_randseed(struct skynet_context* ctx, FILE *f, int64_t x, int64_t y) {
+skynet_record_randseed(struct skynet_context* ctx, struct record_file *rf, int64_t x, int64_t y) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
-    fprintf(f,"r");
-    fwrite(&x, sizeof(x), 1, f);
-    fwrite(&y, sizeof(y), 1, f);
+    if (!record_reserve(ctx, rf, 17)) {
+        return;
+    }
+    record_append(rf, "r", 1);
+    APPEND(rf, x);
+    APPEND(rf, y);
+    record_commit(rf, 17);
     skynet_record_add_limit_count(ctx, 17);
 }
 
 void 
-skynet_record_parse_randseed(FILE *f) {
-    int64_t x = unpackNumberValue(f, 8);
-    int64_t y = unpackNumberValue(f, 8);
+skynet_record_parse_randseed(struct record_reader *r) {
+    int64_t x = unpackNumberValue(r, 8);
+    int64_t y = unpackNumberValue(r, 8);
     skynet_record_push_mathseek(x, y);
 }
 
 void 
-skynet_record_ostime(struct skynet_context* ctx, FILE *f, uint32_t ostime) {
+skynet_record_ostime(struct skynet_context* ctx, struct record_file *rf, uint32_t ostime) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
-    fprintf(f,"t");
-    fwrite(&ostime, sizeof(ostime), 1, f);
+    if (!record_reserve(ctx, rf, 5)) {
+        return;
+    }
+    record_append(rf, "t", 1);
+    APPEND(rf, ostime);
+    record_commit(rf, 5);
     skynet_record_add_limit_count(ctx, 5);
 }
 
 void 
-skynet_record_parse_ostime(FILE *f) {
-    uint32_t ostime = (uint32_t)unpackNumberValue(f, 4);
+skynet_record_parse_ostime(struct record_reader *r) {
+    uint32_t ostime = (uint32_t)unpackNumberValue(r, 4);
     skynet_record_push_ostime(ostime);
 }
 
 void 
-skynet_record_nowtime(struct skynet_context* ctx, FILE *f, int64_t now) {
+skynet_record_nowtime(struct skynet_context* ctx, struct record_file *rf, int64_t now, int ms) {
     if (!skynet_record_check_limit(ctx)) {
         return;
     }
-    fprintf(f,"n");
-    fwrite(&now, sizeof(now), 1, f);
+    if (!record_reserve(ctx, rf, 9)) {
+        return;
+    }
+    record_append(rf, ms ? "N" : "n", 1);
+    APPEND(rf, now);
+    record_commit(rf, 9);
     skynet_record_add_limit_count(ctx, 9);
 }
 
 void 
-skynet_record_parse_now(FILE *f) {
-    uint64_t now = unpackNumberValue(f, 8);
-    skynet_record_push_nowtime(now);
+skynet_record_parse_now(struct record_reader *r, int ms) {
+    uint64_t now = unpackNumberValue(r, 8);
+    // the queue keeps millisecond, see skynet_record_pop_nowtime
+    skynet_record_push_nowtime(ms ? now : now * 10);
+}
+
+void
+skynet_record_checkpoint(struct skynet_context* ctx, struct record_file *rf, const void *snapshot, size_t sz) {
+    if (!skynet_record_check_limit(ctx)) {
+        return;
+    }
+    uint64_t ti = skynet_now();
+    size_t len = sizeof(ti) + sizeof(sz) + sz + 1;
+    if (!record_reserve(ctx, rf, len)) {
+        return;
+    }
+    if (rf->flight) {
+        flight_mark(rf, ti, 1);
+    } else {
+        index_add(rf, ti, 1);
+    }
+    record_append(rf, "p", 1);
+    APPEND(rf, ti);
+    APPEND(rf, sz);
+    record_append(rf, snapshot, sz);
+    record_commit(rf, len);
+    skynet_record_add_limit_count(ctx, len);
+}
+
+int
+skynet_record_parse_checkpoint(struct record_reader *r, uint32_t handle, int restore, struct record_message *msg) {
+    uint64_t ti = unpackNumberValue(r, 8);
+    size_t sz = (size_t)unpackNumberValue(r, 8);
+    if (!restore) {
+        skynet_record_reader_seek(r, skynet_record_reader_tell(r) + sz);
+        return 0;
+    }
+    char *buffer = reader_payload(r, sz);
+    if (buffer == NULL) {
+        skynet_error(NULL, "Error record checkpoint %zu", sz);
+        return 0;
+    }
+    msg->handle = handle;
+    msg->time = ti;
+    msg->message.source = 0;
+    msg->message.session = 0;
+    msg->message.data = buffer;
+    msg->message.sz = sz | ((size_t)PTYPE_RECORD << MESSAGE_TYPE_SHIFT);
+    return 1;
+}
+
+void
+skynet_record_push_message(struct record_message *msg) {
+    skynet_timer_setcurrent(msg->time);
+    if (skynet_context_push(msg->handle, &msg->message)) {
+        skynet_free(msg->message.data);
+    }
+}
+
+int
+skynet_record_version_check(const char *version) {
+    return strcmp(version, SKYNET_RECORD_VERSION) == 0 || strcmp(version, SKYNET_RECORD_VERSION_NOINDEX) == 0;
+}
+
+int
+skynet_record_load_index(struct record_reader *r, struct record_index **index) {
+    char magic[sizeof(SKYNET_RECORD_INDEX_MAGIC)];
+    uint64_t offset;
+    uint32_t n;
+    char type;
+    int ret = -1;
+    size_t pos = r->pos;
+    *index = NULL;
+    if (r->size < sizeof(offset) + sizeof(magic) - 1)
+        goto _end;
+    if (!skynet_record_reader_seek(r, r->size - (sizeof(offset) + sizeof(magic) - 1)))
+        goto _end;
+    if (!reader_read(r, &offset, sizeof(offset)) || !reader_read(r, magic, sizeof(magic) - 1))
+        goto _end;
+    if (memcmp(magic, SKYNET_RECORD_INDEX_MAGIC, sizeof(magic) - 1) != 0)
+        goto _end;
+    if (!skynet_record_reader_seek(r, offset) || !reader_read(r, &type, 1) || type != 'x' || !reader_read(r, &n, sizeof(n)))
+        goto _end;
+    if (n > 0) {
+        *index = skynet_malloc(n * sizeof(struct record_index));
+        if (!reader_read(r, *index, n * sizeof(struct record_index))) {
+            skynet_free(*index);
+            *index = NULL;
+            goto _end;
+        }
+    }
+    ret = (int)n;
+_end:
+    skynet_record_reader_seek(r, pos);
+    return ret;
+}
+
+static int
+record_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int
+skynet_record_files(const char *path, char *files[], int max) {
+    struct stat st;
+    if (stat(path, &st) != 0 || max <= 0)
+        return 0;
+    if (!S_ISDIR(st.st_mode)) {
+        files[0] = skynet_strdup(path);
+        return 1;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    int n = 0;
+    struct dirent *e;
+    while (n < max && (e = readdir(dir)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (len <= sizeof(".record") - 1 || strcmp(e->d_name + len - (sizeof(".record") - 1), ".record") != 0)
+            continue;
+        char *name = skynet_malloc(strlen(path) + len + 2);
+        sprintf(name, "%s/%s", path, e->d_name);
+        files[n++] = name;
+    }
+    closedir(dir);
+    qsort(files, n, sizeof(char *), record_name_cmp);
+    return n;
+}
+
+struct record_reader *
+skynet_record_reader_open(const char *filename, int usemmap) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return NULL;
+    struct record_reader *r = skynet_malloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0) {
+        r->size = (size_t)st.st_size;
+    }
+    if (usemmap && r->size > 0) {
+        void *data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (data != MAP_FAILED) {
+            madvise(data, r->size, MADV_SEQUENTIAL);
+            r->data = data;
+            fclose(f);
+            return r;
+        }
+        skynet_error(NULL, "Map record file %s fail %s, use stdio", filename, strerror(errno));
+    }
+    r->f = f;
+    return r;
+}
+
+void
+skynet_record_reader_close(struct record_reader *r) {
+    if (r->data) {
+        munmap((void *)r->data, r->size);
+    } else {
+        fclose(r->f);
+    }
+    skynet_free(r);
+}
+
+int
+skynet_record_reader_peek(struct record_reader *r) {
+    if (r->data) {
+        return r->pos < r->size ? (unsigned char)r->data[r->pos] : EOF;
+    }
+    int c = fgetc(r->f);
+    if (c != EOF) {
+        ungetc(c, r->f);
+    }
+    return c;
+}
+
+int
+skynet_record_reader_read(struct record_reader *r, void *buf, size_t sz) {
+    return reader_read(r, buf, sz);
+}
+
+int
+skynet_record_reader_seek(struct record_reader *r, size_t offset) {
+    if (offset > r->size)
+        return 0;
+    if (r->f && fseek(r->f, (long)offset, SEEK_SET) != 0)
+        return 0;
+    r->pos = offset;
+    return 1;
+}
+
+size_t
+skynet_record_reader_tell(struct record_reader *r) {
+    return r->pos;
+}
+
+size_t
+skynet_record_reader_size(struct record_reader *r) {
+    return r->size;
 }
 
 //mq
 struct record_intque * 
 skynet_record_mq_create() {
     struct record_intque *q = skynet_malloc(sizeof(*q));
+    SPIN_INIT(q);
     q->cap = 4;
 	q->head = 0;
 	q->tail = 0;
@@ -387,6 +1280,7 @@ skynet_record_mq_create() {
 
 void 
 skynet_record_mq_push(struct record_intque * mq, int64_t v) {
+	SPIN_LOCK(mq);
 	mq->queue[mq->tail] = v;
 	mq->tail++;
 	if (mq->tail >= mq->cap) {
@@ -406,21 +1300,22 @@ skynet_record_mq_push(struct record_intque * mq, int64_t v) {
 		skynet_free(mq->queue);
 		mq->queue = new_queue;
 	}
+	SPIN_UNLOCK(mq);
 }
 
 int64_t 
 skynet_record_mq_pop(struct record_intque * mq) {
+	int64_t v = 0;
+	SPIN_LOCK(mq);
 	if (mq->head != mq->tail) {
-		int64_t v = mq->queue[mq->head++];
+		v = mq->queue[mq->head++];
 		int head = mq->head;
 		int cap = mq->cap;
 
 		if (head >= cap) {
 			mq->head = 0;
 		}
-		
-		return v;
 	}
-	
-	return 0;
+	SPIN_UNLOCK(mq);
+	return v;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include "skynet_env.h"
 #include "skynet.h"
+#include "skynet_mq.h"
+#include "spinlock.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -11,37 +13,102 @@
 void skynet_set_strseed(unsigned int seed);
 unsigned int skynet_get_strseed(void);
 
-#define SKYNET_RECORD_VERSION "1.2.0"
+#define SKYNET_RECORD_VERSION "1.3.0"
+#define SKYNET_RECORD_VERSION_NOINDEX "1.2.0"	// still can be replayed, but no index
 
+/*
+ * Since 1.3.0, a finalized record file ends with an index :
+ *	'x' uint32_t n, struct record_index[n], uint64_t offset of 'x', SKYNET_RECORD_INDEX_MAGIC
+ * Checkpoint record : 'p' uint64_t now, size_t sz, snapshot[sz]
+ * skynet.now() record : 'n' int64_t centisecond, skynet.now_ms() record : 'N' int64_t millisecond (since 1.3.0),
+ * skynet.time() of 1.2.0 records 'n', replay converts it to the unit asked.
+ *
+ * A record group is a directory of record files, one for each member service.
+ * Every 'b', 'm' and 'a' in them is preceded by 'q' uint64_t sequence, shared by the group.
+ */
+#define RECORD_GROUP_MAX 64
+#define SKYNET_RECORD_INDEX_MAGIC "SKYNETIX"
+#define SKYNET_RECORD_INDEX_INTERVAL 4096	// messages between index entries
+// checkpoint of a flight record dump, the messages before it are dropped, replay restores it after the prologue
+#define SKYNET_RECORD_INDEX_TRUNCATED 2
+
+struct record_index {
+	uint64_t offset;	// offset of the 'm'/'a' record, or 'p' if checkpoint
+	uint64_t msgno;	// messages before it
+	uint64_t time;
+	uint32_t checkpoint;	// 1 checkpoint, SKYNET_RECORD_INDEX_TRUNCATED
+	uint32_t reserved;
+};
+
+struct record_file;
+struct record_reader;
+
+// the record thread pushes and the service pops, they run concurrently when replay is pipelined
 struct record_intque {
+	struct spinlock lock;
 	int cap;
 	int head;
 	int tail;
 	int64_t *queue;
 };
 
-FILE * skynet_record_open(struct skynet_context* ctx, uint32_t handle, const char* filename);
-void skynet_record_close(struct skynet_context* ctx, FILE *f, uint32_t handle);
-void skynet_record_output(struct skynet_context* ctx, FILE *f, uint32_t source, int type, int session, void * buffer, size_t sz);
-void skynet_record_start(struct skynet_context* ctx, FILE *f, const char* buffer);
-void skynet_record_newsession(struct skynet_context* ctx, FILE *f, int session);
-void skynet_record_handle(struct skynet_context* ctx, FILE *f, uint32_t handle);
-void skynet_record_socketid(struct skynet_context* ctx, FILE *f, int id);
-void skynet_record_randseed(struct skynet_context* ctx, FILE *f, int64_t x, int64_t y);
-void skynet_record_ostime(struct skynet_context* ctx, FILE *f, uint32_t ostime);
-void skynet_record_nowtime(struct skynet_context* ctx, FILE *f, int64_t now);
+void skynet_record_init(size_t backlog);	// max bytes of a record file buffered in memory (recordbacklog), 0 for unlimited
+struct record_file * skynet_record_open(struct skynet_context* ctx, uint32_t handle, const char* filename);
+void skynet_record_close(struct skynet_context* ctx, struct record_file *rf, uint32_t handle);
+void skynet_record_release(struct record_file *rf);
+void skynet_record_exit(void);	// flush all the record files, and dump the flight recorders
+// flight recorder (recordflight) : keep the tail of the records in memory, dump writes them to the record file
+// error : dumped by a lua error, at most once in RECORD_DUMP_INTERVAL
+void skynet_record_dump(struct record_file *rf, int error);
+int skynet_record_flight(struct record_file *rf);
+void skynet_record_output(struct skynet_context* ctx, struct record_file *rf, uint32_t source, int type, int session, void * buffer, size_t sz);
+void skynet_record_start(struct skynet_context* ctx, struct record_file *rf, const char* buffer);
+void skynet_record_newsession(struct skynet_context* ctx, struct record_file *rf, int session);
+void skynet_record_handle(struct skynet_context* ctx, struct record_file *rf, uint32_t handle);
+void skynet_record_socketid(struct skynet_context* ctx, struct record_file *rf, int id);
+void skynet_record_randseed(struct skynet_context* ctx, struct record_file *rf, int64_t x, int64_t y);
+void skynet_record_ostime(struct skynet_context* ctx, struct record_file *rf, uint32_t ostime);
+void skynet_record_nowtime(struct skynet_context* ctx, struct record_file *rf, int64_t now, int ms);
+void skynet_record_checkpoint(struct skynet_context* ctx, struct record_file *rf, const void *snapshot, size_t sz);
+
+int skynet_record_version_check(const char *version);
+// return the number of index entries, -1 if the file has no index (old version or not finalized)
+int skynet_record_load_index(struct record_reader *r, struct record_index **index);
+
+// path is a record file or the directory of a record group, return the number of files (sorted, free them by caller)
+int skynet_record_files(const char *path, char *files[], int max);
+
+// replay reader, it maps the record file (falls back to stdio when usemmap is 0 or mmap fails)
+struct record_reader * skynet_record_reader_open(const char *filename, int usemmap);
+void skynet_record_reader_close(struct record_reader *r);
+int skynet_record_reader_peek(struct record_reader *r);	// next byte or EOF
+int skynet_record_reader_read(struct record_reader *r, void *buf, size_t sz);	// 1 ok, 0 eof
+int skynet_record_reader_seek(struct record_reader *r, size_t offset);
+size_t skynet_record_reader_tell(struct record_reader *r);
+size_t skynet_record_reader_size(struct record_reader *r);
+
+// a message parsed from the record, it's pushed after the side records of its group
+struct record_message {
+	uint32_t handle;
+	uint64_t time;
+	struct skynet_message message;
+};
 
 //parse_do
-void skynet_record_parse_open(FILE *f);
-void skynet_record_parse_close(FILE *f);
-void skynet_record_parse_socket(FILE *f, uint32_t handle);
-void skynet_record_parse_output(FILE *f, uint32_t handle);
-void skynet_record_parse_newsession(FILE *f);
-void skynet_record_parse_handle(FILE *f);
-void skynet_record_parse_socketid(FILE *f);
-void skynet_record_parse_randseed(FILE *f);
-void skynet_record_parse_ostime(FILE *f);
-void skynet_record_parse_now(FILE *f);
+void skynet_record_parse_open(struct record_reader *r);
+void skynet_record_parse_close(struct record_reader *r);
+// return 1 and fill msg if succeed
+int skynet_record_parse_socket(struct record_reader *r, uint32_t handle, struct record_message *msg);
+int skynet_record_parse_output(struct record_reader *r, uint32_t handle, struct record_message *msg);
+void skynet_record_parse_newsession(struct record_reader *r);
+void skynet_record_parse_handle(struct record_reader *r);
+void skynet_record_parse_socketid(struct record_reader *r);
+void skynet_record_parse_randseed(struct record_reader *r);
+void skynet_record_parse_ostime(struct record_reader *r);
+void skynet_record_parse_now(struct record_reader *r, int ms);
+// restore != 0 : fill msg with the snapshot for handle (replay seeks to this checkpoint) and return 1, otherwise skip it
+int skynet_record_parse_checkpoint(struct record_reader *r, uint32_t handle, int restore, struct record_message *msg);
+void skynet_record_push_message(struct record_message *msg);
 
 //队列
 struct record_intque * skynet_record_mq_create();
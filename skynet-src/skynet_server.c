@@ -11,10 +11,12 @@
 #include "skynet_imp.h"
 #include "skynet_log.h"
 #include "skynet_record.h"
+#include "malloc_hook.h"
 #include "spinlock.h"
 #include "atomic.h"
 
 #include <pthread.h>
+#include <inttypes.h>
 
 #include <string.h>
 #include <assert.h>
@@ -40,6 +42,9 @@
 
 #endif
 
+// the max number of messages popped from message queue in one lock
+#define MESSAGE_BATCH 64
+
 struct skynet_context {
 	void * instance;
 	struct skynet_module * mod;
@@ -56,6 +61,7 @@ struct skynet_context {
 	uint32_t handle;
 	int session_id;
 	ATOM_INT ref;
+	int arena;	// see malloc_arena_new
 	size_t message_count;
 	bool init;
 	bool endless;
@@ -72,6 +78,8 @@ struct skynet_node {
 	bool profile;	// default is on
 	//record
 	uint32_t recordhandle;
+	int recordhandle_n;	// the services replayed from a record group
+	uint32_t recordhandles[RECORD_GROUP_MAX];
 };
 
 static struct skynet_node G_NODE;
@@ -171,12 +179,15 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->handle = 0;
 	const uint32_t handle = skynet_handle_register(ctx);
 	ctx->handle = handle;
+	ctx->arena = malloc_arena_new(handle);
 	struct message_queue * queue = ctx->queue = skynet_mq_create(handle);
 	// init function maybe use ctx->handle, so it must init at last
 	context_inc();
 
 	CHECKCALLING_BEGIN(ctx)
+	int arena = malloc_arena_bind(ctx->arena);
 	int r = skynet_module_instance_init(mod, inst, ctx, param);
+	malloc_arena_bind(arena);
 	CHECKCALLING_END(ctx)
 	if (r == 0) {
 		ctx->init = true;
@@ -204,7 +215,7 @@ skynet_context_newsession(struct skynet_context *ctx) {
 		return 1;
 	}
 
-	FILE *rf = (FILE *)ATOM_LOAD(&ctx->recordfile);
+	struct record_file *rf = (struct record_file *)ATOM_LOAD(&ctx->recordfile);
 	if (rf) {
 		skynet_record_newsession(ctx, rf, session);
 	}
@@ -231,11 +242,12 @@ delete_context(struct skynet_context *ctx) {
 	if (f) {
 		fclose(f);
 	}
-	FILE *rf = (FILE *)ATOM_LOAD(&ctx->recordfile);
+	struct record_file *rf = (struct record_file *)ATOM_LOAD(&ctx->recordfile);
 	if (rf) {
-		fclose(rf);
+		skynet_record_release(rf);
 	}
 	skynet_module_instance_release(ctx->mod, ctx->instance);
+	malloc_arena_release(ctx->arena);
 	skynet_mq_mark_release(ctx->queue);
 	CHECKCALLING_DESTROY(ctx)
 	skynet_free(ctx);
@@ -285,13 +297,14 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	assert(ctx->init);
 	CHECKCALLING_BEGIN(ctx)
 	pthread_setspecific(G_NODE.handle_key, (void *)(uintptr_t)(ctx->handle));
+	int arena = malloc_arena_bind(ctx->arena);
 	int type = msg->sz >> MESSAGE_TYPE_SHIFT;
 	size_t sz = msg->sz & MESSAGE_TYPE_MASK;
 	FILE *f = (FILE *)ATOM_LOAD(&ctx->logfile);
 	if (f) {
 		skynet_log_output(f, msg->source, type, msg->session, msg->data, sz);
 	}
-	FILE *rf = (FILE *)ATOM_LOAD(&ctx->recordfile);
+	struct record_file *rf = (struct record_file *)ATOM_LOAD(&ctx->recordfile);
 	if (rf) {
 		skynet_record_output(ctx, rf, msg->source, type, msg->session, msg->data, sz);
 	}
@@ -308,6 +321,7 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	if (!reserve_msg) {
 		skynet_free(msg->data);
 	}
+	malloc_arena_bind(arena);
 	CHECKCALLING_END(ctx)
 }
 
@@ -321,10 +335,19 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+static struct message_queue *
+next_queue(void) {
+	struct message_queue *q = skynet_globalmq_pop();
+	if (q == NULL) {
+		q = skynet_mq_steal();
+	}
+	return q;
+}
+
 struct message_queue *
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
 	if (q == NULL) {
-		q = skynet_globalmq_pop();
+		q = next_queue();
 		if (q==NULL)
 			return NULL;
 	}
@@ -335,35 +358,42 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	if (ctx == NULL) {
 		struct drop_t d = { handle };
 		skynet_mq_release(q, drop_message, &d);
-		return skynet_globalmq_pop();
+		return next_queue();
 	}
 
-	int i,n=1;
-	struct skynet_message msg;
+	int i,n;
+	int budget = 0;
+	struct skynet_message batch[MESSAGE_BATCH];
 
-	for (i=0;i<n;i++) {
-		if (skynet_mq_pop(q,&msg)) {
+	do {
+		n = skynet_mq_pop_batch(q, batch, MESSAGE_BATCH, weight, &budget);
+		if (n == 0) {
 			skynet_context_release(ctx);
-			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
+			return next_queue();
 		}
 		int overload = skynet_mq_overload(q);
 		if (overload) {
-			skynet_error(ctx, "error: May overload, message queue length = %d", overload);
+			int high = skynet_mq_lane_length(q, MQ_LANE_HIGH);
+			if (high) {
+				skynet_error(ctx, "error: May overload, message queue length = %d (high lane = %d)", overload, high);
+			} else {
+				skynet_error(ctx, "error: May overload, message queue length = %d", overload);
+			}
 		}
 
-		skynet_monitor_trigger(sm, msg.source , handle);
+		for (i=0;i<n;i++) {
+			struct skynet_message *msg = &batch[i];
+			skynet_monitor_trigger(sm, msg->source , handle);
 
-		if (ctx->cb == NULL) {
-			skynet_free(msg.data);
-		} else {
-			dispatch_message(ctx, &msg);
-		}
+			if (ctx->cb == NULL) {
+				skynet_free(msg->data);
+			} else {
+				dispatch_message(ctx, msg);
+			}
 
-		skynet_monitor_trigger(sm, 0,0);
-	}
+			skynet_monitor_trigger(sm, 0,0);
+		}
+	} while (budget > 0);
 
 	assert(q == ctx->queue);
 	struct message_queue *nq = skynet_globalmq_pop();
@@ -427,11 +457,33 @@ cmd_timeout(struct skynet_context * context, const char * param) {
 	char * session_ptr = NULL;
 	int ti = strtol(param, &session_ptr, 10);
 	int session = skynet_context_newsession(context);
-	skynet_timeout(context->handle, ti, session);
+	if (*session_ptr != '\0') {
+		// fractional centisecond (such as 0.5 or 1e-05), see timerresolution. It's rounded to microsecond
+		// (the error of double) here, and skynet_timeout_us rounds it up to the tick, so the timer never expires earlier.
+		double cs = strtod(param, NULL);
+		if (cs > INT32_MAX)
+			cs = INT32_MAX;
+		int64_t us = 0;
+		if (cs > 0) {
+			us = (int64_t)(cs * 10000 + 0.5);
+			if (us == 0)
+				us = 1;
+		}
+		skynet_timeout_us(context->handle, us, session);
+	} else {
+		skynet_timeout(context->handle, ti, session);
+	}
 	sprintf(context->result, "%d", session);
 	return context->result;
 }
 
+static const char *
+cmd_timeoutcancel(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	sprintf(context->result, "%d", skynet_timeout_cancel(context->handle, session));
+	return context->result;
+}
+
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {
@@ -452,7 +504,7 @@ cmd_query(struct skynet_context * context, const char * param) {
 		handle = skynet_handle_findname(param+1);
 	}
 
-	FILE *rf = (FILE *)ATOM_LOAD(&context->recordfile);
+	struct record_file *rf = (struct record_file *)ATOM_LOAD(&context->recordfile);
 	if (rf) {
 		skynet_record_handle(context, rf, handle);
 	}
@@ -589,6 +641,9 @@ cmd_stat(struct skynet_context * context, const char * param) {
 	if (strcmp(param, "mqlen") == 0) {
 		int len = skynet_mq_length(context->queue);
 		sprintf(context->result, "%d", len);
+	} else if (strcmp(param, "mqhigh") == 0) {
+		int len = skynet_mq_lane_length(context->queue, MQ_LANE_HIGH);
+		sprintf(context->result, "%d", len);
 	} else if (strcmp(param, "endless") == 0) {
 		if (context->endless) {
 			strcpy(context->result, "1");
@@ -609,6 +664,19 @@ cmd_stat(struct skynet_context * context, const char * param) {
 		}
 	} else if (strcmp(param, "message") == 0) {
 		sprintf(context->result, "%zu", context->message_count);
+	} else if (strncmp(param, "worker_", 7) == 0) {
+		uint64_t sleep, wakeup, spin;
+		skynet_worker_idlestat(&sleep, &wakeup, &spin);
+		const char * what = param + 7;
+		if (strcmp(what, "sleep") == 0) {
+			sprintf(context->result, "%" PRIu64, sleep);
+		} else if (strcmp(what, "wakeup") == 0) {
+			sprintf(context->result, "%" PRIu64, wakeup);
+		} else if (strcmp(what, "spin") == 0) {
+			sprintf(context->result, "%" PRIu64, spin);
+		} else {
+			context->result[0] = '\0';
+		}
 	} else {
 		context->result[0] = '\0';
 	}
@@ -665,8 +733,8 @@ cmd_recordon(struct skynet_context * context, const char * param) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
 	if (ctx == NULL)
 		return NULL;
-	FILE *f = NULL;
-	FILE * lastf = (FILE *)ATOM_LOAD(&ctx->recordfile);
+	struct record_file *f = NULL;
+	struct record_file * lastf = (struct record_file *)ATOM_LOAD(&ctx->recordfile);
 	if (lastf == NULL) {
 		const char *record_limit_str = skynet_getenv("recordlimit");
 		char *endptr = NULL;
@@ -678,9 +746,13 @@ cmd_recordon(struct skynet_context * context, const char * param) {
 			param = strchr(param, ' ');
 			f = skynet_record_open(ctx, handle, param + 1);
 			if (f) {
+				if (skynet_record_flight(f)) {
+					// the flight recorder is bounded by itself
+					ctx->record_limit = INT64_MAX;
+				}
 				if (!ATOM_CAS_POINTER(&ctx->recordfile, 0, (uintptr_t)f)) {
 					// recordfile opens in other thread, close this one.
-					fclose(f);
+					skynet_record_release(f);
 				}
 			}
 		}
@@ -698,7 +770,7 @@ cmd_recordoff(struct skynet_context * context, const char * param) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
 	if (ctx == NULL)
 		return NULL;
-	FILE * f = (FILE *)ATOM_LOAD(&ctx->recordfile);
+	struct record_file * f = (struct record_file *)ATOM_LOAD(&ctx->recordfile);
 	if (f) {
 		// recordfile may close in other thread
 		if (ATOM_CAS_POINTER(&ctx->recordfile, (uintptr_t)f, (uintptr_t)NULL)) {
@@ -711,7 +783,7 @@ cmd_recordoff(struct skynet_context * context, const char * param) {
 
 static const char *
 cmd_recordstart(struct skynet_context *context, const char* buffer) {
-	FILE * f = (FILE *)ATOM_LOAD(&context->recordfile);
+	struct record_file * f = (struct record_file *)ATOM_LOAD(&context->recordfile);
 	if (f == NULL) {
 		return NULL;
 	}
@@ -720,6 +792,15 @@ cmd_recordstart(struct skynet_context *context, const char* buffer) {
 	return NULL;
 }
 
+static const char *
+cmd_recorddump(struct skynet_context *context, const char* param) {
+	struct record_file * f = (struct record_file *)ATOM_LOAD(&context->recordfile);
+	if (f) {
+		skynet_record_dump(f, param != NULL && strcmp(param, "error") == 0);
+	}
+	return NULL;
+}
+
 static const char *
 cmd_signal(struct skynet_context * context, const char * param) {
 	uint32_t handle = tohandle(context, param);
@@ -742,6 +823,7 @@ cmd_signal(struct skynet_context * context, const char * param) {
 
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },
+	{ "TIMEOUTCANCEL", cmd_timeoutcancel },
 	{ "REG", cmd_reg },
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },
@@ -759,6 +841,7 @@ static struct command_func cmd_funcs[] = {
 	{ "RECORDON", cmd_recordon },
 	{ "RECORDOFF", cmd_recordoff },
 	{ "RECORDSTART", cmd_recordstart },
+	{ "RECORDDUMP", cmd_recorddump },
 	{ "SIGNAL", cmd_signal },
 	{ NULL, NULL },
 };
@@ -961,9 +1044,9 @@ skynet_profile_enable(int enable) {
 }
 
 //record
-FILE* 
+struct record_file * 
 skynet_context_recordfile(struct skynet_context * context) {
-	return (FILE *)ATOM_LOAD(&context->recordfile);
+	return (struct record_file *)ATOM_LOAD(&context->recordfile);
 }
 
 void 
@@ -1015,13 +1098,16 @@ uint32_t skynet_record_pop_ostime() {
 }
 
 void 
-skynet_record_push_nowtime(int64_t now) {
-	skynet_record_mq_push(G_NOWTIME_Q, now);
+skynet_record_push_nowtime(int64_t ms) {
+	skynet_record_mq_push(G_NOWTIME_Q, ms);
 }
 
+// The unit is recorded ('n' or 'N'), it may differ from the replayed api :
+// skynet.time() of 1.2.0 records skynet.now(), and now reads skynet.now_ms().
 int64_t 
-skynet_record_pop_nowtime() {
-	return skynet_record_mq_pop(G_NOWTIME_Q);
+skynet_record_pop_nowtime(int ms) {
+	int64_t now = skynet_record_mq_pop(G_NOWTIME_Q);
+	return ms ? now : now / 10;
 }
 
 int 
@@ -1039,7 +1125,22 @@ skynet_record_add_limit_count(struct skynet_context * ctx, size_t len) {
 
 void 
 skynet_set_recordhandle(uint32_t handle) {
-	G_NODE.recordhandle = handle;
+	if (G_NODE.recordhandle == 0) {
+		G_NODE.recordhandle = handle;
+	}
+	if (G_NODE.recordhandle_n < RECORD_GROUP_MAX) {
+		G_NODE.recordhandles[G_NODE.recordhandle_n++] = handle;
+	}
+}
+
+int
+skynet_is_record_handle(uint32_t handle) {
+	int i;
+	for (i=0;i<G_NODE.recordhandle_n;i++) {
+		if (G_NODE.recordhandles[i] == handle)
+			return 1;
+	}
+	return 0;
 }
 
 uint32_t 
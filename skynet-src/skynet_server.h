@@ -8,6 +8,7 @@
 struct skynet_context;
 struct skynet_message;
 struct skynet_monitor;
+struct record_file;
 
 uint32_t skynet_context_new(const char * name, const char * parm);
 void skynet_context_grab(struct skynet_context *);
@@ -30,7 +31,7 @@ void skynet_initthread(int m);
 void skynet_profile_enable(int enable);
 
 //record
-FILE* skynet_context_recordfile(struct skynet_context * context);
+struct record_file * skynet_context_recordfile(struct skynet_context * context);
 
 void skynet_record_push_session(int session);
 int skynet_record_pop_session();
@@ -42,13 +43,14 @@ void skynet_record_push_mathseek(int64_t x, int64_t y);
 int64_t skynet_record_pop_mathseek();
 void skynet_record_push_ostime(uint32_t ostime);
 uint32_t skynet_record_pop_ostime();
-void skynet_record_push_nowtime(int64_t ostime);
-int64_t skynet_record_pop_nowtime();
+void skynet_record_push_nowtime(int64_t ms);
+int64_t skynet_record_pop_nowtime(int ms);	// in millisecond if ms, or centisecond
 
 int skynet_record_check_limit(struct skynet_context * ctx);
 void skynet_record_add_limit_count(struct skynet_context * ctx, size_t len);
 
 void skynet_set_recordhandle(uint32_t handle);
-uint32_t skynet_get_record_handle();
+uint32_t skynet_get_record_handle();	// the first replayed service
+int skynet_is_record_handle(uint32_t handle);
 
 #endif
@@ -14,8 +14,8 @@
 static struct socket_server * SOCKET_SERVER = NULL;
 
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(skynet_now());
+skynet_socket_init(int pollers, int uring) {
+	SOCKET_SERVER = socket_server_create_pollers(skynet_now(), pollers, uring);
 }
 
 void
@@ -34,7 +34,7 @@ skynet_socket_updatetime() {
 	socket_server_updatetime(SOCKET_SERVER, skynet_now());
 }
 
-// mainloop thread
+// mainloop thread, one for each poller
 static void
 forward_message(int type, bool padding, struct socket_message * result) {
 	struct skynet_socket_message *sm;
@@ -76,12 +76,12 @@ forward_message(int type, bool padding, struct socket_message * result) {
 }
 
 int 
-skynet_socket_poll() {
+skynet_socket_poll(int index) {
 	struct socket_server *ss = SOCKET_SERVER;
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
-	int type = socket_server_poll(ss, &result, &more);
+	int type = socket_server_poll_loop(ss, index, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
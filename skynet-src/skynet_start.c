@@ -1,3 +1,8 @@
+#ifdef __linux__
+// for pthread_setaffinity_np
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 #include "skynet_server.h"
 #include "skynet_imp.h"
@@ -10,6 +15,8 @@
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
 #include "skynet_record.h"
+#include "skynet_error.h"
+#include "spinlock.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -18,11 +25,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <inttypes.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#endif
+
+// spin budget (dispatch retries) of an idle worker before parking, adapted per worker
+#define SPIN_MIN 4
+#define SPIN_MAX 256
+#define SPIN_PAUSE 16
+
+// each worker parks on its own cond, so wakeup() can wake exactly one of them
+struct worker_park {
+	pthread_cond_t cond;
+	int parked;
+	int next;	// idle stack link
+	uint64_t sleep;
+	uint64_t wakeup;
+	uint64_t spin;	// idle periods ended by spinning, without parking
+};
+
+// the clock of replay, paces the record thread by the recorded time of the messages
+struct record_clock {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// signaled when the control changes
+	double speed;	// times of the recorded speed, 0 for as fast as possible
+	int paused;
+	int steps;	// message groups allowed to play when paused
+	int rebase;	// restart the pacing from the next message
+	uint64_t goto_time;	// play as fast as possible until the recorded time (centisecond), then pause
+	uint64_t base_time;	// recorded time of the pacing origin
+	uint64_t base_wall;	// monotonic clock (microsecond) of the pacing origin
+};
 
 struct monitor {
 	int count;
 	struct skynet_monitor ** m;
-	pthread_cond_t cond;
+	struct worker_park * park;
+	int idle;	// top of parked worker stack (LIFO, the latest parked is the hottest), -1 for empty
+	ATOM_INT parked;	// the size of the idle stack, read without the mutex by worker_unpark
+	ATOM_INT spinning;	// the workers spinning for work
+	int cpu;	// online cpus, no more running workers are woken than it
+	int spin;	// max spin budget, 0 disables spinning
 	pthread_mutex_t mutex;
 	pthread_cond_t timecond;
 	pthread_mutex_t timemutex;
@@ -33,12 +80,20 @@ struct monitor {
 	uint64_t fast_time;
 	uint32_t once_addtime;
 	const char* recordfile;
+	int playrecord;
+	struct record_clock clock;
 };
 
 struct worker_parm {
 	struct monitor *m;
 	int id;
 	int weight;
+	const char *affinity;
+};
+
+struct socket_parm {
+	struct monitor *m;
+	int id;	// index of the poller
 };
 
 static struct monitor *M;
@@ -61,28 +116,88 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
+// m->mutex must be locked, remove the worker from the idle stack
 static void
-wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+unlink_worker(struct monitor *m, int id) {
+	int *next = &m->idle;
+	while (*next != id) {
+		next = &m->park[*next].next;
 	}
+	*next = m->park[id].next;
+	m->park[id].parked = 0;
+	ATOM_FDEC(&m->parked);
+}
+
+// m->mutex must be locked
+static void
+unpark_worker(struct monitor *m, int id) {
+	struct worker_park *p = &m->park[id];
+	unlink_worker(m, id);
+	++ p->wakeup;
+	pthread_cond_signal(&p->cond);
+}
+
+// m->mutex must be locked
+static int
+unpark_one(struct monitor *m) {
+	int id = m->idle;
+	if (id < 0)
+		return 0;
+	unpark_worker(m, id);
+	return 1;
+}
+
+// m->mutex must be locked
+static void
+unpark_all(struct monitor *m) {
+	while (unpark_one(m))
+		;
+}
+
+// wait for all the workers parked, the services have consumed everything pushed.
+static void
+barrier(struct monitor *m) {
+	pthread_mutex_lock(&m->mutex);
+	unpark_all(m);
+	pthread_cond_wait(&m->workcond, &m->mutex);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+// The hook of skynet_mq, a queue becomes active : wake the preferred worker if it's parked,
+// or the latest parked one for any. It's lock free when no worker is parked, a spinning worker
+// will take the queue, or the running workers occupy all the cpus : one of them takes it later,
+// from the global queue or by stealing, because park() checks all the queues after the announcement.
+static void
+worker_unpark(int worker) {
+	struct monitor *m = M;
+	int parked = ATOM_LOAD(&m->parked);
+	if (parked == 0 || m->count - parked >= m->cpu)
+		return;
+	if (worker < 0 && ATOM_LOAD(&m->spinning) > 0)
+		return;
+	pthread_mutex_lock(&m->mutex);
+	if (worker < 0) {
+		unpark_one(m);
+	} else if (m->park[worker].parked) {
+		unpark_worker(m, worker);
+	}
+	pthread_mutex_unlock(&m->mutex);
 }
 
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
 	skynet_initthread(THREAD_SOCKET);
 	skynet_handle_register_thread();
 	for (;;) {
-		int r = skynet_socket_poll();
+		// the receiver of the message is activated by skynet_mq_push, it wakes a worker (See worker_unpark)
+		int r = skynet_socket_poll(sp->id);
 		if (r==0)
 			break;
 		if (r<0) {
 			CHECK_ABORT
 			continue;
 		}
-		wakeup(m,0);
 	}
 	return NULL;
 }
@@ -94,8 +209,11 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
+	for (i=0;i<n;i++) {
+		pthread_cond_destroy(&m->park[i].cond);
+	}
 	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
+	skynet_free(m->park);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -134,6 +252,7 @@ signal_hup() {
 	if (logger) {
 		skynet_context_push(logger, &smsg);
 	}
+	skynet_error_reopen();
 }
 
 static void *
@@ -145,13 +264,14 @@ thread_timer(void *p) {
 		skynet_updatetime();
 		skynet_socket_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1);
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
 		}
 		pthread_mutex_lock(&m->timemutex);
-		pthread_cond_wait(&m->timecond, &m->timemutex);
+		// thread_fasttimer signals timecond once more when it exits for abort
+		if (skynet_context_total() > 0)
+			pthread_cond_wait(&m->timecond, &m->timemutex);
 		pthread_mutex_unlock(&m->timemutex);
 	}
 	// wakeup socket thread
@@ -159,16 +279,52 @@ thread_timer(void *p) {
 	// wakeup all worker thread
 	pthread_mutex_lock(&m->mutex);
 	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
+	unpark_all(m);
 	pthread_mutex_unlock(&m->mutex);
 	return NULL;
 }
 
+// the timer thread is driven 4 times per tick (2.5ms for centisecond tick)
+static int
+tick_interval(void) {
+	return 1000000 / skynet_timer_resolution() / 4;
+}
+
+static int
+tick_open(int usec) {
+#ifdef __linux__
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd >= 0) {
+		struct itimerspec its;
+		its.it_interval.tv_sec = usec / 1000000;
+		its.it_interval.tv_nsec = (long)(usec % 1000000) * 1000;
+		its.it_value = its.it_interval;
+		if (timerfd_settime(fd, 0, &its, NULL) == 0) {
+			return fd;
+		}
+		close(fd);
+	}
+#endif
+	return -1;
+}
+
+static void
+tick_wait(int fd, int usec) {
+	if (fd >= 0) {
+		uint64_t expirations;
+		if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			return;
+	}
+	usleep(usec);
+}
+
 static void *
 thread_fasttimer(void *p) {
 	struct monitor * m = p;
 	skynet_initthread(THREAD_FAST_TIMER);
 	skynet_handle_register_thread();
+	int interval = tick_interval();
+	int tfd = tick_open(interval);
 	int64_t remain_time;
 	uint32_t once_addtime;
 	for (;;) {
@@ -176,23 +332,29 @@ thread_fasttimer(void *p) {
 		if (m->fast_time > 0) {
 			pthread_mutex_lock(&m->timemutex);
 			skynet_error(NULL,"fasttime begin now_time= %lld fasttime = %lld once_add=%u",M->start_time + skynet_now(),m->fast_time,m->once_addtime);
+			uint64_t steps = 0;
 			for(;;) {
 				remain_time = m->fast_time - (M->start_time + skynet_now());
 				if (remain_time <= 0)break;
 
-				if (remain_time > m->once_addtime) {
+				// jump to the next timer at once, once_addtime (0 for no limit) bounds the jump
+				once_addtime = skynet_timer_idle(remain_time > UINT32_MAX ? UINT32_MAX : (uint32_t)remain_time);
+				if (once_addtime == 0) {
+					once_addtime = 1;
+				}
+				if (m->once_addtime > 0 && once_addtime > m->once_addtime) {
 					once_addtime = m->once_addtime;
-				} else {
-					once_addtime = remain_time;
 				}
 				skynet_time_fast(once_addtime);
-				skynet_updatetime();
+				int expired = skynet_updatetime();
 				skynet_socket_updatetime();
-				pthread_mutex_lock(&m->mutex);
-				pthread_cond_broadcast(&m->cond);
-				pthread_cond_wait(&m->workcond, &m->mutex);
-				pthread_mutex_unlock(&m->mutex);
+				++steps;
+				if (expired > 0) {
+					// the services run the expired timers (and add new ones) before the clock moves on
+					barrier(m);
+				}
 			}
+			skynet_error(NULL,"fasttime steps %" PRIu64, steps);
 			m->fast_time = 0;
 			m->once_addtime = 0;
 			skynet_error(NULL,"fasttime end");
@@ -200,12 +362,149 @@ thread_fasttimer(void *p) {
 		}
 
 		pthread_cond_signal(&m->timecond);
-		usleep(2500);
+		tick_wait(tfd, interval);
+	}
+	// wakeup timer thread, it drives the exit of the other threads
+	pthread_mutex_lock(&m->timemutex);
+	pthread_cond_signal(&m->timecond);
+	pthread_mutex_unlock(&m->timemutex);
+	if (tfd >= 0) {
+		close(tfd);
 	}
 
 	return NULL;
 }
 
+#ifdef __linux__
+
+#define MAX_CPU_LIST 1024
+
+// parse cpu list such as "0-3,8,10-11" , return the number of cpus
+static int
+parse_cpulist(const char *str, int *cpu, int max) {
+	int n = 0;
+	while (*str) {
+		char *end;
+		long from = strtol(str, &end, 10);
+		if (end == str)
+			return n;
+		long to = from;
+		str = end;
+		if (*str == '-') {
+			to = strtol(str + 1, &end, 10);
+			str = end;
+		}
+		for (;from <= to && n < max; from++) {
+			cpu[n++] = (int)from;
+		}
+		while (*str == ',' || *str == ' ' || *str == '\n') {
+			++str;
+		}
+	}
+	return n;
+}
+
+static int
+node_cpulist(int node, int *cpu, int max) {
+	char path[128];
+	char buf[1024];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	int n = 0;
+	if (fgets(buf, sizeof(buf), f)) {
+		n = parse_cpulist(buf, cpu, max);
+	}
+	fclose(f);
+	return n;
+}
+
+// affinity :
+//	"auto" : worker i binds to cpu i % ncpu
+//	"0-3,8" : worker i binds to the i-th cpu of the list (round robin)
+//	"node:0,1" : worker i binds to all the cpus of the i-th numa node of the list (round robin)
+static void
+bind_worker(int id, const char *affinity) {
+	int cpu[MAX_CPU_LIST];
+	int n;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (strcmp(affinity, "auto") == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu <= 0)
+			return;
+		CPU_SET(id % ncpu, &set);
+	} else if (strncmp(affinity, "node:", 5) == 0) {
+		int node[MAX_CPU_LIST];
+		n = parse_cpulist(affinity + 5, node, MAX_CPU_LIST);
+		if (n == 0)
+			return;
+		int nc = node_cpulist(node[id % n], cpu, MAX_CPU_LIST);
+		if (nc == 0) {
+			skynet_error(NULL, "Can't read cpulist of numa node %d", node[id % n]);
+			return;
+		}
+		int i;
+		for (i=0;i<nc;i++) {
+			CPU_SET(cpu[i], &set);
+		}
+	} else {
+		n = parse_cpulist(affinity, cpu, MAX_CPU_LIST);
+		if (n == 0) {
+			skynet_error(NULL, "Invalid cpuaffinity %s", affinity);
+			return;
+		}
+		CPU_SET(cpu[id % n], &set);
+	}
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		skynet_error(NULL, "Bind worker %d to cpu (%s) failed", id, affinity);
+	}
+}
+
+#else
+
+static void
+bind_worker(int id, const char *affinity) {
+	skynet_error(NULL, "cpuaffinity is not supported on this platform");
+}
+
+#endif
+
+static void
+park(struct monitor *m, int id) {
+	struct worker_park *p = &m->park[id];
+	if (pthread_mutex_lock(&m->mutex) == 0) {
+		if (!m->quit) {
+			p->parked = 1;
+			p->next = m->idle;
+			m->idle = id;
+			ATOM_FINC(&m->parked);
+			// a queue activated after the announcement above wakes a worker by worker_unpark,
+			// check the queues once more (including the local queues of the others) for the one
+			// activated before it, worker_unpark may skip it when this worker was running.
+			if (skynet_mq_pending()) {
+				unlink_worker(m, id);
+				pthread_mutex_unlock(&m->mutex);
+				return;
+			}
+			++ p->sleep;
+		}
+		++ m->sleep;
+		if (m->sleep == m->count) {
+			pthread_cond_signal(&m->workcond);
+		}
+		// unpark_worker() clears parked
+		while (p->parked)
+			pthread_cond_wait(&p->cond, &m->mutex);
+		-- m->sleep;
+		if (pthread_mutex_unlock(&m->mutex)) {
+			fprintf(stderr, "unlock mutex error");
+			exit(1);
+		}
+	}
+}
+
 static void *
 thread_worker(void *p) {
 	struct worker_parm *wp = p;
@@ -215,187 +514,527 @@ thread_worker(void *p) {
 	struct skynet_monitor *sm = m->m[id];
 	skynet_initthread(THREAD_WORKER);
 	skynet_handle_register_thread();
+	skynet_mq_register_worker(id);
+	if (wp->affinity) {
+		bind_worker(id, wp->affinity);
+	}
 	struct message_queue * q = NULL;
+	int spin = m->spin;
 	while (!m->quit) {
 		q = skynet_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
-				if (m->sleep == m->count) {
-					pthread_cond_signal(&m->workcond);
-				}
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.	
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
+			// spin a while before parking, a new message often arrives soon under load.
+			int i,j;
+			ATOM_FINC(&m->spinning);
+			for (i=0;i<spin && q == NULL && !m->quit;i++) {
+				for (j=0;j<SPIN_PAUSE;j++) {
+					atomic_pause_();
 				}
+				q = skynet_context_message_dispatch(sm, NULL, weight);
+			}
+			// stop spinning before park() checks the queues, see worker_unpark
+			ATOM_FDEC(&m->spinning);
+			if (q) {
+				++ m->park[id].spin;
+				// spinning pays off, spin longer next time
+				spin = spin * 2 > m->spin ? m->spin : spin * 2;
+			} else {
+				spin = spin / 2 < SPIN_MIN ? SPIN_MIN : spin / 2;
+				if (spin > m->spin)
+					spin = m->spin;
+				park(m, id);
 			}
 		}
 	}
 	return NULL;
 }
 
-static void *
-thread_record(void* p) {
-	struct monitor * m = p;
-	skynet_initthread(THREAD_RECORD);
-
-	FILE *f = fopen(m->recordfile, "rb"); // 以二进制读取模式打开文件
-    if (f == NULL) {
-        skynet_error(NULL, "Error opening file: %s", m->recordfile);
-        return NULL;
-    }
+// recordseek = "msg:N" or "time:T" (centisecond), replay from the last checkpoint before it.
+// A flight record dump which dropped the head of the records always replays from its first checkpoint.
+static size_t
+record_seek(struct record_reader *r) {
+	const char * target = skynet_getenv("recordseek");
+	if (target && target[0] == '\0')
+		target = NULL;
+	int bytime = 0;
+	uint64_t v = 0;
+	if (target) {
+		bytime = strncmp(target, "time:", 5) == 0;
+		if (!bytime && strncmp(target, "msg:", 4) != 0) {
+			skynet_error(NULL, "Invalid recordseek %s", target);
+			target = NULL;
+		} else {
+			v = strtoull(strchr(target, ':') + 1, NULL, 10);
+		}
+	}
+	struct record_index *index;
+	int n = skynet_record_load_index(r, &index);
+	if (n < 0) {
+		if (target) {
+			skynet_error(NULL, "The record has no index, replay from the beginning");
+		}
+		return 0;
+	}
+	size_t offset = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		if (index[i].checkpoint == SKYNET_RECORD_INDEX_TRUNCATED) {
+			skynet_error(NULL, "Flight record, replay from the checkpoint at %zu", (size_t)index[i].offset);
+			offset = (size_t)index[i].offset;
+			continue;
+		}
+		if (!index[i].checkpoint || target == NULL)
+			continue;
+		if ((bytime ? index[i].time : index[i].msgno) > v)
+			break;
+		offset = (size_t)index[i].offset;
+	}
+	skynet_free(index);
+	if (target && offset == 0) {
+		skynet_error(NULL, "No checkpoint before %s, replay from the beginning", target);
+	}
+	return offset;
+}
 
-	fseek(f, 0, SEEK_END);
-	long flen = ftell(f);
-	fseek(f, 0, SEEK_SET);
+struct record_stream {
+	struct record_reader *r;
+	char *filename;
+	uint32_t handle;
+	uint64_t seq;	// sequence of the next group, only in the record group
+	size_t seek;	// replay jumps to this checkpoint after the first message group
+	int eof;
+};
 
-	char version[256]; // 存储版本信息
-	float pre_progress = 0;
-    if (fgets(version, sizeof(SKYNET_RECORD_VERSION), f) != NULL) {
-        skynet_error(NULL, "Version:%s", version);
-    }
+#define RECORD_GROUP_START 1
+#define RECORD_GROUP_MESSAGE 2
+#define RECORD_GROUP_RESTORE 4
 
-	if (strcmp(version, SKYNET_RECORD_VERSION) != 0) {
-		skynet_error(NULL, "version not same curversion[%s] recordversion[%s]", version, SKYNET_RECORD_VERSION);
-		return NULL;
+// skip the records between groups, and read the sequence of the next group
+static void
+stream_next(struct record_stream *s) {
+	int type;
+	char c;
+	while ((type = skynet_record_reader_peek(s->r)) != EOF) {
+		switch (type) {
+		case 'q':
+			skynet_record_reader_read(s->r, &c, 1);
+			skynet_record_reader_read(s->r, &s->seq, sizeof(s->seq));
+			return;
+		case 'o':
+			skynet_record_reader_read(s->r, &c, 1);
+			skynet_record_parse_open(s->r);
+			break;
+		case 'c':
+			skynet_record_reader_read(s->r, &c, 1);
+			skynet_record_parse_close(s->r);
+			break;
+		case 'x':
+			// index, the end of records
+			skynet_record_reader_seek(s->r, skynet_record_reader_size(s->r));
+			break;
+		default:
+			return;
+		}
 	}
+	s->eof = 1;
+}
 
-	skynet_error(NULL, "start play record >>> %s", m->recordfile);
-	char type;
-	uint32_t handle = 0;
-    // 读取消息体
-	while (fread(&type, sizeof(type), 1, f) == 1)
-	{
-		fseek(f, -sizeof(type), SEEK_CUR);
-		int is_msg = 0;
-		int is_start = 0;
-		char *start_args = NULL;
-		pthread_mutex_lock(&m->mutex);
-
-		long cur = ftell(f);
-		float progress = ((double)cur / (double)flen) * 100;
-		if (progress - pre_progress >= 1) {
-			pre_progress = progress;
-			skynet_error(NULL, "record speed of progress[%0.0f%%] curindex[%d] total_len[%d]", progress, cur, flen);
-		}
-		
-		while (fread(&type, sizeof(type), 1, f) == 1) {
-			if (is_msg == 1 || is_start == 1) {
-				if (type != 's' && type != 'h' && type != 'k' && type != 'r' && type != 't' && type != 'n') {
-					fseek(f, -(sizeof(type)), SEEK_CUR);
-					break;
-				}
+// a group is a start 'b' or a message ('m', 'a', or 'p' when restore) followed by its side records
+static int
+stream_group(struct record_stream *s, int restore, struct record_message *msg, char **start_args) {
+	struct record_reader *r = s->r;
+	int flags = 0;
+	int type;
+	while ((type = skynet_record_reader_peek(r)) != EOF) {
+		if (flags) {
+			// a flight record dump has no message between the first group and the checkpoint
+			if (s->seek > 0 && skynet_record_reader_tell(r) == s->seek) {
+				break;
+			}
+			if (type != 's' && type != 'h' && type != 'k' && type != 'r' && type != 't' && type != 'n' && type != 'N' && type != 'p') {
+				break;
 			}
+		}
+		char c;
+		skynet_record_reader_read(r, &c, 1);
 
-			switch (type) {
-				case 'o': {
-					skynet_record_parse_open(f);
-					break;
-				}
-				case 'm': {
-					if (handle <= 0) {
-						skynet_error(NULL, "record error not ctx");
-						break;
-					}
-					skynet_record_parse_output(f, handle);
-					is_msg = 1;
-					break;
-				}
-				case 'a': {
-					if (handle <= 0) {
-						skynet_error(NULL, "record error not ctx");
-						break;
-					}
-					skynet_record_parse_socket(f, handle);
-					is_msg = 1;
-					break;
-				}
-				case 'c': {
-					skynet_record_parse_close(f);
-					break;
-				}
-				case 'b': {
-					size_t len;
-					if (fread(&len, sizeof(len), 1, f) != 1) {
-						skynet_error(NULL, "Error fread b len");
-						break;
-					}
-					char hbuf[9];
-					if (fread(hbuf, 8, 1, f) != 1) {
-						skynet_error(NULL, "Error fread b handle");
-						break;
-					}
-					hbuf[8] = '\0';
-					handle = (uint32_t)strtoul(hbuf, NULL, 16);
-					
-					start_args = (char *)skynet_malloc(len - 8 + 1);
-					if (fread(start_args, len - 8, 1, f) != 1) {
-						skynet_error(NULL, "Error source b");
-						break;
-					}
-					start_args[len - 8] = '\0';
-					
-					is_start = 1;
-					break;
-				}
-				case 's': {
-					skynet_record_parse_newsession(f);
+		switch (type) {
+			case 'm': {
+				if (s->handle <= 0) {
+					skynet_error(NULL, "record error not ctx");
 					break;
 				}
-				case 'h': {
-					skynet_record_parse_handle(f);
+				if (skynet_record_parse_output(r, s->handle, msg))
+					flags |= RECORD_GROUP_MESSAGE;
+				break;
+			}
+			case 'a': {
+				if (s->handle <= 0) {
+					skynet_error(NULL, "record error not ctx");
 					break;
 				}
-				case 'k': {
-					skynet_record_parse_socketid(f);
+				if (skynet_record_parse_socket(r, s->handle, msg))
+					flags |= RECORD_GROUP_MESSAGE;
+				break;
+			}
+			case 'b': {
+				size_t len;
+				if (!skynet_record_reader_read(r, &len, sizeof(len))) {
+					skynet_error(NULL, "Error fread b len");
 					break;
 				}
-				case 'r': {
-					skynet_record_parse_randseed(f);
+				char hbuf[9];
+				if (!skynet_record_reader_read(r, hbuf, 8)) {
+					skynet_error(NULL, "Error fread b handle");
 					break;
 				}
-				case 't': {
-					skynet_record_parse_ostime(f);
+				hbuf[8] = '\0';
+				s->handle = (uint32_t)strtoul(hbuf, NULL, 16);
+				
+				*start_args = (char *)skynet_malloc(len - 8 + 1);
+				if (!skynet_record_reader_read(r, *start_args, len - 8)) {
+					skynet_error(NULL, "Error source b");
 					break;
 				}
-				case 'n': {
-					skynet_record_parse_now(f);
-					break;
+				(*start_args)[len - 8] = '\0';
+				flags |= RECORD_GROUP_START;
+				break;
+			}
+			case 's': {
+				skynet_record_parse_newsession(r);
+				break;
+			}
+			case 'h': {
+				skynet_record_parse_handle(r);
+				break;
+			}
+			case 'k': {
+				skynet_record_parse_socketid(r);
+				break;
+			}
+			case 'r': {
+				skynet_record_parse_randseed(r);
+				break;
+			}
+			case 't': {
+				skynet_record_parse_ostime(r);
+				break;
+			}
+			case 'n': {
+				skynet_record_parse_now(r, 0);
+				break;
+			}
+			case 'N': {
+				skynet_record_parse_now(r, 1);
+				break;
+			}
+			case 'p': {
+				if (skynet_record_parse_checkpoint(r, s->handle, restore, msg)) {
+					// the snapshot message is a group
+					restore = 0;
+					flags |= RECORD_GROUP_MESSAGE | RECORD_GROUP_RESTORE;
 				}
-				default:
-					skynet_error(NULL, "Unknown record type: %c", type);
-					break;
+				break;
 			}
+			default:
+				skynet_error(NULL, "Unknown record type: %c", type);
+				break;
 		}
+	}
+	return flags;
+}
 
-		if (is_start == 1) {
-			skynet_handle_set_index(handle);
-			struct skynet_context *ctx = skynet_context_new("snlua", start_args);
-			if (ctx == NULL) {
-				skynet_error(NULL, "Can't launch service");
+static int
+record_open_stream(struct record_stream *s, char *filename, int usemmap) {
+	memset(s, 0, sizeof(*s));
+	s->filename = filename;
+	s->r = skynet_record_reader_open(filename, usemmap);
+	if (s->r == NULL) {
+		skynet_error(NULL, "Error opening file: %s", filename);
+		return 0;
+	}
+	char version[sizeof(SKYNET_RECORD_VERSION)]; // 存储版本信息
+	if (skynet_record_reader_read(s->r, version, sizeof(version) - 1)) {
+		version[sizeof(version) - 1] = '\0';
+		skynet_error(NULL, "Version:%s %s", version, filename);
+	} else {
+		version[0] = '\0';
+	}
+	if (!skynet_record_version_check(version)) {
+		skynet_error(NULL, "version not same curversion[%s] recordversion[%s]", version, SKYNET_RECORD_VERSION);
+		skynet_record_reader_close(s->r);
+		s->r = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static uint64_t
+clock_us(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000;
+}
+
+static void
+record_clock_init(struct record_clock *c) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (pthread_mutex_init(&c->lock, NULL) || pthread_cond_init(&c->cond, &attr)) {
+		fprintf(stderr, "Init record clock error");
+		exit(1);
+	}
+	pthread_condattr_destroy(&attr);
+	const char * speed = skynet_getenv("recordspeed");
+	c->speed = speed ? strtod(speed, NULL) : 0;
+	const char * paused = skynet_getenv("recordpause");
+	c->paused = paused && strcmp(paused, "true") == 0;
+	c->rebase = 1;
+}
+
+// wait until the message group recorded at ti is due, return 1 if it's a step when paused
+static int
+record_clock_wait(struct record_clock *c, uint64_t ti) {
+	int step = 0;
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		if (c->goto_time > 0) {
+			if (ti < c->goto_time)
+				break;
+			c->goto_time = 0;
+			c->paused = 1;
+			skynet_error(NULL, "replay paused at %" PRIu64, ti);
+		}
+		if (c->paused) {
+			if (c->steps > 0) {
+				--c->steps;
+				step = 1;
+				c->rebase = 1;
 				break;
 			}
-			skynet_set_recordhandle(handle);
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+		if (c->speed <= 0)
+			break;
+		uint64_t now = clock_us();
+		if (c->rebase || ti < c->base_time) {
+			c->rebase = 0;
+			c->base_time = ti;
+			c->base_wall = now;
+			break;
+		}
+		// recorded time is centisecond
+		uint64_t due = c->base_wall + (uint64_t)((ti - c->base_time) * 10000 / c->speed);
+		if (now >= due)
+			break;
+		struct timespec ts;
+		ts.tv_sec = due / 1000000;
+		ts.tv_nsec = (due % 1000000) * 1000;
+		pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return step;
+}
+
+int
+skynet_replay_control(const char *cmd, double arg) {
+	struct monitor *m = M;
+	if (m == NULL || !m->playrecord)
+		return -1;
+	struct record_clock *c = &m->clock;
+	int ret = 0;
+	pthread_mutex_lock(&c->lock);
+	if (strcmp(cmd, "speed") == 0 && arg >= 0) {
+		c->speed = arg;
+	} else if (strcmp(cmd, "pause") == 0) {
+		c->paused = 1;
+	} else if (strcmp(cmd, "resume") == 0) {
+		c->paused = 0;
+		c->steps = 0;
+	} else if (strcmp(cmd, "step") == 0) {
+		c->paused = 1;
+		c->steps += arg > 1 ? (int)arg : 1;
+	} else if (strcmp(cmd, "goto") == 0 && arg > 0) {
+		c->goto_time = (uint64_t)arg;
+		c->paused = 0;
+	} else {
+		ret = -1;
+	}
+	c->rebase = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+static void *
+thread_record(void* p) {
+	struct monitor * m = p;
+	skynet_initthread(THREAD_RECORD);
+
+	// recordfile is a record file, or the directory of a record group.
+	// The groups of all the files are replayed in the order of their shared sequence.
+	char *files[RECORD_GROUP_MAX];
+	int n = skynet_record_files(m->recordfile, files, RECORD_GROUP_MAX);
+	if (n == 0) {
+		skynet_error(NULL, "Error opening file: %s", m->recordfile);
+		return NULL;
+	}
+	const char * usemmap = skynet_getenv("recordmmap");
+	struct record_stream streams[RECORD_GROUP_MAX];
+	size_t flen = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		if (!record_open_stream(&streams[i], files[i], usemmap == NULL || strcmp(usemmap, "false") != 0)) {
+			int j;
+			for (j=0;j<i;j++) {
+				skynet_record_reader_close(streams[j].r);
+			}
+			for (j=0;j<n;j++) {
+				skynet_free(files[j]);
+			}
+			return NULL;
+		}
+		flen += skynet_record_reader_size(streams[i].r);
+	}
+
+	if (n == 1) {
+		streams[0].seek = record_seek(streams[0].r);
+	} else if (skynet_getenv("recordseek")) {
+		skynet_error(NULL, "recordseek is not supported by record group");
+	}
+	int restore = 0;
+
+	// recordwindow > 0 : pipelined replay, push up to recordwindow message groups between barriers.
+	// The side records of a group are queued before its message, so the service consumes them in order.
+	// The side record queues are shared, so a group for another service waits for a barrier.
+	const char * w = skynet_getenv("recordwindow");
+	int window = w ? strtol(w, NULL, 10) : 0;
+	int inflight = 0;
+	uint32_t last = 0;
+	float pre_progress = 0;
+
+	// recordconsole = [ip:]port : a debug console to control the replay clock, it runs without the record stubs
+	const char * console = skynet_getenv("recordconsole");
+	if (console && console[0]) {
+		char args[128];
+		snprintf(args, sizeof(args), "debug_console %s", console);
+		char *colon = strchr(args, ':');
+		if (colon) {
+			*colon = ' ';
+		}
+		if (skynet_context_new("snlua", args) == 0) {
+			skynet_error(NULL, "Can't launch %s", args);
+		}
+		barrier(m);
+	}
+
+	for (i=0;i<n;i++) {
+		stream_next(&streams[i]);
+	}
+
+	skynet_error(NULL, "start play record >>> %s", m->recordfile);
+	for (;;) {
+		struct record_stream *s = NULL;
+		size_t cur = 0;
+		for (i=0;i<n;i++) {
+			cur += skynet_record_reader_tell(streams[i].r);
+			if (!streams[i].eof && (s == NULL || streams[i].seq < s->seq)) {
+				s = &streams[i];
+			}
+		}
+		if (s == NULL)
+			break;
+
+		float progress = ((double)cur / (double)flen) * 100;
+		if (progress - pre_progress >= 1) {
+			pre_progress = progress;
+			skynet_error(NULL, "record speed of progress[%0.0f%%] curindex[%zu] total_len[%zu]", progress, cur, flen);
+		}
+
+		if (inflight > 0 && s->handle != last) {
+			barrier(m);
+			inflight = 0;
+		}
+
+		char *start_args = NULL;
+		struct record_message msg;
+		int flags = stream_group(s, restore, &msg, &start_args);
+		if (flags & RECORD_GROUP_RESTORE) {
+			restore = 0;
+		}
+
+		if (flags & RECORD_GROUP_START) {
+			skynet_handle_set_index(s->handle);
+			const char * args = start_args;
+			if (args[0] == '\0') {
+				// a binary message log (logformat = "binary") has no launch args, recordservice launches it.
+				// It has no side records (now, send, timeout ...) either, so the service runs without
+				// the record stubs, and only the messages are injected.
+				args = skynet_getenv("recordservice");
+				if (args == NULL) {
+					skynet_error(NULL, "%s has no launch args, set recordservice", s->filename);
+					skynet_free(start_args);
+					break;
+				}
+			} else {
+				// register it first, only the replayed services stub the record apis (skynet.record_pre)
+				skynet_set_recordhandle(s->handle);
+			}
+			uint32_t handle = skynet_context_new("snlua", args);
 			skynet_free(start_args);
+			if (handle == 0) {
+				skynet_error(NULL, "Can't launch service");
+				break;
+			}
+		}
+
+		int step = 0;
+		if (flags & RECORD_GROUP_MESSAGE) {
+			step = record_clock_wait(&m->clock, msg.time);
+			skynet_record_push_message(&msg);
+			++inflight;
+			last = s->handle;
 		}
 
-		pthread_cond_broadcast(&m->cond);
-		pthread_cond_wait(&m->workcond, &m->mutex);
-		pthread_mutex_unlock(&m->mutex);
+		if (s->seek > 0 && (flags & RECORD_GROUP_MESSAGE)) {
+			// the service is started by the first message, then jump to the checkpoint
+			skynet_error(NULL, "record seek to checkpoint at %zu", s->seek);
+			skynet_record_reader_seek(s->r, s->seek);
+			s->seek = 0;
+			restore = 1;
+		}
+		stream_next(s);
+
+		if (restore == 0 && (flags & (RECORD_GROUP_START | RECORD_GROUP_RESTORE)) == 0 && inflight < window && !step) {
+			// no barrier, the worker may be parked
+			pthread_mutex_lock(&m->mutex);
+			if (m->sleep >= m->count) {
+				unpark_one(m);
+			}
+			pthread_mutex_unlock(&m->mutex);
+			continue;
+		}
+
+		// the launch of the service, seek, restore and step always need a barrier.
+		barrier(m);
+		inflight = 0;
+	}
+	if (inflight > 0) {
+		barrier(m);
 	}
 	skynet_error(NULL, "play record over >>> %s", m->recordfile);
-    fclose(f); // 关闭文件
+	for (i=0;i<n;i++) {
+		skynet_record_reader_close(streams[i].r);
+		skynet_free(files[i]);
+	}
 	return NULL;
 }
 
 static void
-start(int thread, int is_playrecord, const char* recordfile) {
-	pthread_t pid[thread+5];
+start(int thread, int socketthread, int is_playrecord, const char* recordfile, const char *affinity) {
+	pthread_t pid[thread+socketthread+4];
 
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	M = m;
@@ -407,20 +1046,34 @@ start(int thread, int is_playrecord, const char* recordfile) {
 	m->start_time = skynet_starttime();
 	m->start_time *= 100;
 	m->recordfile = recordfile;
+	m->playrecord = is_playrecord;
+	record_clock_init(&m->clock);
+	m->idle = -1;
+	ATOM_INIT(&m->parked, 0);
+	ATOM_INIT(&m->spinning, 0);
+	m->cpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (m->cpu < 1)
+		m->cpu = 1;
+	skynet_mq_unpark_hook(worker_unpark);
+	// don't spin when playing record, the record thread waits for all the workers parked
+	m->spin = is_playrecord ? 0 : SPIN_MAX;
 
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
+	m->park = skynet_malloc(thread * sizeof(struct worker_park));
+	memset(m->park, 0, thread * sizeof(struct worker_park));
 	int i;
 	for (i=0;i<thread;i++) {
 		m->m[i] = skynet_monitor_new();
+		m->park[i].next = -1;
+		if (pthread_cond_init(&m->park[i].cond, NULL)) {
+			fprintf(stderr, "Init cond error");
+			exit(1);
+		}
 	}
 	if (pthread_mutex_init(&m->mutex, NULL)) {
 		fprintf(stderr, "Init mutex error");
 		exit(1);
 	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
-	}
 	if (pthread_mutex_init(&m->timemutex, NULL)) {
 		fprintf(stderr, "Init mutex error");
 		exit(1);
@@ -436,7 +1089,12 @@ start(int thread, int is_playrecord, const char* recordfile) {
 
 	create_thread(&pid[0], thread_monitor, m);
 	create_thread(&pid[1], thread_timer, m);
-	create_thread(&pid[2], thread_socket, m);
+	struct socket_parm sp[socketthread];
+	for (i=0;i<socketthread;i++) {
+		sp[i].m = m;
+		sp[i].id = i;
+	}
+	create_thread(&pid[2], thread_socket, &sp[0]);
 	create_thread(&pid[3], thread_fasttimer, m);
 
 	static int weight[] = {
@@ -448,6 +1106,7 @@ start(int thread, int is_playrecord, const char* recordfile) {
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
+		wp[i].affinity = affinity;
 		if (i < sizeof(weight)/sizeof(weight[0])) {
 			wp[i].weight= weight[i];
 		} else {
@@ -457,15 +1116,20 @@ start(int thread, int is_playrecord, const char* recordfile) {
 	}
 
 	int len = 4;
+	for (i=1;i<socketthread;i++) {
+		create_thread(&pid[thread+len], thread_socket, &sp[i]);
+		++len;
+	}
 	if (is_playrecord == 1) {
-		create_thread(&pid[thread+4], thread_record, m);
-		len = 5;
+		create_thread(&pid[thread+len], thread_record, m);
+		++len;
 	}
 
 	for (i=0;i<thread+len;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
+	skynet_mq_unpark_hook(NULL);
 	free_monitor(m);
 }
 
@@ -512,12 +1176,16 @@ skynet_start(struct skynet_config * config) {
 		}
 	}
 	skynet_harbor_init(config->harbor);
-	skynet_handle_init(config->harbor, config->thread);
-	skynet_mq_init();
+	// the extra socket threads need their own reader slots
+	skynet_handle_init(config->harbor, config->thread + config->socketthread - 1);
+	skynet_mq_init(config->thread, config->workstealing);
+	skynet_mq_lane_enable(config->prioritylane);
+	skynet_mq_affinity_enable(config->softaffinity);
 	skynet_module_init(config->module_path);
-	skynet_timer_init();
-	skynet_socket_init();
+	skynet_timer_init(config->timerresolution, config->timershard);
+	skynet_socket_init(config->socketthread, config->socketuring);
 	skynet_profile_enable(config->profile);
+	skynet_record_init(config->recordbacklog);
 
 	const uint32_t logger_handle = skynet_context_new(config->logservice, config->logger);
 	if (logger_handle == 0) {
@@ -527,14 +1195,25 @@ skynet_start(struct skynet_config * config) {
 
 	skynet_handle_namehandle(logger_handle, "logger");
 
+	if (config->logbuffer > 0) {
+		if (strcmp(config->logservice, "logger") != 0) {
+			skynet_error(NULL, "logbuffer is ignored, it replaces the logger service only");
+		} else if (skynet_error_async(config->logger, config->logbuffer)) {
+			fprintf(stderr, "Can't start the async logger\n");
+			exit(1);
+		}
+	}
+
 	if (strcmp(config->recordfile, "") == 0) {
 		bootstrap(logger_handle, config->bootstrap);
 
-		start(config->thread, 0, config->recordfile);
+		start(config->thread, config->socketthread, 0, config->recordfile, config->cpuaffinity);
 	} else {
-		start(config->thread, 1, config->recordfile);
+		start(config->thread, config->socketthread, 1, config->recordfile, config->cpuaffinity);
 	}
 
+	skynet_record_exit();
+	skynet_error_exit();
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
 	skynet_socket_free();
@@ -545,9 +1224,13 @@ skynet_start(struct skynet_config * config) {
 
 
 uint64_t skynet_fast_time(uint64_t ftime, uint32_t once_add) {
+	if (M->playrecord) {
+		skynet_error(NULL, "fasttime is not supported when playing record, use replay goto");
+		return 0;
+	}
 	pthread_mutex_lock(&M->timemutex);
 	uint64_t now_time = M->start_time + skynet_now();
-	if (ftime < now_time && once_add > 0) {
+	if (ftime <= now_time) {
 		skynet_error(NULL,"fasttime must be greater than the current time now_time= %lld fasttime = %lld once_add=%u",now_time,ftime,once_add);
 		pthread_mutex_unlock(&M->timemutex);
 		return 0;
@@ -557,3 +1240,19 @@ uint64_t skynet_fast_time(uint64_t ftime, uint32_t once_add) {
 	pthread_mutex_unlock(&M->timemutex);
 	return ftime;
 }
+
+void
+skynet_worker_idlestat(uint64_t *sleep, uint64_t *wakeup, uint64_t *spin) {
+	*sleep = 0;
+	*wakeup = 0;
+	*spin = 0;
+	struct monitor *m = M;
+	if (m == NULL || m->park == NULL)
+		return;
+	int i;
+	for (i=0;i<m->count;i++) {
+		*sleep += m->park[i].sleep;
+		*wakeup += m->park[i].wakeup;
+		*spin += m->park[i].spin;
+	}
+}
@@ -11,8 +11,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
-
-typedef void (*timer_execute_func)(void *ud,void *arg);
+#include <stdio.h>
 
 #define TIME_NEAR_SHIFT 8
 #define TIME_NEAR (1 << TIME_NEAR_SHIFT)
@@ -21,48 +20,155 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
-struct timer_event {
-	uint32_t handle;
-	int session;
-};
+#define TIMER_INDEX_DEFAULT 1024
+#define TIMER_POOL_MAX 4096
 
+// timer nodes are linked in circular lists (head is the sentinel), so they can be removed in O(1),
+// and indexed by (handle, session) for skynet_timeout_cancel.
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;
+	struct timer_node *hnext;
 	uint32_t expire;
+	uint32_t handle;
+	int session;
 };
 
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
 };
 
 struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
 	struct spinlock lock;
+	struct timer_node **index;
+	int index_size;
+	int index_count;
+	struct timer_node *pool;	// free nodes
+	int pool_size;
 	uint32_t time;
+};
+
+// timers are sharded by handle, each shard has its own wheel and lock.
+// all the timers of a service live in one shard, so they still expire in order.
+struct timer_shards {
+	int n;
+	struct timer **shard;
 	uint32_t starttime;
 	uint64_t current;
 	uint64_t current_point;
 };
 
-static struct timer * TI = NULL;
+static struct timer_shards * TI = NULL;
 uint64_t fast_time;
 
+// ticks per second, TIMER_RESOLUTION (centisecond) by default, TIMER_RESOLUTION_MS for millisecond ticks.
+// T->time, expire, current and current_point are in ticks, the apis (skynet_now, skynet_timeout) keep centisecond.
+static int TICKS = TIMER_RESOLUTION;
+static int TICKS_PER_CS = 1;
+
+static inline void
+link_init(struct link_list *list) {
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+}
+
+static inline int
+link_empty(struct link_list *list) {
+	return list->head.next == &list->head;
+}
+
+// detach all the nodes from the list, return a NULL terminated chain
 static inline struct timer_node *
 link_clear(struct link_list *list) {
-	struct timer_node * ret = list->head.next;
-	list->head.next = 0;
-	list->tail = &(list->head);
+	struct timer_node * ret = NULL;
+	if (!link_empty(list)) {
+		ret = list->head.next;
+		list->head.prev->next = NULL;
+	}
+	link_init(list);
 
 	return ret;
 }
 
 static inline void
 link(struct link_list *list,struct timer_node *node) {
-	list->tail->next = node;
-	list->tail = node;
-	node->next=0;
+	struct timer_node *tail = list->head.prev;
+	node->prev = tail;
+	node->next = &list->head;
+	tail->next = node;
+	list->head.prev = node;
+}
+
+static inline void
+link_remove(struct timer_node *node) {
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+static inline uint32_t
+index_hash(uint32_t handle, int session) {
+	return (handle * 2654435761u) ^ (uint32_t)session;
+}
+
+static void
+index_expand(struct timer *T) {
+	int newsize = T->index_size * 2;
+	struct timer_node **index = skynet_malloc(newsize * sizeof(struct timer_node *));
+	memset(index, 0, newsize * sizeof(struct timer_node *));
+	int i;
+	for (i=0;i<T->index_size;i++) {
+		struct timer_node *node = T->index[i];
+		while (node) {
+			struct timer_node *next = node->hnext;
+			struct timer_node **slot = &index[index_hash(node->handle, node->session) & (newsize-1)];
+			node->hnext = *slot;
+			*slot = node;
+			node = next;
+		}
+	}
+	skynet_free(T->index);
+	T->index = index;
+	T->index_size = newsize;
+}
+
+static void
+index_insert(struct timer *T, struct timer_node *node) {
+	if (T->index_count >= T->index_size) {
+		index_expand(T);
+	}
+	struct timer_node **slot = &T->index[index_hash(node->handle, node->session) & (T->index_size-1)];
+	node->hnext = *slot;
+	*slot = node;
+	++T->index_count;
+}
+
+static struct timer_node *
+index_remove(struct timer *T, uint32_t handle, int session) {
+	struct timer_node **slot = &T->index[index_hash(handle, session) & (T->index_size-1)];
+	while (*slot) {
+		struct timer_node *node = *slot;
+		if (node->handle == handle && node->session == session) {
+			*slot = node->hnext;
+			--T->index_count;
+			return node;
+		}
+		slot = &node->hnext;
+	}
+	return NULL;
+}
+
+// T must be locked
+static void
+node_free(struct timer *T, struct timer_node *node) {
+	if (T->pool_size < TIMER_POOL_MAX) {
+		node->next = T->pool;
+		T->pool = node;
+		++T->pool_size;
+	} else {
+		skynet_free(node);
+	}
 }
 
 static void
@@ -87,14 +193,23 @@ add_node(struct timer *T,struct timer_node *node) {
 }
 
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
-
+timer_add(struct timer *T,uint32_t handle,int session,int time) {
 	SPIN_LOCK(T);
 
+		struct timer_node *node = T->pool;
+		if (node) {
+			T->pool = node->next;
+			--T->pool_size;
+		} else {
+			SPIN_UNLOCK(T);
+			node = (struct timer_node *)skynet_malloc(sizeof(*node));
+			SPIN_LOCK(T);
+		}
+		node->handle = handle;
+		node->session = session;
 		node->expire=time+T->time;
 		add_node(T,node);
+		index_insert(T,node);
 
 	SPIN_UNLOCK(T);
 }
@@ -135,47 +250,85 @@ timer_shift(struct timer *T) {
 static inline void
 dispatch_list(struct timer_node *current) {
 	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
 		struct skynet_message message;
 		message.source = 0;
-		message.session = event->session;
+		message.session = current->session;
 		message.data = NULL;
 		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
 
-		skynet_context_push(event->handle, &message);
+		skynet_context_push(current->handle, &message);
 		
-		struct timer_node * temp = current;
 		current=current->next;
-		skynet_free(temp);	
 	} while (current);
 }
 
-static inline void
+// return the number of timers expired
+static inline int
 timer_execute(struct timer *T) {
 	int idx = T->time & TIME_NEAR_MASK;
+	int n = 0;
 	
-	while (T->near[idx].head.next) {
+	while (!link_empty(&T->near[idx])) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		struct timer_node *node;
+		// can't be canceled after detached
+		for (node = current; node; node = node->next) {
+			index_remove(T, node->handle, node->session);
+			++n;
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
 		dispatch_list(current);
 		SPIN_LOCK(T);
+		while (current) {
+			node = current->next;
+			node_free(T, current);
+			current = node;
+		}
+	}
+	return n;
+}
+
+// T must be locked. The ticks before the next one may expire a timer : the near slots
+// are empty until the next shift (which moves the lists from the upper levels), or no timer at all.
+static uint32_t
+timer_idle(struct timer *T, uint32_t max) {
+	if (T->index_count == 0)
+		return max;
+	uint32_t ct = T->time;
+	uint32_t n = 0;
+	uint32_t gap = TIME_NEAR_MASK - (ct & TIME_NEAR_MASK);
+	while (n < gap && n < max && link_empty(&T->near[(ct + n + 1) & TIME_NEAR_MASK])) {
+		++n;
 	}
+	return n;
 }
 
-static void 
-timer_update(struct timer *T) {
+// advance diff ticks, the idle ticks are skipped in a batch, return the number of timers expired
+static int
+timer_update(struct timer *T, uint32_t diff) {
+	int n = 0;
 	SPIN_LOCK(T);
 
 	// try to dispatch timeout 0 (rare condition)
-	timer_execute(T);
-
-	// shift time first, and then dispatch timer message
-	timer_shift(T);
-
-	timer_execute(T);
+	n += timer_execute(T);
+
+	while (diff > 0) {
+		uint32_t idle = timer_idle(T, diff);
+		if (idle > 0) {
+			// no timer in these ticks, they are not the boundary of the near wheel either
+			T->time += idle;
+			diff -= idle;
+			continue;
+		}
+		// shift time first, and then dispatch timer message
+		timer_shift(T);
+		n += timer_execute(T);
+		--diff;
+	}
 
 	SPIN_UNLOCK(T);
+	return n;
 }
 
 static struct timer *
@@ -186,24 +339,31 @@ timer_create_timer() {
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
-		link_clear(&r->near[i]);
+		link_init(&r->near[i]);
 	}
 
 	for (i=0;i<4;i++) {
 		for (j=0;j<TIME_LEVEL;j++) {
-			link_clear(&r->t[i][j]);
+			link_init(&r->t[i][j]);
 		}
 	}
 
 	SPIN_INIT(r)
 
-	r->current = 0;
+	r->index_size = TIMER_INDEX_DEFAULT;
+	r->index = skynet_malloc(r->index_size * sizeof(struct timer_node *));
+	memset(r->index, 0, r->index_size * sizeof(struct timer_node *));
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
+static inline struct timer *
+timer_shard(uint32_t handle) {
+	return TI->shard[handle % TI->n];
+}
+
+static int
+timeout_ticks(uint32_t handle, int time, int session) {
 	if (time <= 0) {
 		struct skynet_message message;
 		message.source = 0;
@@ -215,22 +375,51 @@ skynet_timeout(uint32_t handle, int time, int session) {
 			return -1;
 		}
 	} else {
-		struct timer_event event;
-		event.handle = handle;
-		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(timer_shard(handle), handle, session, time);
 	}
 
 	return session;
 }
 
-// centisecond: 1/100 second
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	if (time > INT32_MAX / TICKS_PER_CS) {
+		time = INT32_MAX / TICKS_PER_CS;
+	}
+	return timeout_ticks(handle, time * TICKS_PER_CS, session);
+}
+
+int
+skynet_timeout_us(uint32_t handle, int64_t us, int session) {
+	// round up, never expires earlier than us
+	int64_t ticks = us > 0 ? (us * TICKS + 999999) / 1000000 : 0;
+	if (ticks > INT32_MAX) {
+		ticks = INT32_MAX;
+	}
+	return timeout_ticks(handle, (int)ticks, session);
+}
+
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer *T = timer_shard(handle);
+	SPIN_LOCK(T);
+	struct timer_node *node = index_remove(T, handle, session);
+	if (node) {
+		link_remove(node);
+		node_free(T, node);
+	}
+	SPIN_UNLOCK(T);
+
+	return node != NULL;
+}
+
+// tick: 1/TICKS second
 static void
-systime(uint32_t *sec, uint32_t *cs) {
+systime(uint32_t *sec, uint32_t *tick) {
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
 	*sec = (uint32_t)ti.tv_sec;
-	*cs = (uint32_t)(ti.tv_nsec / 10000000);
+	*tick = (uint32_t)(ti.tv_nsec / (1000000000 / TICKS));
 }
 
 static uint64_t
@@ -238,14 +427,15 @@ gettime() {
 	uint64_t t;
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * TICKS;
+	t += ti.tv_nsec / (1000000000 / TICKS);
 	t += fast_time;
 	return t;
 }
 
-void
+int
 skynet_updatetime(void) {
+	int n = 0;
 	uint64_t cp = gettime();
 	if(cp < TI->current_point) {
 		skynet_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
@@ -254,11 +444,29 @@ skynet_updatetime(void) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
 		TI->current_point = cp;
 		TI->current += diff;
+		// each shard catches up at once, the timers of a service are still in order
 		int i;
-		for (i=0;i<diff;i++) {
-			timer_update(TI);
+		for (i=0;i<TI->n;i++) {
+			n += timer_update(TI->shard[i], diff);
 		}
 	}
+	return n;
+}
+
+uint32_t
+skynet_timer_idle(uint32_t max) {
+	uint64_t ticks = (uint64_t)max * TICKS_PER_CS;
+	uint32_t idle = ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+	int i;
+	for (i=0;i<TI->n && idle > 0;i++) {
+		struct timer *T = TI->shard[i];
+		SPIN_LOCK(T);
+		uint32_t n = timer_idle(T, idle);
+		SPIN_UNLOCK(T);
+		if (n < idle)
+			idle = n;
+	}
+	return idle / TICKS_PER_CS;
 }
 
 uint32_t
@@ -268,18 +476,44 @@ skynet_starttime(void) {
 
 uint64_t 
 skynet_now(void) {
-	return TI->current;
+	return TI->current / TICKS_PER_CS;
+}
+
+uint64_t
+skynet_now_ms(void) {
+	return TI->current * 1000 / TICKS;
+}
+
+int
+skynet_timer_resolution(void) {
+	return TICKS;
 }
 
 void
 skynet_time_fast(uint32_t addtime) {
-	fast_time += addtime;
+	fast_time += (uint64_t)addtime * TICKS_PER_CS;
 }
 
 void 
-skynet_timer_init(void) {
+skynet_timer_init(int resolution, int shard) {
+	if (resolution != TIMER_RESOLUTION && resolution != TIMER_RESOLUTION_MS) {
+		fprintf(stderr, "Invalid timerresolution %d, use %d\n", resolution, TIMER_RESOLUTION);
+		resolution = TIMER_RESOLUTION;
+	}
+	TICKS = resolution;
+	TICKS_PER_CS = resolution / TIMER_RESOLUTION;
+	if (shard < 1) {
+		shard = 1;
+	}
 	fast_time = 0;
-	TI = timer_create_timer();
+	TI = (struct timer_shards *)skynet_malloc(sizeof(struct timer_shards));
+	memset(TI, 0, sizeof(*TI));
+	TI->n = shard;
+	TI->shard = (struct timer **)skynet_malloc(shard * sizeof(struct timer *));
+	int i;
+	for (i=0;i<shard;i++) {
+		TI->shard[i] = timer_create_timer();
+	}
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
 	TI->current = current;
@@ -307,5 +541,5 @@ skynet_timer_setstarttime(uint32_t time) {
 
 void
 skynet_timer_setcurrent(uint64_t current) {
-	TI->current = current;
+	TI->current = current * TICKS_PER_CS;
 }
\ No newline at end of file
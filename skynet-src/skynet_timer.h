@@ -3,13 +3,23 @@
 
 #include <stdint.h>
 
+// ticks per second
+#define TIMER_RESOLUTION 100
+#define TIMER_RESOLUTION_MS 1000
+
 int skynet_timeout(uint32_t handle, int time, int session);
-void skynet_updatetime(void);
+int skynet_timeout_us(uint32_t handle, int64_t us, int session);
+// remove the timer before it expires, return 1 if removed, 0 if not found (or the message has been sent)
+int skynet_timeout_cancel(uint32_t handle, int session);
+int skynet_updatetime(void);	// return the number of timers expired
 uint32_t skynet_starttime(void);
 uint64_t skynet_thread_time(void);	// for profile, in micro second
 void skynet_time_fast(uint32_t addtime);
+// centiseconds (at most max) the clock can jump without expiring any timer, it's a lower bound
+uint32_t skynet_timer_idle(uint32_t max);
+int skynet_timer_resolution(void);
 
-void skynet_timer_init(void);
+void skynet_timer_init(int resolution, int shard);
 
 //录像用
 void skynet_timer_setstarttime(uint32_t time);
@@ -2,6 +2,9 @@
 
 #include "socket_server.h"
 #include "socket_poll.h"
+#ifdef USE_IO_URING
+#include "socket_uring.h"
+#endif
 #include "atomic.h"
 #include "spinlock.h"
 
@@ -16,6 +19,11 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <sched.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #define MAX_INFO 128
 // MAX_SOCKET will be 2^MAX_SOCKET_P
@@ -50,6 +58,21 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+// the slots of the ctrl command ring of a poller, must be power of 2
+#define CTRL_RING_SIZE 1024
+
+#ifdef USE_IO_URING
+// user_data of io_uring : op (16 bits) | generation of recv/accept (16 bits) | socket id (32 bits)
+#define UR_POLL 1
+#define UR_RECV 2
+#define UR_ACCEPT 3
+#define UR_DOORBELL 4
+#define UR_IGNORE 5
+#define UR_DATA(op, gen, id) ((uint64_t)(op) << 48 | (uint64_t)((gen) & 0xffff) << 32 | (uint32_t)(id))
+// uring_event passes the event to the readiness dispatch of epoll
+#define UR_PASS (-2)
+#endif
+
 // EAGAIN and EWOULDBLOCK may be not the same value.
 #if (EAGAIN != EWOULDBLOCK)
 #define AGAIN_WOULDBLOCK EAGAIN : case EWOULDBLOCK
@@ -110,24 +133,55 @@ struct socket {
 	int dw_offset;
 	const void * dw_buffer;
 	size_t dw_size;
+#ifdef USE_IO_URING
+	unsigned uring_events;	// the events of the multishot poll
+	uint16_t uring_gen;	// the generation of the multishot recv or accept
+	bool uring_recv;
+	bool uring_accept;
+#endif
 };
 
-struct socket_server {
-	volatile uint64_t time;
+// A ctrl command in the ring. seq is the ticket of the slot (see poller_request), the payload is the union of request_package.
+struct ctrl_cell {
+	ATOM_SIZET seq;
+	uint8_t type;
+	uint8_t len;
+	uint8_t buffer[256];
+};
+
+// The sockets are sharded by slot into the pollers, each one has its own event pool and ctrl ring,
+// and runs in its own thread (socket_server_poll_loop). A socket is only touched by the thread of its poller,
+// so the messages of a socket keep their order.
+// The ctrl commands are pushed into the ring by any thread, and the doorbell (an eventfd, or a pipe out of linux)
+// is only rung when the poller is sleeping in sp_wait, so a command costs no syscall while the poller is busy.
+struct socket_poller {
 	int reserve_fd;	// for EMFILE
-	int recvctrl_fd;
+	int recvctrl_fd;	// the doorbell, the same fd as sendctrl_fd for eventfd
 	int sendctrl_fd;
 	int checkctrl;
+	ATOM_INT sleeping;
+	size_t ctrl_head;	// only read by the poller
+	ATOM_SIZET ctrl_tail;
+	struct ctrl_cell ctrl[CTRL_RING_SIZE];
 	poll_fd event_fd;
-	ATOM_INT alloc_id;
 	int event_n;
 	int event_index;
-	struct socket_object_interface soi;
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
 	char buffer[MAX_INFO];
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds;
+#ifdef USE_IO_URING
+	struct uring uring;	// uring.fd is -1 when the poller uses epoll
+	struct io_uring_cqe cqe[MAX_EVENT];
+#endif
+};
+
+struct socket_server {
+	volatile uint64_t time;
+	ATOM_INT alloc_id;
+	int poller_n;
+	struct socket_object_interface soi;
+	struct socket slot[MAX_SOCKET];
+	struct socket_poller poller[1];
 };
 
 struct request_open {
@@ -197,6 +251,12 @@ struct request_dial_udp {
 	uint8_t address[UDP_ADDRESS_SIZE];
 };
 
+struct request_accept {
+	int id;
+	int fd;
+	uintptr_t opaque;
+};
+
 /*
 	The first byte is TYPE
 	R Resume socket
@@ -214,10 +274,12 @@ struct request_dial_udp {
 	N client dial to UDP host port
 	T Set opt
 	U Create UDP socket
+	F Add an accepted socket to its poller
+
+	Every request begins with the socket id, it goes to the poller of the socket.
  */
 
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy
 	union {
 		char buffer[256];
 		struct request_open open;
@@ -231,6 +293,7 @@ struct request_package {
 		struct request_udp udp;
 		struct request_setudp set_udp;
 		struct request_dial_udp dial_udp;
+		struct request_accept accept;
 	} u;
 	uint8_t dummy[256];
 };
@@ -288,6 +351,16 @@ socket_unlock(struct socket_lock *sl) {
 	}
 }
 
+static inline struct socket_poller *
+socket_poller(struct socket_server *ss, struct socket *s) {
+	return &ss->poller[(s - ss->slot) % ss->poller_n];
+}
+
+static inline struct socket_poller *
+id_poller(struct socket_server *ss, int id) {
+	return socket_poller(ss, &ss->slot[HASH_ID(id)]);
+}
+
 static inline int
 socket_invalid(struct socket *s, int id) {
 	return (s->id != id || ATOM_LOAD(&s->type) == SOCKET_TYPE_INVALID);
@@ -386,36 +459,138 @@ clear_wb_list(struct wb_list *list) {
 	list->tail = NULL;
 }
 
-struct socket_server *
-socket_server_create(uint64_t time) {
-	int i;
-	int fd[2];
+static int
+doorbell_create(int fd[2]) {
+#if defined(__linux__)
+	int efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0)
+		return 1;
+	fd[0] = efd;
+	fd[1] = efd;
+#else
+	if (pipe(fd))
+		return 1;
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+#endif
+	return 0;
+}
+
+static void
+doorbell_release(int fd[2]) {
+	close(fd[0]);
+	if (fd[1] != fd[0])
+		close(fd[1]);
+}
+
+#ifdef USE_IO_URING
+
+static inline bool
+poller_uring(struct socket_poller *p) {
+	return p->uring.fd >= 0;
+}
+
+#else
+
+static inline bool
+poller_uring(struct socket_poller *p) {
+	return false;
+}
+
+#endif
+
+// the event pool of the poller, io_uring or epoll (kqueue)
+static int
+poller_event_init(struct socket_poller *p, int ctrl_fd, bool uring) {
+	p->event_fd = -1;
+#ifdef USE_IO_URING
+	p->uring.fd = -1;
+	if (uring) {
+		if (su_create(&p->uring) == 0) {
+			su_poll(&p->uring, ctrl_fd, UR_DATA(UR_DOORBELL, 0, 0), POLLIN);
+			return 0;
+		}
+		skynet_error(NULL, "socket-server : io_uring is unavailable, use epoll instead.");
+	}
+#endif
 	poll_fd efd = sp_create();
 	if (sp_invalid(efd)) {
 		skynet_error(NULL, "socket-server error: create event pool failed.");
-		return NULL;
-	}
-	if (pipe(fd)) {
-		sp_release(efd);
-		skynet_error(NULL, "socket-server error: create socket pair failed.");
-		return NULL;
+		return 1;
 	}
-	if (sp_add(efd, fd[0], NULL)) {
+	if (sp_add(efd, ctrl_fd, NULL)) {
 		// add recvctrl_fd to event poll
 		skynet_error(NULL, "socket-server error: can't add server fd to event pool.");
-		close(fd[0]);
-		close(fd[1]);
 		sp_release(efd);
-		return NULL;
+		return 1;
 	}
+	p->event_fd = efd;
+	return 0;
+}
 
-	struct socket_server *ss = MALLOC(sizeof(*ss));
+static int
+poller_init(struct socket_poller *p, bool uring) {
+	int fd[2];
+	int i;
+	if (doorbell_create(fd)) {
+		skynet_error(NULL, "socket-server error: create ctrl doorbell failed.");
+		return 1;
+	}
+	if (poller_event_init(p, fd[0], uring)) {
+		doorbell_release(fd);
+		return 1;
+	}
+	p->recvctrl_fd = fd[0];
+	p->sendctrl_fd = fd[1];
+	p->checkctrl = 1;
+	ATOM_INIT(&p->sleeping, 0);
+	p->ctrl_head = 0;
+	ATOM_INIT(&p->ctrl_tail, 0);
+	for (i=0;i<CTRL_RING_SIZE;i++) {
+		ATOM_INIT(&p->ctrl[i].seq, i);
+	}
+	p->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
+	p->event_n = 0;
+	p->event_index = 0;
+	return 0;
+}
+
+static void
+poller_release(struct socket_poller *p) {
+	int fd[2] = { p->recvctrl_fd, p->sendctrl_fd };
+	doorbell_release(fd);
+#ifdef USE_IO_URING
+	if (poller_uring(p))
+		su_release(&p->uring);
+#endif
+	if (!sp_invalid(p->event_fd))
+		sp_release(p->event_fd);
+	if (p->reserve_fd >= 0)
+		close(p->reserve_fd);
+}
+
+struct socket_server *
+socket_server_create(uint64_t time) {
+	return socket_server_create_pollers(time, 1, 0);
+}
+
+struct socket_server *
+socket_server_create_pollers(uint64_t time, int pollers, int uring) {
+	int i;
+	if (pollers < 1)
+		pollers = 1;
+	struct socket_server *ss = MALLOC(sizeof(*ss) + (pollers - 1) * sizeof(struct socket_poller));
+	for (i=0;i<pollers;i++) {
+		if (poller_init(&ss->poller[i], uring)) {
+			while (--i >= 0) {
+				poller_release(&ss->poller[i]);
+			}
+			FREE(ss);
+			return NULL;
+		}
+	}
+	ss->poller_n = pollers;
 	ss->time = time;
-	ss->event_fd = efd;
-	ss->recvctrl_fd = fd[0];
-	ss->sendctrl_fd = fd[1];
-	ss->checkctrl = 1;
-	ss->reserve_fd = dup(1);	// reserve an extra fd for EMFILE
 
 	for (i=0;i<MAX_SOCKET;i++) {
 		struct socket *s = &ss->slot[i];
@@ -425,15 +600,16 @@ socket_server_create(uint64_t time) {
 		spinlock_init(&s->dw_lock);
 	}
 	ATOM_INIT(&ss->alloc_id , 0);
-	ss->event_n = 0;
-	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
 
+int
+socket_server_pollers(struct socket_server *ss) {
+	return ss->poller_n;
+}
+
 void
 socket_server_updatetime(struct socket_server *ss, uint64_t time) {
 	ss->time = time;
@@ -487,6 +663,103 @@ clone_buffer(struct socket_sendbuffer *buf, size_t *sz) {
 	return NULL;
 }
 
+#ifdef USE_IO_URING
+
+// arm or cancel the multishot ops of the socket by its state :
+// a connected tcp socket reads by multishot recv, a listen socket accepts by multishot accept,
+// and the multishot poll waits for the rest (udp, connecting, writable).
+static void
+uring_update(struct socket_poller *p, struct socket *s) {
+	struct uring *u = &p->uring;
+	int type = ATOM_LOAD(&s->type);
+	bool recv = s->reading && s->protocol == PROTOCOL_TCP &&
+		(type == SOCKET_TYPE_CONNECTED || type == SOCKET_TYPE_HALFCLOSE_WRITE);
+	bool accept = s->reading && type == SOCKET_TYPE_LISTEN;
+	unsigned events = ((s->reading && !recv && !accept) ? POLLIN : 0) | (s->writing ? POLLOUT : 0);
+	if (recv != s->uring_recv) {
+		if (recv) {
+			++s->uring_gen;
+			su_recv(u, s->fd, UR_DATA(UR_RECV, s->uring_gen, s->id));
+		} else {
+			su_cancel(u, UR_DATA(UR_RECV, s->uring_gen, s->id), UR_DATA(UR_IGNORE, 0, 0));
+		}
+		s->uring_recv = recv;
+	}
+	if (accept != s->uring_accept) {
+		if (accept) {
+			++s->uring_gen;
+			su_accept(u, s->fd, UR_DATA(UR_ACCEPT, s->uring_gen, s->id));
+		} else {
+			su_cancel(u, UR_DATA(UR_ACCEPT, s->uring_gen, s->id), UR_DATA(UR_IGNORE, 0, 0));
+		}
+		s->uring_accept = accept;
+	}
+	if (events != s->uring_events) {
+		su_poll_update(u, UR_DATA(UR_POLL, 0, s->id), events, UR_DATA(UR_IGNORE, 0, 0));
+		s->uring_events = events;
+	}
+}
+
+#endif
+
+static int
+poller_add(struct socket_server *ss, struct socket *s, int id, int fd) {
+	struct socket_poller *p = socket_poller(ss, s);
+#ifdef USE_IO_URING
+	if (poller_uring(p)) {
+		s->uring_events = POLLIN;
+		s->uring_recv = false;
+		s->uring_accept = false;
+		su_poll(&p->uring, fd, UR_DATA(UR_POLL, 0, id), POLLIN);
+		return 0;
+	}
+#endif
+	return sp_add(p->event_fd, fd, s);
+}
+
+static void
+poller_del(struct socket_server *ss, struct socket *s) {
+	struct socket_poller *p = socket_poller(ss, s);
+#ifdef USE_IO_URING
+	if (poller_uring(p)) {
+		struct uring *u = &p->uring;
+		su_cancel(u, UR_DATA(UR_POLL, 0, s->id), UR_DATA(UR_IGNORE, 0, 0));
+		if (s->uring_recv || s->uring_accept) {
+			su_cancel(u, UR_DATA(s->uring_recv ? UR_RECV : UR_ACCEPT, s->uring_gen, s->id), UR_DATA(UR_IGNORE, 0, 0));
+			s->uring_recv = false;
+			s->uring_accept = false;
+		}
+		// the pending ops hold the file, cancel them before close(fd)
+		su_submit(u, false);
+		return;
+	}
+#endif
+	sp_del(p->event_fd, s->fd);
+}
+
+static int
+poller_enable(struct socket_server *ss, struct socket *s) {
+	struct socket_poller *p = socket_poller(ss, s);
+#ifdef USE_IO_URING
+	if (poller_uring(p)) {
+		uring_update(p, s);
+		return 0;
+	}
+#endif
+	return sp_enable(p->event_fd, s->fd, s, s->reading, s->writing);
+}
+
+// The type of the socket changed (connected or listen), io_uring switches to multishot recv or accept.
+static inline void
+poller_retype(struct socket_server *ss, struct socket *s) {
+#ifdef USE_IO_URING
+	struct socket_poller *p = socket_poller(ss, s);
+	if (poller_uring(p)) {
+		uring_update(p, s);
+	}
+#endif
+}
+
 static void
 force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	result->id = s->id;
@@ -500,7 +773,7 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, s
 	assert(type != SOCKET_TYPE_RESERVE);
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
-	sp_del(ss->event_fd, s->fd);
+	poller_del(ss, s);
 	socket_lock(l);
 	if (type != SOCKET_TYPE_BIND) {
 		if (close(s->fd) < 0) {
@@ -533,11 +806,9 @@ socket_server_release(struct socket_server *ss) {
 		}
 		spinlock_destroy(&s->dw_lock);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
-	sp_release(ss->event_fd);
-	if (ss->reserve_fd >= 0)
-		close(ss->reserve_fd);
+	for (i=0;i<ss->poller_n;i++) {
+		poller_release(&ss->poller[i]);
+	}
 	FREE(ss);
 }
 
@@ -551,7 +822,7 @@ static inline int
 enable_write(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->writing != enable) {
 		s->writing = enable;
-		return sp_enable(ss->event_fd, s->fd, s, s->reading, enable);
+		return poller_enable(ss, s);
 	}
 	return 0;
 }
@@ -560,7 +831,7 @@ static inline int
 enable_read(struct socket_server *ss, struct socket *s, bool enable) {
 	if (s->reading != enable) {
 		s->reading = enable;
-		return sp_enable(ss->event_fd, s->fd, s, enable, s->writing);
+		return poller_enable(ss, s);
 	}
 	return 0;
 }
@@ -570,7 +841,7 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	struct socket * s = &ss->slot[HASH_ID(id)];
 	assert(ATOM_LOAD(&s->type) == SOCKET_TYPE_RESERVE);
 
-	if (sp_add(ss->event_fd, fd, s)) {
+	if (poller_add(ss, s, id, fd)) {
 		ATOM_STORE(&s->type, SOCKET_TYPE_INVALID);
 		return NULL;
 	}
@@ -665,10 +936,12 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 
 	if(status == 0) {
 		ATOM_STORE(&ns->type , SOCKET_TYPE_CONNECTED);
+		poller_retype(ss, ns);
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
+		struct socket_poller *p = socket_poller(ss, ns);
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, p->buffer, sizeof(p->buffer))) {
+			result->data = p->buffer;
 		}
 		freeaddrinfo( ai_list );
 		return SOCKET_OPEN;
@@ -1110,16 +1383,17 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 	result->ud = 0;
 	result->data = "listen";
 
+	struct socket_poller *p = socket_poller(ss, s);
 	union sockaddr_all u;
 	socklen_t slen = sizeof(u);
 	if (getsockname(listen_fd, &u.s, &slen) == 0) {
 		void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-		if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer)) == 0) {
+		if (inet_ntop(u.s.sa_family, sin_addr, p->buffer, sizeof(p->buffer)) == 0) {
 			result->data = strerror(errno);
 			return SOCKET_ERR;
 		}
 		int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
-		result->data = ss->buffer;
+		result->data = p->buffer;
 		result->ud = sin_port;
 	} else {
 		result->data = strerror(errno);
@@ -1238,6 +1512,7 @@ resume_socket(struct socket_server *ss, struct request_resumepause *request, str
 	uint8_t type = ATOM_LOAD(&s->type);
 	if (type == SOCKET_TYPE_PACCEPT || type == SOCKET_TYPE_PLISTEN) {
 		ATOM_STORE(&s->type , (type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN);
+		poller_retype(ss, s);
 		s->opaque = request->opaque;
 		result->data = "start";
 		return SOCKET_OPEN;
@@ -1276,33 +1551,32 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 }
 
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
+doorbell_drain(struct socket_poller *p) {
+	// the doorbell is nonblocking, an eventfd is drained by one read
+	char tmp[64];
 	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
+		int n = read(p->recvctrl_fd, tmp, sizeof(tmp));
+		if (n < 0) {
+			switch(errno) {
+			case EINTR:
 				continue;
-			skynet_error(NULL, "socket-server : read pipe error %s.",strerror(errno));
+			case AGAIN_WOULDBLOCK:
+				break;
+			default:
+				skynet_error(NULL, "socket-server : read ctrl doorbell error %s.", strerror(errno));
+				break;
+			}
 			return;
 		}
-		// must atomic read from a pipe
-		assert(n == sz);
-		return;
+		if (n < (int)sizeof(tmp))
+			return;
 	}
 }
 
 static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
-
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
-	}
-	return 0;
+has_cmd(struct socket_poller *p) {
+	struct ctrl_cell *c = &p->ctrl[p->ctrl_head & (CTRL_RING_SIZE - 1)];
+	return ATOM_LOAD(&c->seq) == p->ctrl_head + 1;
 }
 
 static void
@@ -1324,6 +1598,18 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	memset(ns->p.udp_address, 0, sizeof(ns->p.udp_address));
 }
 
+static void
+add_accept_socket(struct socket_server *ss, struct request_accept *request) {
+	int id = request->id;
+	struct socket *ns = new_fd(ss, id, request->fd, PROTOCOL_TCP, request->opaque, false);
+	if (ns == NULL) {
+		// SOCKET_ACCEPT is raised, socket_server_start will report the error
+		close(request->fd);
+		return;
+	}
+	ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
+}
+
 static int
 set_udp_address(struct socket_server *ss, struct request_setudp *request, struct socket_message *result) {
 	int id = request->id;
@@ -1403,15 +1689,16 @@ dec_sending_ref(struct socket_server *ss, int id) {
 
 // return type
 static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
+ctrl_cmd(struct socket_server *ss, struct socket_poller *p, struct socket_message *result) {
 	// the length of message is one byte, so 256 buffer size is enough.
 	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
+	struct ctrl_cell *c = &p->ctrl[p->ctrl_head & (CTRL_RING_SIZE - 1)];
+	int type = c->type;
+	int len = c->len;
+	memcpy(buffer, c->buffer, len);
+	// release the cell to the producers of the next round
+	ATOM_STORE(&c->seq, p->ctrl_head + CTRL_RING_SIZE);
+	++p->ctrl_head;
 	// ctrl command only exist in local fd, so don't worry about endian.
 	switch (type) {
 	case 'R':
@@ -1456,6 +1743,9 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'F':
+		add_accept_socket(ss, (struct request_accept *)buffer);
+		return -1;
 	default:
 		skynet_error(NULL, "socket-server error: Unknown ctrl %c.",type);
 		return -1;
@@ -1464,6 +1754,30 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+// recv 0 (eof)
+static int
+report_eof(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	if (s->closing) {
+		// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
+		if (nomore_sending_data(s)) {
+			force_close(ss,s,l,result);
+		}
+		return -1;
+	}
+	int t = ATOM_LOAD(&s->type);
+	if (t == SOCKET_TYPE_HALFCLOSE_READ) {
+		// Rare case : Already shutdown read.
+		return -1;
+	}
+	if (t == SOCKET_TYPE_HALFCLOSE_WRITE) {
+		// Remote shutdown read (write error) before.
+		force_close(ss,s,l,result);
+	} else {
+		close_read(ss, s, result);
+	}
+	return SOCKET_CLOSE;
+}
+
 // return -1 (ignore) when error
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
@@ -1483,25 +1797,7 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lo
 	}
 	if (n==0) {
 		FREE(buffer);
-		if (s->closing) {
-			// Rare case : if s->closing is true, reading event is disable, and SOCKET_CLOSE is raised.
-			if (nomore_sending_data(s)) {
-				force_close(ss,s,l,result);
-			}
-			return -1;
-		}
-		int t = ATOM_LOAD(&s->type);
-		if (t == SOCKET_TYPE_HALFCLOSE_READ) {
-			// Rare case : Already shutdown read.
-			return -1;
-		}
-		if (t == SOCKET_TYPE_HALFCLOSE_WRITE) {
-			// Remote shutdown read (write error) before.
-			force_close(ss,s,l,result);
-		} else {
-			close_read(ss, s, result);
-		}
-		return SOCKET_CLOSE;
+		return report_eof(ss, s, l, result);
 	}
 
 	if (halfclose_read(s)) {
@@ -1549,7 +1845,8 @@ static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	union sockaddr_all sa;
 	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	struct socket_poller *p = socket_poller(ss, s);
+	int n = recvfrom(s->fd, p->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
 	if (n<0) {
 #ifdef _WIN32
 		errno = WSAGetLastError();
@@ -1583,7 +1880,7 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lo
 		data = MALLOC(n + 1 + 2 + 16);
 		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
 	}
-	memcpy(data, ss->udpbuffer, n);
+	memcpy(data, p->udpbuffer, n);
 
 	result->opaque = s->opaque;
 	result->id = s->id;
@@ -1605,6 +1902,7 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 		return SOCKET_ERR;
 	} else {
 		ATOM_STORE(&s->type , SOCKET_TYPE_CONNECTED);
+		poller_retype(ss, s);
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
@@ -1615,12 +1913,13 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l
 				return SOCKET_ERR;
 			}
 		}
+		struct socket_poller *p = socket_poller(ss, s);
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
 			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
+			if (inet_ntop(u.s.sa_family, sin_addr, p->buffer, sizeof(p->buffer))) {
+				result->data = p->buffer;
 				return SOCKET_OPEN;
 			}
 		}
@@ -1643,68 +1942,275 @@ getname(union sockaddr_all *u, char *buffer, size_t sz) {
 	}
 }
 
+static void send_request(struct socket_server *ss, struct request_package *request, char type, int len);
+static inline void request_init(struct request_package *req);
+
 // return 0 when failed, or -1 when file limit
 static int
-report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
-	union sockaddr_all u;
-	socklen_t len = sizeof(u);
-	int client_fd = accept(s->fd, &u.s, &len);
-	if (client_fd < 0) {
-		if (errno == EMFILE || errno == ENFILE) {
-			result->opaque = s->opaque;
-			result->id = s->id;
-			result->ud = 0;
-			result->data = strerror(errno);
-
-			// See https://stackoverflow.com/questions/47179793/how-to-gracefully-handle-accept-giving-emfile-and-close-the-connection
-			if (ss->reserve_fd >= 0) {
-				close(ss->reserve_fd);
-				client_fd = accept(s->fd, &u.s, &len);
-				if (client_fd >= 0) {
-					close(client_fd);
-				}
-				ss->reserve_fd = dup(1);
+report_accept_error(struct socket_server *ss, struct socket *s, int err, struct socket_message *result) {
+	struct socket_poller *p = socket_poller(ss, s);
+	if (err == EMFILE || err == ENFILE) {
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = 0;
+		result->data = strerror(err);
+
+		// See https://stackoverflow.com/questions/47179793/how-to-gracefully-handle-accept-giving-emfile-and-close-the-connection
+		if (p->reserve_fd >= 0) {
+			close(p->reserve_fd);
+			int client_fd = accept(s->fd, NULL, NULL);
+			if (client_fd >= 0) {
+				close(client_fd);
 			}
-			return -1;
-		} else {
-			return 0;
+			p->reserve_fd = dup(1);
 		}
+		return -1;
 	}
+	return 0;
+}
+
+// add the accepted (nonblocking) client_fd, return 0 when failed
+static int
+accept_socket(struct socket_server *ss, struct socket *s, int client_fd, union sockaddr_all *u, struct socket_message *result) {
+	struct socket_poller *p = socket_poller(ss, s);
 	int id = reserve_id(ss);
 	if (id < 0) {
 		close(client_fd);
 		return 0;
 	}
 	socket_keepalive(client_fd);
-	sp_nonblocking(client_fd);
-	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
-	if (ns == NULL) {
-		close(client_fd);
-		return 0;
+	if (id_poller(ss, id) == p) {
+		struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
+		if (ns == NULL) {
+			close(client_fd);
+			return 0;
+		}
+		ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
+	} else {
+		// the new socket belongs to another poller, it's added before any request of the new id
+		struct request_package request;
+		request_init(&request);
+		request.u.accept.id = id;
+		request.u.accept.fd = client_fd;
+		request.u.accept.opaque = s->opaque;
+		send_request(ss, &request, 'F', sizeof(request.u.accept));
 	}
 	// accept new one connection
 	stat_read(ss,s,1);
 
-	ATOM_STORE(&ns->type , SOCKET_TYPE_PACCEPT);
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = id;
 	result->data = NULL;
 
-	if (getname(&u, ss->buffer, sizeof(ss->buffer))) {
-		result->data = ss->buffer;
+	if (getname(u, p->buffer, sizeof(p->buffer))) {
+		result->data = p->buffer;
 	}
 
 	return 1;
 }
 
+// return 0 when failed, or -1 when file limit
+static int
+report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	union sockaddr_all u;
+	socklen_t len = sizeof(u);
+	int client_fd = accept(s->fd, &u.s, &len);
+	if (client_fd < 0) {
+		return report_accept_error(ss, s, errno, result);
+	}
+	sp_nonblocking(client_fd);
+	return accept_socket(ss, s, client_fd, &u, result);
+}
+
+#ifdef USE_IO_URING
+
+// the multishot recv stops without IORING_CQE_F_MORE, arm it again if it's still wanted
+static void
+uring_recv_stop(struct socket_poller *p, struct io_uring_cqe *cqe, struct socket *s, bool valid, int gen) {
+	if (!(cqe->flags & IORING_CQE_F_MORE) && valid && s->uring_recv && gen == s->uring_gen) {
+		int n = cqe->res;
+		if (n > 0 || n == -ENOBUFS) {
+			// the provided buffers run out
+			su_recv(&p->uring, s->fd, UR_DATA(UR_RECV, gen, s->id));
+		} else {
+			s->uring_recv = false;
+		}
+	}
+}
+
+// copy the data out of the provided buffer, and give the buffer back
+static void
+uring_recv_copy(struct socket_poller *p, struct io_uring_cqe *cqe, char *buffer) {
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (buffer) {
+			memcpy(buffer, su_buffer(&p->uring, bid), cqe->res);
+		}
+		su_buffer_return(&p->uring, bid);
+	}
+}
+
+// the completion of multishot recv. The data of the socket in the following completions of the batch
+// are merged into one message, as read() fills a bigger buffer (s->p.size) in the epoll way.
+static int
+uring_forward_tcp(struct socket_server *ss, struct socket_poller *p, struct io_uring_cqe *cqe, struct socket *s, bool valid, int gen, struct socket_message *result) {
+	int n = cqe->res;
+	uring_recv_stop(p, cqe, s, valid, gen);
+	if (!valid || n <= 0) {
+		uring_recv_copy(p, cqe, NULL);
+		if (!valid)
+			return -1;
+		if (n < 0) {
+			switch (-n) {
+			case ENOBUFS:
+			case ECANCELED:
+			case EINTR:
+			case AGAIN_WOULDBLOCK:
+				return -1;
+			}
+			return report_error(s, result, strerror(-n));
+		}
+		struct socket_lock l;
+		socket_lock_init(s, &l);
+		return report_eof(ss, s, &l, result);
+	}
+	uint32_t id = (uint32_t)cqe->user_data;
+	int sz = n;
+	int last = p->event_index;
+	int i;
+	for (i=p->event_index; i<p->event_n; i++) {
+		struct io_uring_cqe *next = &p->cqe[i];
+		if ((uint32_t)next->user_data == id && (next->user_data >> 48) == UR_RECV) {
+			if (next->res <= 0)
+				break;
+			sz += next->res;
+			last = i + 1;
+		}
+	}
+	char * buffer = MALLOC(sz);
+	uring_recv_copy(p, cqe, buffer);
+	for (i=p->event_index; i<last; i++) {
+		struct io_uring_cqe *next = &p->cqe[i];
+		if ((uint32_t)next->user_data == id && (next->user_data >> 48) == UR_RECV) {
+			uring_recv_stop(p, next, s, valid, (int)(next->user_data >> 32) & 0xffff);
+			uring_recv_copy(p, next, buffer + n);
+			n += next->res;
+			next->user_data = UR_DATA(UR_IGNORE, 0, 0);
+		}
+	}
+	if (halfclose_read(s)) {
+		// discard recv data
+		FREE(buffer);
+		return -1;
+	}
+	stat_read(ss,s,n);
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
+// the completion of multishot accept
+static int
+uring_accept(struct socket_server *ss, struct socket_poller *p, struct io_uring_cqe *cqe, struct socket *s, bool valid, int gen, struct socket_message *result) {
+	int client_fd = cqe->res;
+	if (!(cqe->flags & IORING_CQE_F_MORE) && valid && s->uring_accept && gen == s->uring_gen) {
+		if (client_fd != -ECANCELED) {
+			su_accept(&p->uring, s->fd, UR_DATA(UR_ACCEPT, gen, s->id));
+		} else {
+			s->uring_accept = false;
+		}
+	}
+	if (!valid || ATOM_LOAD(&s->type) != SOCKET_TYPE_LISTEN) {
+		if (client_fd >= 0)
+			close(client_fd);
+		return -1;
+	}
+	int ok;
+	if (client_fd < 0) {
+		ok = report_accept_error(ss, s, -client_fd, result);
+	} else {
+		union sockaddr_all u;
+		socklen_t len = sizeof(u);
+		if (getpeername(client_fd, &u.s, &len) != 0) {
+			u.s.sa_family = AF_UNSPEC;
+		}
+		ok = accept_socket(ss, s, client_fd, &u, result);
+	}
+	if (ok > 0) {
+		return SOCKET_ACCEPT;
+	} else if (ok < 0) {
+		return SOCKET_ERR;
+	}
+	return -1;
+}
+
+// return the type of the message, -1 for nothing, or UR_PASS when the poll event is translated into e for the epoll way.
+static int
+uring_event(struct socket_server *ss, struct socket_poller *p, struct event *e, struct io_uring_cqe *cqe, struct socket_message *result) {
+	uint64_t ud = cqe->user_data;
+	int op = (int)(ud >> 48);
+	int gen = (int)(ud >> 32) & 0xffff;
+	int id = (int)(uint32_t)ud;
+	if (op == 0) {
+		// the event is dispatched again (See SOCKET_MORE)
+		return UR_PASS;
+	}
+	cqe->user_data = 0;
+	switch (op) {
+	case UR_DOORBELL:
+		doorbell_drain(p);
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			su_poll(&p->uring, p->recvctrl_fd, ud, POLLIN);
+		return -1;
+	case UR_IGNORE:
+		return -1;
+	}
+	struct socket *s = &ss->slot[HASH_ID(id)];
+	int type = ATOM_LOAD(&s->type);
+	// the completions of a closed socket are dropped
+	bool valid = s->id == id && type != SOCKET_TYPE_INVALID && type != SOCKET_TYPE_RESERVE;
+	switch (op) {
+	case UR_RECV:
+		return uring_forward_tcp(ss, p, cqe, s, valid, gen, result);
+	case UR_ACCEPT:
+		return uring_accept(ss, p, cqe, s, valid, gen, result);
+	case UR_POLL: {
+		if (!valid)
+			return -1;
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			su_poll(&p->uring, s->fd, ud, s->uring_events);
+		}
+		if (cqe->res < 0)
+			return -1;
+		unsigned events = cqe->res;
+		e->s = s;
+		// the poll events may be out of date, they are filtered by the current state
+		e->read = (events & POLLIN) && (s->uring_events & POLLIN);
+		e->write = (events & POLLOUT) && s->writing;
+		// multishot recv reports the error and eof itself
+		e->error = !s->uring_recv && (events & POLLERR);
+		e->eof = !s->uring_recv && (events & POLLHUP);
+		if (e->read || e->write || e->error || e->eof)
+			return UR_PASS;
+		return -1;
+	}
+	}
+	return -1;
+}
+
+#endif
+
 static inline void
-clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
+clear_closed_event(struct socket_poller *p, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERR) {
 		int id = result->id;
 		int i;
-		for (i=ss->event_index; i<ss->event_n; i++) {
-			struct event *e = &ss->ev[i];
+		for (i=p->event_index; i<p->event_n; i++) {
+			struct event *e = &p->ev[i];
 			struct socket *s = e->s;
 			if (s) {
 				if (socket_invalid(s, id) && s->id == id) {
@@ -1719,28 +2225,51 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 // return type
 int
 socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+	return socket_server_poll_loop(ss, 0, result, more);
+}
+
+int
+socket_server_poll_loop(struct socket_server *ss, int index, struct socket_message * result, int * more) {
+	struct socket_poller *p = &ss->poller[index];
 	for (;;) {
-		if (ss->checkctrl) {
-			if (has_cmd(ss)) {
-				int type = ctrl_cmd(ss, result);
+		if (p->checkctrl) {
+			if (has_cmd(p)) {
+				int type = ctrl_cmd(ss, p, result);
 				if (type != -1) {
-					clear_closed_event(ss, result, type);
+					clear_closed_event(p, result, type);
 					return type;
 				} else
 					continue;
 			} else {
-				ss->checkctrl = 0;
+				p->checkctrl = 0;
 			}
 		}
-		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
-			ss->checkctrl = 1;
+		if (p->event_index == p->event_n) {
+			// announce the sleep before the last check of the ring, so a producer either sees it or its command is seen here
+			ATOM_STORE(&p->sleeping, 1);
+			if (has_cmd(p)) {
+				ATOM_STORE(&p->sleeping, 0);
+				p->checkctrl = 1;
+				// a new batch as sp_wait returns, the socket thread wakes up a worker for it
+				if (more) {
+					*more = 0;
+				}
+				continue;
+			}
+#ifdef USE_IO_URING
+			if (poller_uring(p))
+				p->event_n = su_wait(&p->uring, p->cqe, MAX_EVENT);
+			else
+#endif
+			p->event_n = sp_wait(p->event_fd, p->ev, MAX_EVENT);
+			ATOM_STORE(&p->sleeping, 0);
+			p->checkctrl = 1;
 			if (more) {
 				*more = 0;
 			}
-			ss->event_index = 0;
-			if (ss->event_n <= 0) {
-				ss->event_n = 0;
+			p->event_index = 0;
+			if (p->event_n <= 0) {
+				p->event_n = 0;
 				int err = errno;
 				if (err != EINTR) {
 					skynet_error(NULL, "socket-server error: %s", strerror(err));
@@ -1748,10 +2277,20 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				continue;
 			}
 		}
-		struct event *e = &ss->ev[ss->event_index++];
+		struct event *e = &p->ev[p->event_index++];
+#ifdef USE_IO_URING
+		if (poller_uring(p)) {
+			int type = uring_event(ss, p, e, &p->cqe[p->event_index - 1], result);
+			if (type == -1)
+				continue;
+			if (type != UR_PASS)
+				return type;
+		}
+#endif
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// the doorbell, the ring is drained at beginning
+			doorbell_drain(p);
 			continue;
 		}
 		struct socket_lock l;
@@ -1778,21 +2317,21 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				if (s->protocol == PROTOCOL_TCP) {
 					type = forward_message_tcp(ss, s, &l, result);
 					if (type == SOCKET_MORE) {
-						--ss->event_index;
+						--p->event_index;
 						return SOCKET_DATA;
 					}
 				} else {
 					type = forward_message_udp(ss, s, &l, result);
 					if (type == SOCKET_UDP) {
 						// try read again
-						--ss->event_index;
+						--p->event_index;
 						return SOCKET_UDP;
 					}
 				}
 				if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERR) {
 					// Try to dispatch write message next step if write flag set.
 					e->read = false;
-					--ss->event_index;
+					--p->event_index;
 				}
 				if (type == -1)
 					break;
@@ -1832,24 +2371,48 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
+// Bounded MPSC ring (Vyukov) : a producer claims the slot of ctrl_tail when the seq of the cell equals the position,
+// and publishes it by seq = position + 1. The poller consumes the cell and passes it to the next round by seq = position + CTRL_RING_SIZE.
 static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	const char * req = (const char *)request + offsetof(struct request_package, header[6]);
+poller_request(struct socket_poller *p, struct request_package *request, char type, int len) {
+	struct ctrl_cell *c;
+	size_t pos = ATOM_LOAD(&p->ctrl_tail);
 	for (;;) {
-		ssize_t n = write(ss->sendctrl_fd, req, len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				skynet_error(NULL, "socket-server : send ctrl command error %s.", strerror(errno));
-			}
-			continue;
+		c = &p->ctrl[pos & (CTRL_RING_SIZE - 1)];
+		size_t seq = ATOM_LOAD(&c->seq);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (ATOM_CAS_SIZET(&p->ctrl_tail, pos, pos + 1))
+				break;
+		} else if (dif < 0) {
+			// the ring is full, wait for the poller like a full pipe
+			sched_yield();
+		}
+		pos = ATOM_LOAD(&p->ctrl_tail);
+	}
+	c->type = (uint8_t)type;
+	c->len = (uint8_t)len;
+	memcpy(c->buffer, &request->u, len);
+	ATOM_STORE(&c->seq, pos + 1);
+	if (ATOM_LOAD(&p->sleeping) && ATOM_CAS(&p->sleeping, 1, 0)) {
+		uint64_t one = 1;
+		for (;;) {
+			// eventfd needs 8 bytes, a pipe doorbell takes them too
+			ssize_t n = write(p->sendctrl_fd, &one, sizeof(one));
+			if (n < 0 && errno == EINTR)
+				continue;
+			// EAGAIN : the doorbell is ringing already
+			return;
 		}
-		assert(n == len+2);
-		return;
 	}
 }
 
+static void
+send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
+	// every request begins with the socket id
+	poller_request(id_poller(ss, request->u.send.id), request, type, len);
+}
+
 static int
 open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port) {
 	int len = strlen(addr);
@@ -1989,9 +2552,12 @@ socket_server_send_lowpriority(struct socket_server *ss, struct socket_sendbuffe
 
 void
 socket_server_exit(struct socket_server *ss) {
-	struct request_package request;
-	request_init(&request);
-	send_request(ss, &request, 'X', 0);
+	int i;
+	for (i=0;i<ss->poller_n;i++) {
+		struct request_package request;
+		request_init(&request);
+		poller_request(&ss->poller[i], &request, 'X', 0);
+	}
 }
 
 void
@@ -28,9 +28,14 @@ struct socket_message {
 };
 
 struct socket_server * socket_server_create(uint64_t time);
+// the sockets are sharded by id into pollers, run socket_server_poll_loop of each poller in its own thread
+// uring : use io_uring instead of epoll when it's built with USE_IO_URING and the kernel supports it
+struct socket_server * socket_server_create_pollers(uint64_t time, int pollers, int uring);
+int socket_server_pollers(struct socket_server *);
 void socket_server_release(struct socket_server *);
 void socket_server_updatetime(struct socket_server *, uint64_t time);
-int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
+int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);	// the poller 0
+int socket_server_poll_loop(struct socket_server *, int index, struct socket_message *result, int *more);
 
 void socket_server_exit(struct socket_server *);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
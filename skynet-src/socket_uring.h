@@ -0,0 +1,329 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+// The io_uring backend of socket_server (build with -DUSE_IO_URING), by raw syscalls without liburing.
+// It needs linux 6.3+ (multishot recv and the provided buffer ring), su_create fails on older kernel.
+// All the functions are called by the thread of the poller only, the sqes are queued and submitted by su_wait.
+
+#include "skynet_malloc.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#define SU_ENTRIES 4096
+#define SU_BUFFER_SIZE 8192
+#define SU_BUFFER_N 256	// must be power of 2
+#define SU_BUFFER_GROUP 0
+
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_pending;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	struct io_uring_buf_ring *br;
+	size_t br_sz;
+	char *buffer;
+	unsigned short br_tail;
+	bool disabled;
+	// the sqes queued when the sq is full and can't be submitted (the cq overflows), see su_sqe
+	struct io_uring_sqe *backlog;
+	int backlog_n;
+	int backlog_cap;
+};
+
+static inline int
+su_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static void
+su_release(struct uring *u) {
+	skynet_free(u->backlog);
+	if (u->buffer)
+		munmap(u->buffer, SU_BUFFER_SIZE * SU_BUFFER_N);
+	if (u->br)
+		munmap(u->br, u->br_sz);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_sz);
+	if (u->fd >= 0)
+		close(u->fd);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+static void
+su_buffer_return(struct uring *u, int bid) {
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (SU_BUFFER_N - 1)];
+	b->addr = (uint64_t)(uintptr_t)(u->buffer + (size_t)bid * SU_BUFFER_SIZE);
+	b->len = SU_BUFFER_SIZE;
+	b->bid = (uint16_t)bid;
+	++u->br_tail;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static inline const char *
+su_buffer(struct uring *u, int bid) {
+	return u->buffer + (size_t)bid * SU_BUFFER_SIZE;
+}
+
+static int
+su_buffer_init(struct uring *u) {
+	u->br_sz = SU_BUFFER_N * sizeof(struct io_uring_buf);
+	void *br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (br == MAP_FAILED)
+		return 1;
+	u->br = br;
+	void *buffer = mmap(NULL, SU_BUFFER_SIZE * SU_BUFFER_N, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (buffer == MAP_FAILED)
+		return 1;
+	u->buffer = buffer;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)br;
+	reg.ring_entries = SU_BUFFER_N;
+	reg.bgid = SU_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return 1;
+	int i;
+	for (i=0;i<SU_BUFFER_N;i++) {
+		su_buffer_return(u, i);
+	}
+	return 0;
+}
+
+// return 1 when io_uring is unavailable
+static int
+su_create(struct uring *u) {
+	memset(u, 0, sizeof(*u));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	// the ring is enabled by the first su_wait, so the poller thread is the single issuer
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+	u->fd = (int)syscall(__NR_io_uring_setup, SU_ENTRIES, &p);
+	if (u->fd < 0)
+		goto _failed;
+	if (!(p.features & IORING_FEAT_LINKED_FILE) || !(p.features & IORING_FEAT_NODROP)) {
+		// older than 6.3, no multishot recv
+		goto _failed;
+	}
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+	void *sq = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto _failed;
+	u->sq_ring = sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = sq;
+	} else {
+		void *cq = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto _failed;
+		u->cq_ring = cq;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto _failed;
+	u->sqes = sqes;
+	char *sqr = u->sq_ring;
+	char *cqr = u->cq_ring;
+	u->sq_head = (unsigned *)(sqr + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sqr + p.sq_off.tail);
+	u->sq_array = (unsigned *)(sqr + p.sq_off.array);
+	u->sq_mask = *(unsigned *)(sqr + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned *)(cqr + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cqr + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cqr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cqr + p.cq_off.cqes);
+	if (su_buffer_init(u))
+		goto _failed;
+	u->disabled = true;
+	return 0;
+_failed:
+	su_release(u);
+	return 1;
+}
+
+// submit the queued sqes, and wait for one cqe at least when wait is true
+static int
+su_submit(struct uring *u, bool wait) {
+	for (;;) {
+		int n = su_enter(u->fd, u->sq_pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+		if (n < 0) {
+			if (errno == EBUSY && !wait) {
+				// the cq overflows, the sqes are submitted by su_wait later
+				return 0;
+			}
+			return -1;
+		}
+		u->sq_pending -= n;
+		if (u->sq_pending == 0 || wait)
+			return 0;
+	}
+}
+
+// a free entry of sq, NULL if the sq is still full after submitting
+static struct io_uring_sqe *
+su_sq_next(struct uring *u) {
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		su_submit(u, false);
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+			return NULL;
+	}
+	unsigned index = tail & u->sq_mask;
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++u->sq_pending;
+	return &u->sqes[index];
+}
+
+// The sq is full only if the last submit got EBUSY : the cq overflows, and the kernel takes no more sqes
+// until the poller reaps the cqes. Waiting here would deadlock, so the sqes go to the backlog (in order),
+// and su_wait moves them to the sq after the cqes are reaped.
+static struct io_uring_sqe *
+su_sqe(struct uring *u) {
+	struct io_uring_sqe *sqe = u->backlog_n == 0 ? su_sq_next(u) : NULL;
+	if (sqe == NULL) {
+		if (u->backlog_n >= u->backlog_cap) {
+			u->backlog_cap = u->backlog_cap ? u->backlog_cap * 2 : 64;
+			u->backlog = skynet_realloc(u->backlog, u->backlog_cap * sizeof(struct io_uring_sqe));
+		}
+		sqe = &u->backlog[u->backlog_n++];
+	}
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void
+su_backlog(struct uring *u) {
+	int i;
+	for (i=0;i<u->backlog_n;i++) {
+		struct io_uring_sqe *sqe = su_sq_next(u);
+		if (sqe == NULL)
+			break;
+		*sqe = u->backlog[i];
+	}
+	u->backlog_n -= i;
+	memmove(u->backlog, u->backlog + i, u->backlog_n * sizeof(struct io_uring_sqe));
+}
+
+// multishot poll
+static void
+su_poll(struct uring *u, int fd, uint64_t ud, unsigned events) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = events;
+	sqe->user_data = ud;
+}
+
+// change the events of the poll of ud, the result goes to result_ud
+static void
+su_poll_update(struct uring *u, uint64_t ud, unsigned events, uint64_t result_ud) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = ud;
+	sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = events;
+	sqe->user_data = result_ud;
+}
+
+// multishot recv into the provided buffers
+static void
+su_recv(struct uring *u, int fd, uint64_t ud) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = SU_BUFFER_GROUP;
+	sqe->user_data = ud;
+}
+
+// multishot accept, the new fd is nonblocking
+static void
+su_accept(struct uring *u, int fd, uint64_t ud) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = ud;
+}
+
+static void
+su_cancel(struct uring *u, uint64_t ud, uint64_t result_ud) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ud;
+	sqe->user_data = result_ud;
+}
+
+// submit the queued sqes, wait when the cq is empty, and copy the cqes out.
+static int
+su_wait(struct uring *u, struct io_uring_cqe *cqe, int max) {
+	if (u->disabled) {
+		if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+			return -1;
+		u->disabled = false;
+	}
+	if (u->backlog_n > 0) {
+		// the cqes are reaped by the last su_wait
+		su_backlog(u);
+	}
+	unsigned head = *u->cq_head;
+	bool wait = head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	if ((wait || u->sq_pending) && su_submit(u, wait)) {
+		if (errno != EBUSY)
+			return -1;
+	}
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int n = 0;
+	while (head != tail && n < max) {
+		cqe[n++] = u->cqes[head & u->cq_mask];
+		++head;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	if (n == 0) {
+		errno = EINTR;
+		return -1;
+	}
+	return n;
+}
+
+#endif
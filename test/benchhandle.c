@@ -0,0 +1,158 @@
+// Benchmark of skynet_handle_grab while services are spawned and retired.
+// Build with `make benchhandle`, usage : test/benchhandle [services] [reader threads]
+// The spawner registers the services (100k by default) one by one, the slot array doubles
+// up to the next power of 2, and retires them in the end. The readers grab random live handles
+// meanwhile, and report the lookups/s and the longest stall of a batch of lookups.
+// Each service is named before the retirement, to time skynet_handle_namehandle and skynet_handle_findname.
+
+#include "skynet.h"
+#include "skynet_handle.h"
+#include "skynet_server.h"
+#include "atomic.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_SERVICES 100000
+#define DEFAULT_READERS 4
+#define BATCH 256
+
+struct skynet_context {
+	uint32_t handle;
+	ATOM_INT ref;
+};
+
+// skynet_handle.c dependencies
+
+uint32_t
+skynet_context_handle(struct skynet_context *ctx) {
+	return ctx->handle;
+}
+
+void
+skynet_context_grab(struct skynet_context *ctx) {
+	ATOM_FINC(&ctx->ref);
+}
+
+void
+skynet_context_release(struct skynet_context *ctx) {
+	if (ATOM_FDEC(&ctx->ref) == 1) {
+		skynet_free(ctx);
+	}
+}
+
+struct reader {
+	pthread_t pid;
+	uint64_t lookups;
+	uint64_t found;
+	uint64_t stall;
+};
+
+static ATOM_INT QUIT;
+static ATOM_INT LIVE;	// the handles [1, LIVE] are registered
+
+static uint64_t
+gettime() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+static void *
+reader(void *p) {
+	struct reader *r = p;
+	skynet_handle_register_thread();
+	uint32_t x = (uint32_t)(uintptr_t)r | 1;
+	uint64_t last = gettime();
+	while (!ATOM_LOAD(&QUIT)) {
+		int i;
+		for (i=0;i<BATCH;i++) {
+			x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+			int live = ATOM_LOAD(&LIVE);
+			uint32_t handle = live > 0 ? x % live + 1 : 1;
+			struct skynet_context *ctx = skynet_handle_grab(handle);
+			if (ctx) {
+				++r->found;
+				skynet_context_release(ctx);
+			}
+		}
+		r->lookups += BATCH;
+		uint64_t now = gettime();
+		if (now - last > r->stall) {
+			r->stall = now - last;
+		}
+		last = now;
+	}
+	return NULL;
+}
+
+int
+main(int argc, char *argv[]) {
+	int services = argc > 1 ? atoi(argv[1]) : DEFAULT_SERVICES;
+	int readers = argc > 2 ? atoi(argv[2]) : DEFAULT_READERS;
+	skynet_handle_init(0, readers);
+	skynet_handle_register_thread();
+	ATOM_INIT(&QUIT, 0);
+	ATOM_INIT(&LIVE, 0);
+
+	struct reader *r = calloc(readers, sizeof(*r));
+	int i;
+	for (i=0;i<readers;i++) {
+		pthread_create(&r[i].pid, NULL, reader, &r[i]);
+	}
+
+	uint64_t start = gettime();
+	for (i=0;i<services;i++) {
+		struct skynet_context *ctx = skynet_malloc(sizeof(*ctx));
+		ATOM_INIT(&ctx->ref, 1);
+		ctx->handle = skynet_handle_register(ctx);
+		ATOM_STORE(&LIVE, ctx->handle);
+	}
+	uint64_t spawn = gettime() - start;
+	char name[32];
+	start = gettime();
+	for (i=1;i<=services;i++) {
+		snprintf(name, sizeof(name), "player%d", i);
+		skynet_handle_namehandle(i, name);
+	}
+	uint64_t namehandle = gettime() - start;
+	start = gettime();
+	for (i=1;i<=services;i++) {
+		snprintf(name, sizeof(name), "player%d", i);
+		if (skynet_handle_findname(name) != i) {
+			fprintf(stderr, "findname %s failed\n", name);
+			exit(1);
+		}
+	}
+	uint64_t findname = gettime() - start;
+	start = gettime();
+	for (i=services;i>0;i--) {
+		ATOM_STORE(&LIVE, i - 1);
+		skynet_handle_retire(i);
+	}
+	uint64_t retire = gettime() - start;
+	uint64_t total = spawn + namehandle + findname + retire;
+
+	ATOM_STORE(&QUIT, 1);
+	uint64_t lookups = 0, found = 0, stall = 0;
+	for (i=0;i<readers;i++) {
+		pthread_join(r[i].pid, NULL);
+		lookups += r[i].lookups;
+		found += r[i].found;
+		if (r[i].stall > stall)
+			stall = r[i].stall;
+	}
+	printf("services = %d readers = %d spawn = %.3fs (%.2f us/service) retire = %.3fs\n",
+		services, readers, (double)spawn / 1e9, (double)spawn / 1e3 / services, (double)retire / 1e9);
+	printf("lookups = %" PRIu64 " (%.2f M/s, %.1f%% found) longest stall of %d lookups = %.1f us\n",
+		lookups, (double)lookups / ((double)total / 1e3), lookups ? 100.0 * found / lookups : 0.0,
+		BATCH, (double)stall / 1e3);
+	printf("namehandle = %.3fs (%.2f us/name) findname = %.3fs (%.2f us/name)\n",
+		(double)namehandle / 1e9, (double)namehandle / 1e3 / services,
+		(double)findname / 1e9, (double)findname / 1e3 / services);
+	free(r);
+	return 0;
+}
@@ -0,0 +1,66 @@
+-- Allocation benchmark of lua services, for the allocator of snlua (luaslab).
+-- Run it with start = "benchlalloc" in config, and compare luaslab = true with the default.
+
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill and skynet.abort
+
+local SERVICE = 8
+local ROUND = 50
+
+local mode = ...
+
+local function churn()
+	-- small strings, closures and tables, most of them die young
+	local keep = {}
+	for i = 1, 10000 do
+		local s = "key" .. i
+		local t = { s, i, x = i, y = s }
+		local f = function() return t end
+		keep[i % 256 + 1] = { f, s .. "!" }
+	end
+	return keep
+end
+
+if mode == "worker" then
+	skynet.start(function()
+		skynet.dispatch("lua", function()
+			local start = skynet.hpc()
+			for i = 1, ROUND do
+				churn()
+			end
+			skynet.ret(skynet.pack((skynet.hpc() - start) / 1e9, collectgarbage "count"))
+		end)
+	end)
+	return
+end
+
+skynet.start(function()
+	local worker = {}
+	for i = 1, SERVICE do
+		worker[i] = skynet.newservice(SERVICE_NAME, "worker")
+	end
+	local co = coroutine.running()
+	local done = 0
+	local cost, mem = 0, 0
+	local start = skynet.hpc()
+	for i = 1, SERVICE do
+		skynet.fork(function()
+			local t, m = skynet.call(worker[i], "lua")
+			cost = cost + t
+			mem = mem + m
+			done = done + 1
+			if done == SERVICE then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local t = (skynet.hpc() - start) / 1e9
+	print(string.format("luaslab = %s thread = %s", skynet.getenv "luaslab", skynet.getenv "thread"))
+	print(string.format("%d services x %d rounds in %.3fs, %.3fs per service, %.0fK lua memory",
+		SERVICE, ROUND, t, cost / SERVICE, mem / SERVICE))
+	for i = 1, SERVICE do
+		skynet.kill(worker[i])
+	end
+	skynet.abort()
+end)
@@ -0,0 +1,64 @@
+-- Error storm benchmark of skynet.error, for the logger service and the async logger (logbuffer).
+-- Run it with start = "benchlog" and logger = "<file>" in config, and compare logbuffer = 1048576 with the default.
+
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill and skynet.abort
+
+local SERVICE = 8
+local LINES = 50000
+
+local mode = ...
+
+if mode == "worker" then
+	skynet.start(function()
+		skynet.dispatch("lua", function()
+			for i = 1, LINES do
+				skynet.error("error storm", i, "a message of an ordinary length from a busy service")
+			end
+			skynet.ret()
+		end)
+	end)
+	return
+end
+
+skynet.start(function()
+	local worker = {}
+	for i = 1, SERVICE do
+		worker[i] = skynet.newservice(SERVICE_NAME, "worker")
+	end
+	local co = coroutine.running()
+	local done = 0
+	local start = skynet.hpc()
+	for i = 1, SERVICE do
+		skynet.fork(function()
+			skynet.call(worker[i], "lua")
+			done = done + 1
+			if done == SERVICE then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local t = (skynet.hpc() - start) / 1e9
+	-- wait the log file stops growing
+	local filename = assert(skynet.getenv "logger", "set logger to a file")
+	local size
+	repeat
+		local f = io.open(filename)
+		local last = size
+		size = f:seek "end"
+		f:close()
+		skynet.sleep(20)
+	until size == last
+	local written = (skynet.hpc() - start) / 1e9 - 0.2
+	local f = io.open "/proc/self/status"
+	local rss = f and f:read "a":match "VmHWM:%s*(%d+)"
+	if f then f:close() end
+	print(string.format("logbuffer = %s thread = %s", skynet.getenv "logbuffer", skynet.getenv "thread"))
+	print(string.format("%d lines : logged in %.3fs (%.0f lines/s), written in %.3fs, peak rss %sK",
+		SERVICE * LINES, t, SERVICE * LINES / t, written, rss))
+	for i = 1, SERVICE do
+		skynet.kill(worker[i])
+	end
+	skynet.abort()
+end)
@@ -0,0 +1,94 @@
+// Benchmark of message_queue push/pop with multiple producers.
+// Build with `make benchmq`, it builds the spinlock version and the lock free version (USE_LOCKFREE_MQ).
+
+#include "skynet_mq.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MESSAGES 4000000
+
+struct bench {
+	struct message_queue *q;
+	int producer;
+	int count;
+};
+
+static uint64_t
+gettime() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+static void *
+producer(void *p) {
+	struct bench *b = p;
+	struct skynet_message msg;
+	msg.source = 0;
+	msg.session = 0;
+	msg.data = NULL;
+	msg.sz = 0;
+	int i;
+	for (i=0;i<b->count;i++) {
+		msg.session = i;
+		skynet_mq_push(b->q, &msg);
+	}
+	return NULL;
+}
+
+// consume like a worker thread, pop the queue from global queue and drain it.
+static int
+consume(int total) {
+	struct skynet_message msg;
+	int n = 0;
+	while (n < total) {
+		struct message_queue *q = skynet_globalmq_pop();
+		if (q == NULL)
+			continue;
+		while (!skynet_mq_pop(q, &msg)) {
+			++n;
+		}
+	}
+	return n;
+}
+
+static void
+run(int nproducer) {
+	struct bench b;
+	b.q = skynet_mq_create(1);
+	b.producer = nproducer;
+	b.count = MESSAGES / nproducer;
+	// skynet_mq_create set in_global, clear it as skynet_context_new does.
+	skynet_globalmq_push(b.q);
+
+	pthread_t pid[nproducer];
+	uint64_t start = gettime();
+	int i;
+	for (i=0;i<nproducer;i++) {
+		pthread_create(&pid[i], NULL, producer, &b);
+	}
+	int n = consume(b.count * nproducer);
+	for (i=0;i<nproducer;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	uint64_t t = gettime() - start;
+	printf("%-9s producer = %2d messages = %d time = %.3fs (%.2f M/s)\n",
+#ifdef USE_LOCKFREE_MQ
+		"lockfree",
+#else
+		"spinlock",
+#endif
+		nproducer, n, (double)t / 1e9, (double)n / ((double)t / 1e3));
+}
+
+int
+main() {
+	skynet_mq_init(0, 0);
+	run(1);
+	run(8);
+	run(64);
+	return 0;
+}
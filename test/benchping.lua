@@ -0,0 +1,44 @@
+-- Throughput benchmark on pingserver, for worker scheduling options (workstealing, softaffinity, cpuaffinity).
+-- Run it with different config, and measure cache misses with perf, for example :
+--   perf stat -e cache-misses,cache-references,instructions ./skynet examples/config.benchping
+-- The config sets start = "benchping", and thread / workstealing / softaffinity / cpuaffinity to compare.
+
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+local snax = require "skynet.snax"
+
+local SERVER = 16
+local CLIENT = 64
+local ROUND = 2000
+
+skynet.start(function()
+	local server = {}
+	for i = 1, SERVER do
+		server[i] = snax.newservice("pingserver", "bench")
+	end
+	local co = coroutine.running()
+	local done = 0
+	local start = skynet.hpc()
+	for i = 1, CLIENT do
+		skynet.fork(function()
+			for j = 1, ROUND do
+				local ps = server[(i + j) % SERVER + 1]
+				assert(ps.req.echo(j) == j)
+			end
+			done = done + 1
+			if done == CLIENT then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait(co)
+	local t = (skynet.hpc() - start) / 1e9
+	local n = CLIENT * ROUND
+	print(string.format("thread = %s workstealing = %s softaffinity = %s cpuaffinity = %s",
+		skynet.getenv "thread", skynet.getenv "workstealing", skynet.getenv "softaffinity", skynet.getenv "cpuaffinity"))
+	print(string.format("%d calls in %.3fs, %.0f calls/s", n, t, n / t))
+	for i = 1, SERVER do
+		snax.kill(server[i])
+	end
+	skynet.abort()
+end)
@@ -0,0 +1,223 @@
+// Benchmark of the record replay reader, messages/s parsed and pushed.
+// Build with `make benchrecord`, usage : test/benchrecord [size in MB] [record file]
+// It writes a record file of the size (2048 MB by default) and replays it with
+//	legacy : the stdio reader before record_reader (fread each field, ftell/fseek each record)
+//	stdio : record_reader without mmap
+//	mmap : record_reader mapping the file
+
+#include "skynet.h"
+#include "skynet_server.h"
+#include "skynet_mq.h"
+#include "skynet_record.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SIZE 2048
+#define PAYLOAD_MAX 512
+
+static uint64_t MESSAGES = 0;
+static uint64_t BYTES = 0;
+
+// skynet_record.c dependencies, the benchmark consumes the messages itself
+
+void
+skynet_error(struct skynet_context * context, const char *msg, ...) {
+	va_list ap;
+	va_start(ap, msg);
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+int
+skynet_context_push(uint32_t handle, struct skynet_message *message) {
+	++MESSAGES;
+	BYTES += message->sz & MESSAGE_TYPE_MASK;
+	skynet_free(message->data);
+	return 0;
+}
+
+const char * skynet_getenv(const char *key) { return NULL; }
+uint64_t skynet_now(void) { return 0; }
+uint32_t skynet_starttime(void) { return 0; }
+void skynet_timer_setcurrent(uint64_t current) {}
+void skynet_timer_setstarttime(uint32_t starttime) {}
+int skynet_record_check_limit(struct skynet_context * ctx) { return 1; }
+void skynet_record_add_limit_count(struct skynet_context * ctx, size_t len) {}
+void skynet_record_push_session(int session) {}
+void skynet_record_push_handle(uint32_t handle) {}
+void skynet_record_push_socketid(int id) {}
+void skynet_record_push_mathseek(int64_t x, int64_t y) {}
+void skynet_record_push_ostime(uint32_t ostime) {}
+void skynet_record_push_nowtime(int64_t now) {}
+
+static uint64_t
+gettime() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+// a timer wakeup : 'm' with payload, followed by 'n' and 's' like skynet.sleep
+static void
+generate(const char *filename, size_t size) {
+	FILE *f = fopen(filename, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s\n", filename);
+		exit(1);
+	}
+	char payload[PAYLOAD_MAX];
+	memset(payload, 'x', sizeof(payload));
+	fwrite(SKYNET_RECORD_VERSION, sizeof(SKYNET_RECORD_VERSION) - 1, 1, f);
+	size_t total = 0;
+	uint32_t source = 0;
+	int type = PTYPE_RESPONSE;
+	int session = 0;
+	uint64_t ti = 0;
+	srand(0);
+	while (total < size) {
+		size_t sz = rand() % PAYLOAD_MAX;
+		++session;
+		++ti;
+		fputc('m', f);
+		fwrite(&source, sizeof(source), 1, f);
+		fwrite(&type, sizeof(type), 1, f);
+		fwrite(&session, sizeof(session), 1, f);
+		fwrite(&ti, sizeof(ti), 1, f);
+		fwrite(&sz, sizeof(sz), 1, f);
+		fwrite(payload, sz, 1, f);
+		fputc('n', f);
+		fwrite(&ti, sizeof(ti), 1, f);
+		int next = session + 1;
+		fputc('s', f);
+		fwrite(&next, sizeof(next), 1, f);
+		total += 1 + 28 + sz + 9 + 5;
+	}
+	fclose(f);
+}
+
+static uint64_t
+legacy_number(FILE *f, size_t len) {
+	uint64_t value = 0;
+	if (fread(&value, len, 1, f) != 1) {
+		return 0;
+	}
+	return value;
+}
+
+static void
+replay_legacy(const char *filename) {
+	FILE *f = fopen(filename, "rb");
+	char version[sizeof(SKYNET_RECORD_VERSION)];
+	if (fgets(version, sizeof(version), f) == NULL)
+		return;
+	char type;
+	while (fread(&type, sizeof(type), 1, f) == 1) {
+		fseek(f, -sizeof(type), SEEK_CUR);
+		long cur = ftell(f);
+		(void)cur;
+		int is_msg = 0;
+		while (fread(&type, sizeof(type), 1, f) == 1) {
+			if (is_msg && type == 'm') {
+				fseek(f, -sizeof(type), SEEK_CUR);
+				break;
+			}
+			switch (type) {
+			case 'm': {
+				struct skynet_message message;
+				message.source = (uint32_t)legacy_number(f, 4);
+				int type = (int)legacy_number(f, 4);
+				message.session = (int)legacy_number(f, 4);
+				legacy_number(f, 8);
+				size_t sz = (size_t)legacy_number(f, 8);
+				message.data = skynet_malloc(sz);
+				if (sz > 0 && fread(message.data, sz, 1, f) != 1) {
+					skynet_free(message.data);
+					break;
+				}
+				message.sz = sz | ((size_t)type << MESSAGE_TYPE_SHIFT);
+				skynet_context_push(1, &message);
+				is_msg = 1;
+				break;
+			}
+			case 'n':
+				skynet_record_push_nowtime(legacy_number(f, 8) * 10);
+				break;
+			case 's':
+				skynet_record_push_session((int)legacy_number(f, 4));
+				break;
+			}
+		}
+	}
+	fclose(f);
+}
+
+static void
+replay_reader(const char *filename, int usemmap) {
+	struct record_reader *r = skynet_record_reader_open(filename, usemmap);
+	char version[sizeof(SKYNET_RECORD_VERSION) - 1];
+	skynet_record_reader_read(r, version, sizeof(version));
+	int type;
+	while (skynet_record_reader_peek(r) != EOF) {
+		size_t cur = skynet_record_reader_tell(r);
+		(void)cur;
+		int is_msg = 0;
+		while ((type = skynet_record_reader_peek(r)) != EOF) {
+			if (is_msg && type == 'm')
+				break;
+			char c;
+			skynet_record_reader_read(r, &c, 1);
+			switch (type) {
+			case 'm': {
+				struct record_message msg;
+				if (skynet_record_parse_output(r, 1, &msg)) {
+					skynet_record_push_message(&msg);
+				}
+				is_msg = 1;
+				break;
+			}
+			case 'n':
+				skynet_record_parse_now(r, 0);
+				break;
+			case 's':
+				skynet_record_parse_newsession(r);
+				break;
+			}
+		}
+	}
+	skynet_record_reader_close(r);
+}
+
+static void
+run(const char *name, const char *filename, int mode) {
+	MESSAGES = 0;
+	BYTES = 0;
+	uint64_t start = gettime();
+	if (mode < 0) {
+		replay_legacy(filename);
+	} else {
+		replay_reader(filename, mode);
+	}
+	uint64_t t = gettime() - start;
+	printf("%-6s messages = %" PRIu64 " payload = %.0f MB time = %.3fs (%.2f M/s)\n",
+		name, MESSAGES, (double)BYTES / (1024 * 1024), (double)t / 1e9, (double)MESSAGES / ((double)t / 1e3));
+}
+
+int
+main(int argc, char *argv[]) {
+	size_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_SIZE) * 1024 * 1024;
+	const char *filename = argc > 2 ? argv[2] : "/tmp/benchrecord.record";
+	generate(filename, size);
+	// the first pass warms the page cache
+	run("legacy", filename, -1);
+	run("legacy", filename, -1);
+	run("stdio", filename, 0);
+	run("mmap", filename, 1);
+	remove(filename);
+	return 0;
+}
@@ -10,6 +10,10 @@ function response.ping(hello)
 	return hello
 end
 
+function response.echo(v)
+	return v
+end
+
 -- response.sleep and accept.hello share one lock
 local lock
 
@@ -0,0 +1,44 @@
+-- Wakeup test of soft affinity : a queue activated by the timer must be delivered at once,
+-- even if the only running worker parks just after the activation.
+-- Run it with start = "testaffinity", workstealing = true, softaffinity = true,
+-- and thread more than the cpus, so a running worker takes the queue (no unpark).
+
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+local ROUND = 1000
+local LATENCY = 5	-- centisecond, a stranded queue waits for the next burn (10 cs)
+
+local mode = ...
+
+if mode == "burn" then
+	skynet.start(function()
+		-- keep another worker running now and then, it parks when the timer may wake the main service
+		skynet.fork(function()
+			local i = 0
+			while true do
+				skynet.sleep(10)
+				i = i + 1
+				local stop = skynet.hpc() + (i % 7 + 1) * 1000000
+				while skynet.hpc() < stop do end
+			end
+		end)
+	end)
+	return
+end
+
+skynet.start(function()
+	skynet.newservice(SERVICE_NAME, "burn")
+	local worst = 0
+	for i = 1, ROUND do
+		local start = skynet.now()
+		skynet.sleep(1)
+		local t = skynet.now() - start
+		if t > worst then
+			worst = t
+		end
+		assert(t < LATENCY, string.format("round %d : wakeup after %d cs", i, t))
+	end
+	print(string.format("testaffinity ok : %d rounds, worst latency %d cs", ROUND, worst))
+	skynet.abort()
+end)
@@ -0,0 +1,42 @@
+-- Replay test of the binary message log (logformat = "binary").
+-- 1. Run it with start = "testbinlog", logformat = "binary" and logpath = "<dir>" in config,
+--    it logs a counter service to <dir>/<handle>.blog and prints BINLOG SUM.
+-- 2. Replay the log with recordfile = [[<dir>/<handle>.blog]] and recordservice = "testbinlog counter",
+--    the counter prints the same BINLOG SUM.
+
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+local core = require "skynet.core"
+
+local mode = ...
+
+if mode == "counter" then
+	local sum = 0
+	skynet.start(function()
+		skynet.dispatch("lua", function(_, _, cmd, v)
+			if cmd == "add" then
+				-- now and timeout run as usual in the replay of a message log
+				assert(skynet.now() > 0)
+				skynet.timeout(0, function() end)
+				sum = sum + v
+			else
+				print("BINLOG SUM", sum)
+				skynet.ret(skynet.pack(sum))
+			end
+		end)
+	end)
+	return
+end
+
+skynet.start(function()
+	local counter = skynet.newservice(SERVICE_NAME, "counter")
+	core.command("LOGON", skynet.address(counter))
+	for i = 1, 100 do
+		skynet.send(counter, "lua", "add", i)
+	end
+	local sum = skynet.call(counter, "lua", "sum")
+	assert(sum == 5050)
+	core.command("LOGOFF", skynet.address(counter))
+	print("log file", string.format("%s/%08x.blog", skynet.getenv "logpath", counter))
+	skynet.abort()
+end)
@@ -30,6 +30,17 @@ skynet.start(function()
 
 	skynet.fork(wakeup, coroutine.running())
 	skynet.timeout(300, function() timeout "Hello World" end)
+	local t = skynet.timeout(200, function() print "canceled timeout should not run" end)
+	print("cancel timeout", skynet.timeout_cancel(t))
+	-- the coroutine of an expired timer is reused by the next one, the stale handle can't cancel it
+	local t1 = skynet.timeout(0, function() end)
+	skynet.sleep(1)
+	local fired = false
+	local t2 = skynet.timeout(10, function() fired = true end)
+	assert(t1 ~= t2)
+	print("cancel expired timeout", skynet.timeout_cancel(t1))
+	skynet.sleep(20)
+	assert(fired, "the stale handle cancels a new timeout")
 	for i = 1, 10 do
 		print(i, skynet.now())
 		print(skynet.sleep(100))